@@ -35,7 +35,7 @@ public:
     }
   }
 
-  AppendableMMap(uint32_t size, const std::string &filename): m_filename(filename), m_size(size) {
+  AppendableMMap(uint64_t size, const std::string &filename): m_filename(filename), m_size(size) {
     int fd = open(filename.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
     if (fd == -1) {
       throw std::system_error(errno, std::system_category());
@@ -56,7 +56,7 @@ public:
     }
   }
 
-  AppendableMMap(uint32_t size): m_size(size) {
+  AppendableMMap(uint64_t size): m_size(size) {
     m_buffer = reinterpret_cast<char *>(mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
     m_tail_index = size - 1;
   }
@@ -73,13 +73,13 @@ public:
     }
   }
 
-  void appendFront(const void *buffer, uint32_t size) {
+  void appendFront(const void *buffer, uint64_t size) {
     assert(size <= free());
     memcpy(m_buffer + m_head_index,  buffer, size);
     m_head_index += size;
   }
 
-  void appendBack(const void *buffer, uint32_t size) {
+  void appendBack(const void *buffer, uint64_t size) {
     assert(size <= free());
     memcpy(m_buffer + m_tail_index - size + 1, buffer, size);
     m_tail_index -= size;
@@ -89,30 +89,39 @@ public:
     delete_file(m_filename);
   }
 
+  // Hints are best effort, failures are ignored
+  void advise(int advice) const {
+    madvise(m_buffer, m_size, advice);
+  }
+
   const char *data() {
     return m_buffer;
   }
 
-  uint32_t size() {
+  const std::string &filename() const {
+    return m_filename;
+  }
+
+  uint64_t size() {
     return m_size;
   }
 
-  uint32_t head_index() {
+  uint64_t head_index() {
     return m_head_index;
   }
 
-  uint32_t tail_index() {
+  uint64_t tail_index() {
     return m_tail_index;
   }
 
 private:
   std::string m_filename;
   char *m_buffer = nullptr;
-  uint32_t m_head_index = 0;
-  uint32_t m_tail_index = 0;
-  uint32_t m_size;
+  uint64_t m_head_index = 0;
+  uint64_t m_tail_index = 0;
+  uint64_t m_size;
 
-  uint32_t free() {
+  uint64_t free() {
     return m_tail_index - m_head_index + 1;
   }
 };
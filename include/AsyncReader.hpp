@@ -0,0 +1,142 @@
+#ifndef ASYNCREADER_H
+#define ASYNCREADER_H
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "BlockCache.hpp"
+#include "IOUring.hpp"
+#include "RandomAccessFile.hpp"
+
+// Reads blocks with io_uring on behalf of the thread that owns it. A dedicated thread
+// waits for completions and hands them back to the owner through post(), so that the
+// owner only ever blocks on its own task queue. All methods but the constructor and
+// destructor must be called by the owner; reads must have completed before destruction.
+class AsyncReader {
+public:
+  // Runs on the owner thread with the exception raised by the read, if any
+  typedef std::function<void(std::exception_ptr)> Callback;
+
+  // Throws a std::system_error if io_uring isn't available
+  AsyncReader(uint32_t depth, std::function<void(std::function<void()>)> post): m_ring(depth),
+                                                                                m_depth(depth),
+                                                                                m_post(post) {
+    m_reaper = std::thread(&AsyncReader::reap, this);
+  }
+
+  ~AsyncReader() {
+    m_ring.nop(0);
+    m_reaper.join();
+  }
+
+  // Starts reading the block; done runs once the block has been completed. Returns false
+  // if too many reads are in flight.
+  bool submit(std::shared_ptr<BlockRead> read, Callback done) {
+    if (m_in_flight >= m_depth) {
+      return false;
+    }
+
+    std::unique_ptr<Request> request(new Request{read, nullptr, 0, done});
+    uint64_t end;
+    read->file->aligned_range(read->offset, read->size, &request->begin, &end);
+    request->buffer = RandomAccessFile::allocate(end - request->begin);
+
+    if (!m_ring.read(read->file->fd(), request->buffer.get(), end - request->begin, request->begin,
+                     reinterpret_cast<uint64_t>(request.get()))) {
+      return false;
+    }
+
+    request.release();
+    m_in_flight++;
+    m_reads.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  uint32_t in_flight() const {
+    return m_in_flight;
+  }
+
+  // Number of reads submitted so far
+  uint64_t reads() const {
+    return m_reads.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Request {
+    std::shared_ptr<BlockRead> read;
+    std::shared_ptr<char> buffer;
+    uint64_t begin;
+    Callback done;
+  };
+
+  // Completions that arrived together are handed over at once
+  void reap() {
+    while (true) {
+      uint64_t user_data;
+      int32_t res;
+      std::vector<std::pair<Request *, int32_t>> completed;
+      bool terminate = false;
+
+      m_ring.wait(&user_data, &res);
+      do {
+        if (user_data == 0) {
+          terminate = true;
+        } else {
+          completed.emplace_back(reinterpret_cast<Request *>(user_data), res);
+        }
+      } while (m_ring.peek(&user_data, &res));
+
+      if (!completed.empty()) {
+        m_post([this, completed]() {
+          for (const auto &request : completed) {
+            complete(std::unique_ptr<Request>(request.first), request.second);
+          }
+        });
+      }
+
+      if (terminate) {
+        return;
+      }
+    }
+  }
+
+  void complete(std::unique_ptr<Request> request, int32_t res) {
+    m_in_flight--;
+
+    std::exception_ptr error;
+    try {
+      auto &read = *request->read;
+      if (res < 0) {
+        throw std::system_error(-res, std::system_category());
+      }
+
+      // Short reads are finished synchronously
+      auto skip = read.offset - request->begin;
+      if (uint64_t(res) < skip + read.size) {
+        read.complete(read.file->read(read.offset, read.size));
+      } else {
+        read.complete(std::shared_ptr<const char>(request->buffer, request->buffer.get() + skip));
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    request->done(error);
+  }
+
+  IOUring m_ring;
+  uint32_t m_depth;
+  uint32_t m_in_flight = 0;
+  std::atomic<uint64_t> m_reads{0};
+  std::function<void(std::function<void()>)> m_post;
+  std::thread m_reaper;
+};
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "RandomAccessFile.hpp"
+
+// Read of a block that missed the cache, left to the caller instead of being waited
+// for; complete() verifies the block once read and adds it to the cache
+struct BlockRead {
+  std::shared_ptr<const RandomAccessFile> file;
+  uint64_t offset;
+  uint64_t size;
+  std::function<void(std::shared_ptr<const char>)> complete;
+};
+
+// Least recently used set of table blocks read with pread, bounded by max_bytes. Blocks
+// are identified by the id of their table and their index in it; a block stays in
+// memory while it is either in the cache or in use.
+class BlockCache {
+public:
+  BlockCache(uint64_t max_bytes): m_max_bytes(max_bytes) {}
+
+  std::shared_ptr<const char> get(uint64_t table, uint64_t block) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto entry = m_entries.find({table, block});
+    if (entry == m_entries.end()) {
+      m_misses++;
+      return nullptr;
+    }
+
+    m_hits++;
+    m_lru.splice(m_lru.begin(), m_lru, entry->second);
+    return entry->second->data;
+  }
+
+  // Returns the cached block, which is a different one if another thread inserted it first
+  std::shared_ptr<const char> insert(uint64_t table, uint64_t block, std::shared_ptr<const char> data, uint64_t size) {
+    // Evicted blocks are freed after the lock has been released
+    std::vector<std::shared_ptr<const char>> evicted;
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    Key key = {table, block};
+    auto entry = m_entries.find(key);
+    if (entry != m_entries.end()) {
+      return entry->second->data;
+    }
+
+    m_lru.push_front({key, data, size});
+    m_entries[key] = m_lru.begin();
+    m_bytes += size;
+
+    while (m_lru.size() > 1 && m_bytes > m_max_bytes) {
+      auto last = std::prev(m_lru.end());
+      evicted.push_back(last->data);
+      m_bytes -= last->size;
+      m_entries.erase(last->key);
+      m_lru.erase(last);
+    }
+
+    return data;
+  }
+
+  // Bytes of cached blocks
+  uint64_t size() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_bytes;
+  }
+
+  friend std::ostream& operator<< (std::ostream& stream, BlockCache &cache) {
+    std::lock_guard<std::mutex> lock(cache.m_mutex);
+    stream << cache.m_lru.size() << " blocks, " << (cache.m_bytes >> 20) << " MB, "
+           << cache.m_hits << " hits, " << cache.m_misses << " misses";
+    return stream;
+  }
+
+private:
+  struct Key {
+    uint64_t table;
+    uint64_t block;
+
+    bool operator==(const Key &that) const {
+      return table == that.table && block == that.block;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      return std::hash<uint64_t>()(key.table * 0x9e3779b97f4a7c15ull ^ key.block);
+    }
+  };
+
+  struct Entry {
+    Key key;
+    std::shared_ptr<const char> data;
+    uint64_t size;
+  };
+
+  std::mutex m_mutex;
+  std::list<Entry> m_lru;
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> m_entries;
+  uint64_t m_max_bytes;
+  uint64_t m_bytes = 0;
+  uint64_t m_hits = 0;
+  uint64_t m_misses = 0;
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef BLOOMFILTER_H
+#define BLOOMFILTER_H
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "Buffer.hpp"
+#include "Coding.hpp"
+
+// Bloom filter over 64-bit hashes, serialized as its bit array followed by the number of
+// hashes added (8 bytes), the id of the prefix extractor whose prefixes were added along with
+// the keys, 0 if none (8 bytes, see PrefixExtractor) and the number of probes (1 byte).
+// Probes are derived from a single hash by double hashing.
+class BloomFilter {
+public:
+  static const uint64_t SEED = 0x9e3779b97f4a7c15ull;
+  static const uint64_t TRAILER_SIZE = 2*sizeof(uint64_t) + 1;
+  // More bits per key hardly pay off, and a filter with fewer isn't built at all
+  static constexpr double MAX_BITS_PER_KEY = 32;
+  static constexpr double MIN_BITS_PER_KEY = 0.5;
+
+  static uint64_t hash(const Buffer &key) {
+    return key.hash(SEED);
+  }
+
+  // Serialized size of a filter of num_hashes hashes, 0 if there is no filter
+  static uint64_t size(uint64_t num_hashes, double bits_per_key) {
+    if (bits_per_key < MIN_BITS_PER_KEY) {
+      return 0;
+    }
+    return std::max<uint64_t>(std::ceil(num_hashes*bits_per_key/8), sizeof(uint64_t)) + TRAILER_SIZE;
+  }
+
+  static void put(std::string *output, const std::vector<uint64_t> &hashes, double bits_per_key,
+                  uint64_t prefix_extractor = 0) {
+    auto bytes = size(hashes.size(), bits_per_key);
+    if (bytes == 0) {
+      return;
+    }
+
+    auto probes = uint8_t(std::min(std::max(std::round(bits_per_key*std::log(2)), 1.0), 30.0));
+    std::string filter(bytes - TRAILER_SIZE, '\0');
+    uint64_t bits = filter.size()*8;
+    for (auto hash : hashes) {
+      auto delta = rotate(hash);
+      for (uint8_t i = 0; i < probes; i++, hash += delta) {
+        auto bit = hash % bits;
+        filter[bit / 8] |= 1 << (bit % 8);
+      }
+    }
+
+    output->append(filter);
+    put_fixed64(output, hashes.size());
+    put_fixed64(output, prefix_extractor);
+    output->push_back(probes);
+  }
+
+  // Never false for a hash added to the filter; an empty filter contains every hash
+  static bool may_contain(const Buffer &filter, uint64_t hash) {
+    if (filter.size() <= TRAILER_SIZE) {
+      return true;
+    }
+
+    uint64_t bits = (filter.size() - TRAILER_SIZE)*8;
+    uint8_t probes = filter.data()[filter.size() - 1];
+    auto delta = rotate(hash);
+    for (uint8_t i = 0; i < probes; i++, hash += delta) {
+      auto bit = hash % bits;
+      if ((filter.data()[bit / 8] & (1 << (bit % 8))) == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Expected false positive rate, 1 for an empty filter
+  static double false_positive_rate(const Buffer &filter) {
+    if (filter.size() <= TRAILER_SIZE) {
+      return 1;
+    }
+
+    double bits = (filter.size() - TRAILER_SIZE)*8;
+    double hashes = decode_fixed64(filter.data() + filter.size() - TRAILER_SIZE);
+    double probes = uint8_t(filter.data()[filter.size() - 1]);
+    return std::pow(1 - std::exp(-probes*hashes/bits), probes);
+  }
+
+  // Id of the extractor whose prefixes the filter holds, 0 if none
+  static uint64_t prefix_extractor(const Buffer &filter) {
+    if (filter.size() <= TRAILER_SIZE) {
+      return 0;
+    }
+    return decode_fixed64(filter.data() + filter.size() - TRAILER_SIZE + sizeof(uint64_t));
+  }
+
+  // Bits per key of the filters of every level such that the sum of their false positive
+  // rates, i.e. the expected number of tables read by the lookup of a missing key, is
+  // minimal given the total number of bits (see "Monkey: Optimal Navigable Key-Value
+  // Store"). The optimal rate of a level is proportional to its number of entries, so
+  // that smaller levels get more bits per key. Empty levels get the maximum.
+  static std::vector<double> allocate(const std::vector<uint64_t> &entries, double total_bits) {
+    const double ln2_squared = std::log(2)*std::log(2);
+
+    // Bits used if the rate of a level of n entries is e^scale * n, at most 1
+    auto bits_per_key = [&](double scale, uint64_t n) {
+      return std::min(std::max(-(scale + std::log(n))/ln2_squared, 0.0), MAX_BITS_PER_KEY);
+    };
+    auto used = [&](double scale) {
+      double bits = 0;
+      for (auto n : entries) {
+        bits += (n > 0) ? n*bits_per_key(scale, n) : 0;
+      }
+      return bits;
+    };
+
+    // The bits used shrink as the scale grows; none are used from scale 0 on
+    double low = -MAX_BITS_PER_KEY*ln2_squared - 64, high = 0;
+    if (used(low) > total_bits) {
+      for (int i = 0; i < 100; i++) {
+        auto mid = (low + high)/2;
+        if (used(mid) > total_bits) {
+          low = mid;
+        } else {
+          high = mid;
+        }
+      }
+    } else {
+      high = low;
+    }
+
+    std::vector<double> result;
+    for (auto n : entries) {
+      result.push_back((n > 0) ? bits_per_key(high, n) : MAX_BITS_PER_KEY);
+    }
+    return result;
+  }
+
+private:
+  static uint64_t rotate(uint64_t hash) {
+    return (hash >> 32) | (hash << 32);
+  }
+};
+
+#endif
@@ -3,12 +3,15 @@
 
 #include <iostream>
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <cassert>
 #include <cstring>
 #include <algorithm>
 
 #include "AppendableMMap.hpp"
+#include "Coding.hpp"
+#include "Hash.hpp"
 
 class Buffer{
  public:
@@ -19,35 +22,35 @@ class Buffer{
 
   // Warning: Reference only!
   Buffer(const std::string &x) {
-    assert(x.size() < UINT16_MAX);
     m_size = x.size();
     m_buffer = x.c_str();
   }
 
   // Warning: Reference only!
   Buffer (const char *x) {
-    auto len = strlen(x);
-    assert(len < UINT16_MAX);
-    m_size = len;
+    m_size = strlen(x);
     m_buffer = x;
   }
 
   // Warning: Reference only
-  Buffer (const void *x, uint32_t size) {
-    assert(size < UINT16_MAX);
+  Buffer (const void *x, uint64_t size) {
     m_size = size;
     m_buffer = reinterpret_cast<const char *>(x);
   }
 
-  void serialize(AppendableMMap &mmap) const{
-    mmap.appendFront((const char *) &m_size, sizeof(m_size));
-    mmap.appendFront(m_buffer, m_size);
+  // The size is stored as a varint in front of the content
+  // Output is anything that can be appended to, e.g. an AppendableMMap or a SequentialFile
+  template<typename Output>
+  void serialize(Output &output) const{
+    char header[MAX_VARINT_LENGTH];
+    auto header_end = encode_varint(header, m_size);
+    output.appendFront(header, header_end - header);
+    output.appendFront(m_buffer, m_size);
   }
 
   static Buffer deserialize(const char *raw) {
     auto buffer = Buffer();
-    buffer.m_size = *(reinterpret_cast<const uint16_t *>(raw));
-    buffer.m_buffer = reinterpret_cast<const char *>(raw + sizeof(uint16_t));
+    buffer.m_buffer = decode_varint(raw, &buffer.m_size);
     return buffer;
   }
 
@@ -55,36 +58,28 @@ class Buffer{
     return m_buffer;
   }
 
-  const uint16_t size() const{
+  const uint64_t size() const{
     return m_size;
   }
 
-  const uint32_t total_size() const {
-    return m_size + sizeof(uint16_t);
+  const uint64_t total_size() const {
+    return m_size + varint_length(m_size);
   }
 
   int compare(const Buffer &that) const {
     auto size = std::min(m_size, that.m_size);
     auto cmp = memcmp(m_buffer, that.m_buffer, size);
-    auto size_diff = m_size - that.m_size;
 
     if (cmp == 0) {
-      return size_diff;
+      return (m_size < that.m_size) ? -1 : (m_size > that.m_size);
     } else {
       return cmp;
     }
   }
 
-  // djb2 http://www.cse.yorku.ca/~oz/hash.html
-  uint64_t hash() const {
-    uint64_t hash = 5381;
-
-    for (uint32_t i = 0; i < m_size; i++) {
-      auto c = m_buffer[i];
-      hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
-    }
-
-    return hash;
+  // Used for partitioning, use different seeds for independent hash functions
+  uint64_t hash(uint64_t seed = 0) const {
+    return hash64(m_buffer, m_size, seed);
   }
 
   bool operator==(const Buffer &that) const {
@@ -124,22 +119,24 @@ class Buffer{
   }
 
   friend std::ostream& operator<< (std::ostream& stream, const Buffer &buffer) {
-    char tmp[buffer.m_size + 1];
-    strncpy(tmp, buffer.m_buffer, buffer.m_size);
-    tmp[buffer.m_size] = '\0';
-    stream << "Length: " << buffer.m_size << ", Content: " << tmp;
+    stream << "Length: " << buffer.m_size << ", Content: ";
+    stream.write(buffer.m_buffer, buffer.m_size);
     return stream;
   }
 
  protected:
-  uint16_t m_size = 0;
+  uint64_t m_size = 0;
   const char *m_buffer = nullptr;
 };
 
 class OwnedBuffer : public Buffer {
 public:
   OwnedBuffer(const std::string &x): m_copy(x) {
-    assert(m_copy.size() < UINT16_MAX);
+    m_size = m_copy.size();
+    m_buffer = m_copy.c_str();
+  }
+
+  OwnedBuffer(std::string &&x): m_copy(std::move(x)) {
     m_size = m_copy.size();
     m_buffer = m_copy.c_str();
   }
@@ -153,4 +150,13 @@ private:
   std::string m_copy;
 };
 
+// Warning: Reference only, keeps whatever owns the memory alive
+class PinnedBuffer : public Buffer {
+public:
+  PinnedBuffer(const Buffer &x, std::shared_ptr<const void> pin): Buffer(x), m_pin(pin) {}
+
+private:
+  std::shared_ptr<const void> m_pin;
+};
+
 #endif
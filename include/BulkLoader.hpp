@@ -0,0 +1,257 @@
+#ifndef BULKLOADER_H
+#define BULKLOADER_H
+
+#include <sys/mman.h>
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Buffer.hpp"
+#include "Config.hpp"
+#include "KeyValue.hpp"
+#include "Table.hpp"
+#include "TableBuilder.hpp"
+#include "ThreadPool.hpp"
+
+// Turns unsorted entries into tables of the last level of a store, to be moved into it with
+// ParallelKVStore::ingest_files, using an external merge sort:
+// - entries are buffered in batches; full batches are sorted on the pool and spilled to
+//   disk as one sorted run per partition;
+// - once all entries have been added, the runs of every partition are merged into the
+//   final tables, partitions in parallel.
+// At most one batch per thread is being sorted while the next one is filled, so memory
+// use stays around the given bound. Of entries with the same key the last one added wins;
+// an empty value is a tombstone.
+class BulkLoader {
+public:
+  // Runs and tables are written to directory, which must exist; 0 threads means one per core
+  BulkLoader(const Config &config, const std::string &directory, uint64_t memory = 256 << 20, uint32_t threads = 0):
+      m_config(config),
+      m_level(config.level(config.levels.size() - 1)),
+      m_directory(directory),
+      m_runs(config.parallelism),
+      m_pool(threads) {
+    m_batch_size = std::max<uint64_t>(memory / (m_pool.size() + 1), 1);
+  }
+
+  void add(const Buffer &key, const Buffer &value) {
+    assert(key.size() > 0);
+
+    m_batch.entries.push_back({m_batch.data.size(), key.size(), value.size(), m_config.partition(key)});
+    m_batch.data.append(key.data(), key.size());
+    m_batch.data.append(value.data(), value.size());
+    m_entries++;
+    m_bytes += key.size() + value.size();
+
+    if (m_batch.data.size() + m_batch.entries.size()*sizeof(Entry) >= m_batch_size) {
+      spill();
+    }
+  }
+
+  // Sorts what's left and returns the paths of the final tables
+  std::vector<std::string> finish() {
+    spill();
+    while (!m_spilling.empty()) {
+      m_spilling.front().get();
+      m_spilling.pop_front();
+    }
+
+    std::vector<std::future<std::vector<std::string>>> merges;
+    for (uint32_t i = 0; i < m_runs.size(); i++) {
+      merges.push_back(m_pool.submit([this, i]() {
+        return merge(m_runs[i]);
+      }));
+    }
+
+    std::vector<std::string> tables;
+    for (auto &merge : merges) {
+      auto paths = merge.get();
+      tables.insert(tables.end(), paths.begin(), paths.end());
+    }
+    return tables;
+  }
+
+  // Number of entries added so far, duplicates included
+  uint64_t entries() const {
+    return m_entries;
+  }
+
+  // Bytes of keys and values added so far
+  uint64_t bytes() const {
+    return m_bytes;
+  }
+
+  // Number of runs spilled to disk
+  uint64_t runs() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t runs = 0;
+    for (const auto &partition : m_runs) {
+      runs += partition.size();
+    }
+    return runs;
+  }
+
+private:
+  struct Entry {
+    uint64_t offset;
+    uint64_t key_size;
+    uint64_t value_size;
+    uint32_t partition;
+  };
+
+  struct Batch {
+    std::string data;
+    std::vector<Entry> entries;
+  };
+
+  // Runs are identified by the batch they come from, older batches first
+  typedef std::vector<std::pair<uint64_t, std::string>> run_list;
+
+  // Hands the batch over to the pool, waiting for the oldest batch if all threads are busy
+  void spill() {
+    if (m_batch.entries.empty()) {
+      return;
+    }
+
+    if (m_spilling.size() >= m_pool.size()) {
+      m_spilling.front().get();
+      m_spilling.pop_front();
+    }
+
+    auto batch = std::make_shared<Batch>();
+    std::swap(*batch, m_batch);
+    auto id = m_batches++;
+    m_spilling.push_back(m_pool.submit([this, batch, id]() {
+      write_runs(*batch, id);
+    }));
+  }
+
+  void write_runs(Batch &batch, uint64_t id) {
+    auto &data = batch.data;
+    auto key = [&data](const Entry &entry) {
+      return Buffer(data.data() + entry.offset, entry.key_size);
+    };
+
+    // Later entries come first among equal keys, the others are dropped
+    std::stable_sort(batch.entries.begin(), batch.entries.end(), [&key](const Entry &x, const Entry &y) {
+      if (x.partition != y.partition) {
+        return x.partition < y.partition;
+      }
+      auto cmp = key(x).compare(key(y));
+      return cmp < 0 || (cmp == 0 && x.offset > y.offset);
+    });
+
+    for (auto begin = batch.entries.begin(); begin != batch.entries.end(); ) {
+      auto end = begin;
+      uint64_t size = 0, count = 0;
+      for (; end != batch.entries.end() && end->partition == begin->partition; ++end) {
+        size += KeyValue::serialized_size(key(*end), Buffer(data.data() + end->offset + end->key_size, end->value_size), false);
+        count++;
+      }
+
+      // A run is a single table
+      TableBuilder builder(Table::serialized_size(size, count, sizeof(uint64_t)), m_directory);
+      for (auto entry = begin; entry != end; ++entry) {
+        if (entry == begin || key(*entry) != key(*(entry - 1))) {
+          auto added = builder.add(key(*entry), Buffer(data.data() + entry->offset + entry->key_size, entry->value_size));
+          assert(added);
+          (void)added;
+        }
+      }
+
+      auto run = builder.finalize();
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_runs[begin->partition].emplace_back(id, run->path());
+      begin = end;
+    }
+  }
+
+  // Merges the runs of a partition, newer runs winning among equal keys
+  std::vector<std::string> merge(run_list runs) {
+    std::sort(runs.begin(), runs.end());
+
+    std::vector<std::shared_ptr<Table>> tables;
+    std::vector<TableIterator> iterators;
+    uint64_t entries = 0;
+    for (const auto &run : runs) {
+      tables.push_back(Table::load_table(run.second));
+      entries += tables.back()->size();
+      tables.back()->hint(MADV_SEQUENTIAL);
+      iterators.push_back(tables.back()->begin());
+    }
+
+    // Smallest key on top, the newest run first among equal keys
+    auto later = [&iterators](uint64_t x, uint64_t y) {
+      auto cmp = iterators[x]->key.compare(iterators[y]->key);
+      return cmp > 0 || (cmp == 0 && x < y);
+    };
+    std::priority_queue<uint64_t, std::vector<uint64_t>, decltype(later)> heap(later);
+    for (uint64_t i = 0; i < runs.size(); i++) {
+      heap.push(i);
+    }
+
+    std::vector<std::string> paths;
+    auto add_table = [&paths](std::shared_ptr<Table> table) {
+      if (table) {
+        paths.push_back(table->path());
+      }
+    };
+
+    TableBuilder builder(m_level.table_size, m_directory, m_level.index_type, nullptr, FLUSH_PRIORITY,
+                         m_config.last_level_filter_bits(entries), m_level.prefix_extractor, m_level.range_filter,
+                         m_level.range_filter_suffix_bits);
+    std::string last_key;
+    bool first = true;
+
+    while (!heap.empty()) {
+      auto i = heap.top();
+      heap.pop();
+
+      auto item = *iterators[i];
+      if (first || item.key != Buffer(last_key)) {
+        if (!builder.add(item.key, item.value)) {
+          add_table(builder.finalize());
+          builder.add(item.key, item.value);
+        }
+        last_key.assign(item.key.data(), item.key.size());
+        first = false;
+      }
+
+      if (++iterators[i] != tables[i]->end()) {
+        heap.push(i);
+      }
+    }
+
+    add_table(builder.finalize());
+
+    // Only now that the tables are written are the runs no longer needed
+    for (const auto &table : tables) {
+      table->delete_from_fs();
+    }
+    return paths;
+  }
+
+  Config m_config;
+  LevelConfig m_level;
+  std::string m_directory;
+  uint64_t m_batch_size;
+  Batch m_batch;
+  uint64_t m_batches = 0;
+  uint64_t m_entries = 0;
+  uint64_t m_bytes = 0;
+  std::deque<std::future<void>> m_spilling;
+  std::mutex m_mutex;
+  std::vector<run_list> m_runs;
+  // Last, so that pending tasks finish before the rest goes away
+  ThreadPool m_pool;
+};
+
+#endif
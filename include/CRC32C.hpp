@@ -0,0 +1,72 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// CRC-32C (Castagnoli), computed with the SSE4.2 crc32 instruction when the CPU
+// supports it and with a lookup table otherwise.
+inline uint32_t crc32c_software(const char *data, size_t size, uint32_t crc = 0) {
+  static const auto table = []() {
+    struct { uint32_t entries[256]; } table;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t entry = i;
+      for (int j = 0; j < 8; j++) {
+        entry = (entry >> 1) ^ ((entry & 1) ? 0x82F63B78 : 0);
+      }
+      table.entries[i] = entry;
+    }
+    return table;
+  }();
+
+  crc = ~crc;
+  auto ptr = reinterpret_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < size; i++) {
+    crc = table.entries[(crc ^ ptr[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_hardware(const char *data, size_t size, uint32_t crc = 0) {
+  uint64_t state = ~crc;
+
+  for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    state = _mm_crc32_u64(state, word);
+  }
+
+  auto crc32 = static_cast<uint32_t>(state);
+  for (; size > 0; size--, data++) {
+    crc32 = _mm_crc32_u8(crc32, *data);
+  }
+  return ~crc32;
+}
+#endif
+
+inline bool crc32c_hardware_supported() {
+#if defined(__x86_64__)
+  static const bool supported = __builtin_cpu_supports("sse4.2");
+  return supported;
+#else
+  return false;
+#endif
+}
+
+inline uint32_t crc32c(const char *data, size_t size, uint32_t crc = 0) {
+#if defined(__x86_64__)
+  if (crc32c_hardware_supported()) {
+    return crc32c_hardware(data, size, crc);
+  }
+#endif
+  return crc32c_software(data, size, crc);
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef CODING_H
+#define CODING_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Varints store 7 bits per byte, least significant group first; the high bit of
+// every byte but the last one is set. Small lengths hence take a single byte.
+const uint32_t MAX_VARINT_LENGTH = 10;
+
+inline uint32_t varint_length(uint64_t value) {
+  uint32_t length = 1;
+  while (value >= 128) {
+    value >>= 7;
+    length++;
+  }
+  return length;
+}
+
+inline char *encode_varint(char *dst, uint64_t value) {
+  auto ptr = reinterpret_cast<uint8_t *>(dst);
+  while (value >= 128) {
+    *(ptr++) = value | 128;
+    value >>= 7;
+  }
+  *(ptr++) = value;
+  return reinterpret_cast<char *>(ptr);
+}
+
+inline const char *decode_varint(const char *src, uint64_t *value) {
+  auto ptr = reinterpret_cast<const uint8_t *>(src);
+  uint64_t result = 0;
+
+  for (uint32_t shift = 0; shift < 64; shift += 7) {
+    uint64_t byte = *(ptr++);
+    result |= (byte & 127) << shift;
+    if ((byte & 128) == 0) {
+      break;
+    }
+  }
+
+  *value = result;
+  return reinterpret_cast<const char *>(ptr);
+}
+
+inline void put_varint(std::string *dst, uint64_t value) {
+  char buffer[MAX_VARINT_LENGTH];
+  dst->append(buffer, encode_varint(buffer, value) - buffer);
+}
+
+// Varint size followed by the bytes
+inline void put_length_prefixed(std::string *dst, const char *data, uint64_t size) {
+  put_varint(dst, size);
+  dst->append(data, size);
+}
+
+inline void put_fixed32(std::string *dst, uint32_t value) {
+  dst->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+inline void put_fixed64(std::string *dst, uint64_t value) {
+  dst->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+inline uint32_t decode_fixed32(const char *src) {
+  uint32_t value;
+  memcpy(&value, src, sizeof(value));
+  return value;
+}
+
+inline uint64_t decode_fixed64(const char *src) {
+  uint64_t value;
+  memcpy(&value, src, sizeof(value));
+  return value;
+}
+
+#endif
@@ -5,17 +5,35 @@
 #include <cmath>
 #include <sys/types.h>
 #include <cassert>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "BloomFilter.hpp"
 #include "FileSystem.hpp"
+#include "PrefixExtractor.hpp"
+#include "RateLimiter.hpp"
+#include "Table.hpp"
+
+// How levels below level 0 are compacted
+enum CompactionStyle : uint8_t {
+  // Every level is a single sorted run; the level above is merged into it
+  LEVELED_COMPACTION = 0,
+  // Every level holds sorted runs that may overlap each other; once a level holds more
+  // than LevelConfig::max_runs runs, its runs are merged into a single new run of the
+  // next level, and the runs of the last level are merged with each other
+  TIERED_COMPACTION = 1,
+  // Levels above the last one are tiered, the last one is leveled: writes are nearly as
+  // cheap as with tiering while most lookups and most of the data hit a single run
+  LAZY_LEVELING_COMPACTION = 2
+};
 
 struct LevelConfig {
   LevelConfig() {}
   LevelConfig(const std::string &path,
               const std::string &db_name,
               uint32_t level,
-              uint32_t table_size,
+              uint64_t table_size,
               uint32_t threshold,
               bool overwrite = false)
     : path(path),
@@ -31,9 +49,28 @@ struct LevelConfig {
   std::string path_db;
   std::string path_level;
   uint32_t level;
-  uint32_t table_size;
+  uint64_t table_size;
   uint32_t threshold;
   bool overwrite;
+  bool verify_checksums = false;
+  bool hash_index = false;
+  IndexType index_type = DENSE_INDEX;
+  bool access_hints = false;
+  IOBackend io_backend = MMAP_IO;
+  std::shared_ptr<RateLimiter> rate_limiter;
+  bool rate_limit_reads = false;
+  // Either LEVELED_COMPACTION or TIERED_COMPACTION
+  CompactionStyle compaction_style = LEVELED_COMPACTION;
+  // Runs a tiered level holds before being merged
+  uint32_t max_runs = 1;
+  // Bits per key of the Bloom filters of new tables, 0 for none
+  double filter_bits = 0;
+  // Prefixes added to the Bloom filters along with the keys
+  PrefixExtractor prefix_extractor;
+  // Whether new tables get a range filter, keeping the given number of bits of every key
+  // past its cut
+  bool range_filter = false;
+  uint32_t range_filter_suffix_bits = 0;
 };
 
 std::vector<std::string> split(const std::string& s, const char& c) {
@@ -60,9 +97,9 @@ struct Config{
   Config(const std::string &name,
          const std::string &path,
          int num_levels,
-         uint32_t table_size,
+         uint64_t table_size,
          uint32_t threshold,
-         uint32_t memtable_size,
+         uint64_t memtable_size,
          uint32_t parallelism = 1,
          bool overwrite = false):
       name(name),
@@ -82,13 +119,60 @@ struct Config{
 
     for (int i = 0, t = threshold; i < num_levels; i++, t *= threshold) {
       levels.push_back(LevelConfig(directories[i], name, i, table_size, t, overwrite));
+      levels.back().max_runs = threshold;
+    }
+  }
+
+  // Configuration of a level, including the store-wide table options
+  LevelConfig level(uint32_t i) const {
+    auto config = levels[i];
+    config.verify_checksums = verify_checksums;
+    config.hash_index = (i == 0) && level0_hash_index;
+    config.index_type = index_type;
+    config.access_hints = access_hints;
+    config.io_backend = io_backend;
+    config.rate_limiter = rate_limiter;
+    config.rate_limit_reads = rate_limit_reads;
+    config.filter_bits = filter_bits_per_key;
+    config.prefix_extractor = prefix_extractor;
+    config.range_filter = range_filters;
+    config.range_filter_suffix_bits = range_filter_suffix_bits;
+    auto last = (i + 1 == levels.size());
+    if (compaction_style == TIERED_COMPACTION || (compaction_style == LAZY_LEVELING_COMPACTION && !last)) {
+      config.compaction_style = TIERED_COMPACTION;
+    } else {
+      config.compaction_style = LEVELED_COMPACTION;
+    }
+    return config;
+  }
+
+  // Bits per key of the filters of tables written for the last level of a partition of the
+  // store outside of it, e.g. to be ingested, given the entries they hold. With a filter
+  // budget that's the share LSMTree::update_filters gives a last level of that many entries.
+  double last_level_filter_bits(uint64_t entries) const {
+    if (filter_memory == 0) {
+      return filter_bits_per_key;
+    }
+
+    std::vector<uint64_t> level_entries(levels.size(), 0);
+    level_entries.back() = entries;
+    return BloomFilter::allocate(level_entries, 8.0*filter_memory / parallelism).back();
+  }
+
+  // Partition a key belongs to; keys sharing a prefix belong to the same partition
+  uint32_t partition(const Buffer &key) const {
+    Buffer prefix;
+    if (prefix_extractor.extract(key, &prefix)) {
+      return prefix.hash() % parallelism;
     }
+    return key.hash() % parallelism;
   }
 
   static Config create_partition(const Config &config, uint partition) {
     auto new_name = config.name + "_" + std::to_string(partition);
     auto new_config = config;
     new_config.name = new_name;
+    new_config.filter_memory = config.filter_memory / config.parallelism;
 
     for (auto i = 0; i < new_config.levels.size(); i++){
       auto &level = new_config.levels[i];
@@ -102,8 +186,67 @@ struct Config{
   std::vector<LevelConfig> levels;
   std::string name;
   std::string path;
-  uint32_t memtable_size;
+  uint64_t memtable_size;
   uint32_t parallelism;
+
+  // Values of at least this size are kept in a value log and tables only store a
+  // pointer to them; 0 keeps new values in tables, values logged before stay readable.
+  uint64_t value_threshold = 0;
+  uint64_t vlog_file_size = 64 << 20;
+  // Fraction of a value log file that has to be garbage before its live values are relocated
+  double vlog_gc_ratio = 0.5;
+  // Verify table checksums on reads; tables are always verified before being compacted
+  bool verify_checksums = false;
+  // Keep an in-memory hash index of all level 0 keys so that point lookups probe a
+  // single table instead of searching every overlapping one
+  bool level0_hash_index = false;
+  // How tables locate keys, see IndexType
+  IndexType index_type = DENSE_INDEX;
+  // Tables are mapped on first access and at most this many tables, or this many bytes
+  // of them, stay mapped per partition; by default all tables are mapped when loaded
+  uint64_t max_open_tables = 0;
+  uint64_t table_cache_size = 0;
+  // Threads loading tables when a store is opened, 0 for one per core. A KVStore opened on
+  // its own loads its tables on the calling thread unless this is above 1.
+  uint32_t open_threads = 0;
+  // Tell the kernel how tables are read: randomly by point lookups, which disables
+  // readahead, and by compactions, which prefetch their inputs and drop them from memory
+  // once consumed
+  bool access_hints = false;
+  // How tables are read, see IOBackend. Tables read with pread keep recently read
+  // blocks in a cache of at most this many bytes per partition, 0 to disable it.
+  IOBackend io_backend = MMAP_IO;
+  uint64_t block_cache_size = 0;
+  // Gets that miss the block cache read the block with io_uring while the partition
+  // serves other requests; needs a pread backend and a block cache
+  bool async_reads = false;
+  // Flushes and compactions write through the rate limiter, if any; stores sharing a
+  // configuration share its limit. Reads of tables being compacted are charged too if
+  // rate_limit_reads is set.
+  std::shared_ptr<RateLimiter> rate_limiter;
+  bool rate_limit_reads = false;
+  // Tiered compaction writes every entry once per level, at the cost of lookups probing
+  // up to LevelConfig::max_runs runs per level, by default the growth factor. The table
+  // threshold and the number of runs can be tuned for each level in levels. A store can
+  // go from leveled to tiered levels but refuses to open with its tiered levels leveled.
+  CompactionStyle compaction_style = LEVELED_COMPACTION;
+  // Tables carry Bloom filters so that lookups skip most tables that don't hold the key.
+  // Either every level gets the same bits per key, or the filters of the store take up
+  // about filter_memory bytes, spread over the levels to minimize the tables read by
+  // lookups of missing keys (see BloomFilter::allocate) as the levels grow.
+  double filter_bits_per_key = 0;
+  uint64_t filter_memory = 0;
+  // Groups keys by a prefix, e.g. PrefixExtractor::delimited(':') for "tenant:object:field"
+  // keys. Keys sharing a prefix live in the same partition, and the Bloom filters of new
+  // tables hold the prefixes of their keys, so that prefix scans read a single partition
+  // and skip tables without the prefix. Changing it moves keys to other partitions, so a
+  // store with more than one partition refuses to open with another one.
+  PrefixExtractor prefix_extractor;
+  // Tables can carry range filters (see RangeFilter), so that scans skip most tables without
+  // keys in the range, which pays off when many scans of short ranges find few keys or
+  // none. Every suffix bit kept per key costs a bit and rules out more ranges.
+  bool range_filters = false;
+  uint32_t range_filter_suffix_bits = 8;
 };
 
 #endif
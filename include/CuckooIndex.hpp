@@ -0,0 +1,162 @@
+#ifndef CUCKOOINDEX_H
+#define CUCKOOINDEX_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Cuckoo hash table mapping 64-bit key hashes to the location of an entry, i.e. the
+// id of the table that contains it and its position in that table. Every hash can
+// live in one of two buckets of four slots, so a lookup probes at most eight slots.
+// Different keys with the same hash share a slot; callers have to compare the key
+// found at the returned location.
+class CuckooIndex {
+public:
+  // Seed of the key hash, independent of the partitioning hash that makes all keys of a
+  // partition agree on their lowest bits
+  static const uint64_t SEED = 0x9e3779b97f4a7c15ull;
+
+  struct Location {
+    uint64_t table;
+    uint64_t entry;
+  };
+
+  CuckooIndex(uint64_t capacity = 1024) {
+    resize(capacity);
+  }
+
+  // Overwrites the location of a hash that is already present
+  void insert(uint64_t hash, uint64_t table, uint64_t entry) {
+    if (auto slot = find_slot(hash)) {
+      slot->location = {table, entry};
+      return;
+    }
+
+    Slot item = {hash, {table, entry}, true};
+    while (!place(item)) {
+      // The displaced item is reinserted after growing the table
+      resize(m_buckets.size() * 2 * SLOTS);
+    }
+    m_size++;
+  }
+
+  const Location *find(uint64_t hash) const {
+    auto slot = const_cast<CuckooIndex *>(this)->find_slot(hash);
+    return slot ? &slot->location : nullptr;
+  }
+
+  // Removes the locations of all tables with an id smaller than table
+  void erase_before(uint64_t table) {
+    for (auto &bucket : m_buckets) {
+      for (auto &slot : bucket.slots) {
+        if (slot.used && slot.location.table < table) {
+          slot.used = false;
+          m_size--;
+        }
+      }
+    }
+
+    if (m_size < m_buckets.size() * SLOTS / 8 && m_buckets.size() > MIN_BUCKETS) {
+      resize(m_size * 2);
+    }
+  }
+
+  uint64_t size() const {
+    return m_size;
+  }
+
+  // Approximate heap footprint
+  uint64_t memory() const {
+    return m_buckets.size() * sizeof(Bucket);
+  }
+
+private:
+  static const uint32_t SLOTS = 4;
+  static const uint32_t MAX_KICKS = 500;
+  static const uint64_t MIN_BUCKETS = 256;
+
+  struct Slot {
+    uint64_t hash;
+    Location location;
+    bool used;
+  };
+
+  struct Bucket {
+    Slot slots[SLOTS];
+  };
+
+  uint64_t bucket1(uint64_t hash) const {
+    return hash & m_mask;
+  }
+
+  uint64_t bucket2(uint64_t hash) const {
+    return ((hash >> 32) * 0xc6a4a7935bd1e995ull >> 16) & m_mask;
+  }
+
+  Slot *find_slot(uint64_t hash) {
+    for (auto b : {bucket1(hash), bucket2(hash)}) {
+      for (auto &slot : m_buckets[b].slots) {
+        if (slot.used && slot.hash == hash) {
+          return &slot;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  // Places item, kicking out residents to their alternative bucket; on failure item
+  // holds the last displaced resident.
+  bool place(Slot &item) {
+    auto b = bucket1(item.hash);
+
+    for (uint32_t kick = 0; kick < MAX_KICKS; kick++) {
+      for (auto candidate : {bucket1(item.hash), bucket2(item.hash)}) {
+        for (auto &slot : m_buckets[candidate].slots) {
+          if (!slot.used) {
+            slot = item;
+            return true;
+          }
+        }
+      }
+
+      auto &victim = m_buckets[b].slots[kick % SLOTS];
+      std::swap(item, victim);
+      b = (bucket1(item.hash) == b) ? bucket2(item.hash) : bucket1(item.hash);
+    }
+
+    return false;
+  }
+
+  void resize(uint64_t capacity) {
+    uint64_t num_buckets = MIN_BUCKETS;
+    while (num_buckets * SLOTS < capacity) {
+      num_buckets *= 2;
+    }
+
+    std::vector<Bucket> old(num_buckets);
+    std::swap(old, m_buckets);
+    for (auto &bucket : m_buckets) {
+      for (auto &slot : bucket.slots) {
+        slot.used = false;
+      }
+    }
+    m_mask = num_buckets - 1;
+
+    for (auto &bucket : old) {
+      for (auto &slot : bucket.slots) {
+        if (slot.used) {
+          auto item = slot;
+          while (!place(item)) {
+            resize(m_buckets.size() * 2 * SLOTS);
+          }
+        }
+      }
+    }
+  }
+
+  std::vector<Bucket> m_buckets;
+  uint64_t m_mask = 0;
+  uint64_t m_size = 0;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef FENCEINDEX_H
+#define FENCEINDEX_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Buffer.hpp"
+#include "KeyPrefix.hpp"
+#include "Table.hpp"
+
+// Boundary keys of a sorted sequence of non-overlapping tables, kept in contiguous
+// arrays so that choosing the table that may contain a key doesn't touch the tables
+// themselves. Every fence holds the prefixes of the min and max key of a table; the
+// keys are only compared when prefixes are equal.
+class FenceIndex {
+public:
+  FenceIndex() {}
+
+  FenceIndex(const std::vector<std::shared_ptr<Table>> &tables) {
+    if (tables.empty()) {
+      return;
+    }
+
+    // All keys in the level share the prefix of its smallest and largest key
+    m_prefix_offset = common_prefix_length(tables.front()->min_key(), tables.back()->max_key());
+    m_fences.reserve(tables.size());
+
+    for (const auto &table : tables) {
+      Fence fence;
+      fence.min_prefix = key_prefix(table->min_key(), m_prefix_offset);
+      fence.max_prefix = key_prefix(table->max_key(), m_prefix_offset);
+      fence.min_offset = append_key(table->min_key());
+      fence.max_offset = append_key(table->max_key());
+      m_fences.push_back(fence);
+    }
+    m_offsets.push_back(m_keys.size());
+  }
+
+  // Index of the table whose range contains key, -1 if none
+  int64_t find(const Buffer &key) const {
+    if (m_fences.empty() || compare(key, 0, true) < 0 || compare(key, m_fences.size() - 1, false) > 0) {
+      return -1;
+    }
+
+    // First table whose max key is not smaller than key
+    auto prefix = key_prefix(key, m_prefix_offset);
+    int64_t min = 0, max = m_fences.size() - 1;
+    while (min < max) {
+      auto half = (min + max) / 2;
+      if (compare(key, prefix, half, false) > 0) {
+        min = half + 1;
+      } else {
+        max = half;
+      }
+    }
+
+    return (compare(key, prefix, min, true) >= 0) ? min : -1;
+  }
+
+  uint64_t size() const {
+    return m_fences.size();
+  }
+
+private:
+  struct Fence {
+    uint64_t min_prefix;
+    uint64_t max_prefix;
+    uint64_t min_offset;
+    uint64_t max_offset;
+  };
+
+  uint64_t append_key(const Buffer &key) {
+    m_offsets.push_back(m_keys.size());
+    m_keys.append(key.data(), key.size());
+    return m_offsets.size() - 1;
+  }
+
+  Buffer key(uint64_t i) const {
+    return Buffer(m_keys.data() + m_offsets[i], m_offsets[i + 1] - m_offsets[i]);
+  }
+
+  int compare(const Buffer &key, uint64_t i, bool min) const {
+    auto &fence = m_fences[i];
+    return key.compare(this->key(min ? fence.min_offset : fence.max_offset));
+  }
+
+  int compare(const Buffer &key, uint64_t prefix, uint64_t i, bool min) const {
+    auto &fence = m_fences[i];
+    auto fence_prefix = min ? fence.min_prefix : fence.max_prefix;
+
+    if (prefix != fence_prefix) {
+      return (prefix < fence_prefix) ? -1 : 1;
+    }
+    return compare(key, i, min);
+  }
+
+  std::vector<Fence> m_fences;
+  std::vector<uint64_t> m_offsets;
+  std::string m_keys;
+  uint64_t m_prefix_offset = 0;
+};
+
+#endif
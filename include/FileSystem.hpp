@@ -2,13 +2,18 @@
 #define FILESYSTEM_H
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <algorithm>
+#include <cerrno>
+#include <cstdint>
 #include <iostream>
 #include <string>
 #include <cstring>
 #include <sstream>
+#include <system_error>
+#include <vector>
 
 static bool ends_with(std::string const & value, std::string const & ending)
 {
@@ -64,6 +69,102 @@ bool mkdir(const std::string &path) {
   return mkdir(path.c_str(), S_IRWXU | S_IRWXG) == 0;
 }
 
+// Size of a file, -1 if it doesn't exist
+int64_t file_size(const std::string &path) {
+  struct stat sb;
+  return (stat(path.c_str(), &sb) == -1) ? -1 : sb.st_size;
+}
+
+// Whether files can be renamed from one path to the other, i.e. both are on the same device
+bool same_file_system(const std::string &path1, const std::string &path2) {
+  struct stat sb1, sb2;
+  return stat(path1.c_str(), &sb1) == 0 && stat(path2.c_str(), &sb2) == 0 && sb1.st_dev == sb2.st_dev;
+}
+
+// Renames the file, copying it if the destination is on another file system
+void move_file(const std::string &from, const std::string &to) {
+  if (rename(from.c_str(), to.c_str()) == 0) {
+    return;
+  } else if (errno != EXDEV) {
+    throw std::system_error(errno, std::system_category());
+  }
+
+  int in = open(from.c_str(), O_RDONLY);
+  if (in == -1) {
+    throw std::system_error(errno, std::system_category());
+  }
+  int out = open(to.c_str(), O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR);
+  if (out == -1) {
+    close(in);
+    throw std::system_error(errno, std::system_category());
+  }
+
+  char buffer[1 << 16];
+  ssize_t res;
+  bool failed = false;
+  while (!failed && (res = read(in, buffer, sizeof(buffer))) > 0) {
+    for (ssize_t written = 0; written < res && !failed; ) {
+      auto w = write(out, buffer + written, res - written);
+      failed = w == -1;
+      written += w;
+    }
+  }
+
+  failed = failed || res == -1 || fdatasync(out) == -1;
+  auto error = errno;
+  close(in);
+  close(out);
+
+  if (failed) {
+    unlink(to.c_str());
+    throw std::system_error(error, std::system_category());
+  }
+  unlink(from.c_str());
+}
+
+// Returns false if the file doesn't exist
+bool read_file(const std::string &path, std::string *contents) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+
+  char buffer[1 << 16];
+  ssize_t res;
+  contents->clear();
+  while ((res = read(fd, buffer, sizeof(buffer))) > 0) {
+    contents->append(buffer, res);
+  }
+
+  close(fd);
+  if (res == -1) {
+    throw std::system_error(errno, std::system_category());
+  }
+  return true;
+}
+
+// Replaces the file atomically, either the old or the new contents survive a crash
+void write_file(const std::string &path, const std::string &contents) {
+  auto tmp = path + ".tmp";
+  int fd = open(tmp.c_str(), O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    throw std::system_error(errno, std::system_category());
+  }
+
+  for (uint64_t written = 0; written < contents.size(); ) {
+    auto res = write(fd, contents.data() + written, contents.size() - written);
+    if (res == -1) {
+      close(fd);
+      throw std::system_error(errno, std::system_category());
+    }
+    written += res;
+  }
+
+  if (fdatasync(fd) == -1 || close(fd) == -1 || rename(tmp.c_str(), path.c_str()) == -1) {
+    throw std::system_error(errno, std::system_category());
+  }
+}
+
 std::string path_append(const std::string &p1, const std::string &p2) {
   if (ends_with(p1, "/")) {
     return p1 + p2;
@@ -0,0 +1,93 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// 64-bit hash based on wyhash (final version 4, released into the public domain by
+// Wang Yi). Keys are consumed a word at a time and mixed with 64x64->128 bit
+// multiplications, which distributes structured keys like zero-padded numbers
+// evenly.
+namespace hash_internal {
+
+const uint64_t SECRET[4] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull};
+
+inline void multiply(uint64_t *a, uint64_t *b) {
+  __uint128_t result = *a;
+  result *= *b;
+  *a = static_cast<uint64_t>(result);
+  *b = static_cast<uint64_t>(result >> 64);
+}
+
+inline uint64_t mix(uint64_t a, uint64_t b) {
+  multiply(&a, &b);
+  return a ^ b;
+}
+
+inline uint64_t read64(const uint8_t *ptr) {
+  uint64_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+inline uint64_t read32(const uint8_t *ptr) {
+  uint32_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+inline uint64_t read_small(const uint8_t *ptr, size_t size) {
+  return (uint64_t(ptr[0]) << 16) | (uint64_t(ptr[size >> 1]) << 8) | ptr[size - 1];
+}
+
+}
+
+inline uint64_t hash64(const void *data, size_t size, uint64_t seed = 0) {
+  using namespace hash_internal;
+
+  auto ptr = reinterpret_cast<const uint8_t *>(data);
+  uint64_t a, b;
+  seed ^= mix(seed ^ SECRET[0], SECRET[1]);
+
+  if (size <= 16) {
+    if (size >= 4) {
+      a = (read32(ptr) << 32) | read32(ptr + ((size >> 3) << 2));
+      b = (read32(ptr + size - 4) << 32) | read32(ptr + size - 4 - ((size >> 3) << 2));
+    } else if (size > 0) {
+      a = read_small(ptr, size);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    auto remaining = size;
+    if (remaining > 48) {
+      auto seed1 = seed, seed2 = seed;
+      do {
+        seed = mix(read64(ptr) ^ SECRET[1], read64(ptr + 8) ^ seed);
+        seed1 = mix(read64(ptr + 16) ^ SECRET[2], read64(ptr + 24) ^ seed1);
+        seed2 = mix(read64(ptr + 32) ^ SECRET[3], read64(ptr + 40) ^ seed2);
+        ptr += 48;
+        remaining -= 48;
+      } while (remaining > 48);
+      seed ^= seed1 ^ seed2;
+    }
+
+    while (remaining > 16) {
+      seed = mix(read64(ptr) ^ SECRET[1], read64(ptr + 8) ^ seed);
+      ptr += 16;
+      remaining -= 16;
+    }
+
+    a = read64(ptr + remaining - 16);
+    b = read64(ptr + remaining - 8);
+  }
+
+  a ^= SECRET[1];
+  b ^= seed;
+  multiply(&a, &b);
+  return mix(a ^ SECRET[0] ^ size, b ^ SECRET[1]);
+}
+
+#endif
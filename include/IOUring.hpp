@@ -0,0 +1,164 @@
+#ifndef IOURING_H
+#define IOURING_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+
+// Defined by linux/fs.h, clashes with Table::BLOCK_SIZE
+#undef BLOCK_SIZE
+
+// Minimal io_uring on top of the raw system calls. Requests are queued by a single
+// thread and completions are reaped by a single, possibly different, thread.
+class IOUring {
+public:
+  // Throws a std::system_error if io_uring isn't available
+  IOUring(uint32_t entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    m_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (m_fd == -1) {
+      throw std::system_error(errno, std::system_category());
+    }
+
+    m_sq_size = params.sq_off.array + params.sq_entries*sizeof(uint32_t);
+    m_cq_size = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+    m_sqes_size = params.sq_entries*sizeof(io_uring_sqe);
+
+    m_sq = map(m_sq_size, IORING_OFF_SQ_RING);
+    m_cq = map(m_cq_size, IORING_OFF_CQ_RING);
+    m_sqes = static_cast<io_uring_sqe *>(map(m_sqes_size, IORING_OFF_SQES));
+
+    auto sq = static_cast<char *>(m_sq), cq = static_cast<char *>(m_cq);
+    m_sq_head = reinterpret_cast<uint32_t *>(sq + params.sq_off.head);
+    m_sq_tail = reinterpret_cast<uint32_t *>(sq + params.sq_off.tail);
+    m_sq_mask = *reinterpret_cast<uint32_t *>(sq + params.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<uint32_t *>(sq + params.sq_off.array);
+    m_sq_entries = params.sq_entries;
+    m_cq_head = reinterpret_cast<uint32_t *>(cq + params.cq_off.head);
+    m_cq_tail = reinterpret_cast<uint32_t *>(cq + params.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<uint32_t *>(cq + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+  }
+
+  IOUring(const IOUring &) = delete;
+  IOUring &operator=(const IOUring &) = delete;
+
+  ~IOUring() {
+    munmap(m_sqes, m_sqes_size);
+    munmap(m_cq, m_cq_size);
+    munmap(m_sq, m_sq_size);
+    close(m_fd);
+  }
+
+  // Returns false if the submission queue is full
+  bool read(int fd, void *buffer, uint32_t size, uint64_t offset, uint64_t user_data) {
+    auto sqe = next_sqe();
+    if (!sqe) {
+      return false;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    return submit();
+  }
+
+  // Completes right away, e.g. to wake up the thread waiting for completions
+  bool nop(uint64_t user_data) {
+    auto sqe = next_sqe();
+    if (!sqe) {
+      return false;
+    }
+
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = user_data;
+    return submit();
+  }
+
+  // Blocks until a request has completed; res is the number of bytes read or -errno
+  void wait(uint64_t *user_data, int32_t *res) {
+    while (true) {
+      if (peek(user_data, res)) {
+        return;
+      }
+
+      if (syscall(__NR_io_uring_enter, m_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) == -1 && errno != EINTR) {
+        throw std::system_error(errno, std::system_category());
+      }
+    }
+  }
+
+  // Returns false if no request has completed
+  bool peek(uint64_t *user_data, int32_t *res) {
+    auto head = *m_cq_head;
+    if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+
+    auto &cqe = m_cqes[head & m_cq_mask];
+    *user_data = cqe.user_data;
+    *res = cqe.res;
+    __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+private:
+  void *map(uint64_t size, uint64_t offset) {
+    auto ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+    if (ptr == MAP_FAILED) {
+      throw std::system_error(errno, std::system_category());
+    }
+    return ptr;
+  }
+
+  io_uring_sqe *next_sqe() {
+    auto tail = *m_sq_tail;
+    if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries) {
+      return nullptr;
+    }
+
+    auto index = tail & m_sq_mask;
+    m_sq_array[index] = index;
+    memset(&m_sqes[index], 0, sizeof(io_uring_sqe));
+    return &m_sqes[index];
+  }
+
+  bool submit() {
+    __atomic_store_n(m_sq_tail, *m_sq_tail + 1, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, m_fd, 1, 0, 0, nullptr, 0) == -1) {
+      if (errno != EINTR) {
+        throw std::system_error(errno, std::system_category());
+      }
+    }
+    return true;
+  }
+
+  int m_fd;
+  void *m_sq;
+  void *m_cq;
+  io_uring_sqe *m_sqes;
+  uint64_t m_sq_size;
+  uint64_t m_cq_size;
+  uint64_t m_sqes_size;
+  uint32_t *m_sq_head;
+  uint32_t *m_sq_tail;
+  uint32_t *m_sq_array;
+  uint32_t m_sq_mask;
+  uint32_t m_sq_entries;
+  uint32_t *m_cq_head;
+  uint32_t *m_cq_tail;
+  uint32_t m_cq_mask;
+  io_uring_cqe *m_cqes;
+};
+
+#endif
@@ -1,18 +1,25 @@
 #ifndef KVSTORE_H
 #define KVSTORE_H
 
+#include <atomic>
 #include <cassert>
+#include <iostream>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "Buffer.hpp"
 #include "Config.hpp"
+#include "LookupResult.hpp"
 #include "LSMTree.hpp"
 #include "MemTable.hpp"
+#include "ScanRange.hpp"
+#include "ThreadPool.hpp"
 
 class KVStore{
 public:
-  KVStore(const Config &config): m_config(config) {
-    m_tree = std::make_shared<LSMTree>(config);
+  KVStore(const Config &config, ThreadPool *pool = nullptr): m_config(config) {
+    m_tree = std::make_shared<LSMTree>(config, pool);
   }
 
   ~KVStore() {
@@ -22,18 +29,22 @@ public:
   }
 
   std::shared_ptr<Buffer> get(const Buffer &key) {
-    assert(!m_destroyed);
+    auto result = lookup(key);
+    return result.is_found() ? result.value() : nullptr;
+  }
 
-    auto value = m_memtable.get(key);
-    if (value == nullptr) {
-      value = m_tree->get(key);
-    }
+  // Without waiting for reads the result is pending if a block has to be read first
+  LookupResult lookup(const Buffer &key, ReadMode mode = BLOCKING_READ) {
+    assert(!m_destroyed);
 
-    if (value == nullptr || *value == "") {
-      return nullptr;
+    auto result = m_memtable.get(key);
+    if (result.is_resolved()) {
+      m_memtable_hits.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      result = m_tree->get(key, mode);
     }
 
-    return value;
+    return result;
   }
 
   void add(const Buffer &key, const Buffer &value) {
@@ -55,6 +66,51 @@ public:
     m_memtable.add(key, "");
   }
 
+  // Visits the live entries with keys in [start, end) in key order until visit returns
+  // false; an empty end means no bound
+  void scan(const Buffer &start, const Buffer &end, const LSMTree::scan_visitor &visit) {
+    scan(ScanRange(start, end), visit);
+  }
+
+  // Visits the live entries whose keys start with prefix; tables that don't hold the prefix
+  // extracted from it, if any, are skipped (see Config::prefix_extractor)
+  void scan_prefix(const Buffer &prefix, const LSMTree::scan_visitor &visit) {
+    scan(ScanRange::prefix(prefix, m_config.prefix_extractor), visit);
+  }
+
+  void scan(const ScanRange &range, const LSMTree::scan_visitor &visit) {
+    assert(!m_destroyed);
+    m_tree->scan(range, visit, &m_memtable);
+  }
+
+  // Moves tables written elsewhere into the store, their values take precedence over the
+  // current ones; see LSMTree::ingest
+  void ingest(const std::vector<std::string> &paths) {
+    assert(!m_destroyed);
+
+    // Values in the memtable have to be older than the ingested ones
+    m_tree->dump_memtable(m_memtable);
+    m_memtable.clear();
+
+    for (const auto &path : paths) {
+      m_tree->ingest(path);
+    }
+  }
+
+  // Returns false if any table is corrupted, throws I/O errors, including the one a
+  // compaction failed with
+  bool verify() {
+    assert(!m_destroyed);
+
+    try {
+      m_tree->verify();
+      return true;
+    } catch (const CorruptionError &e) {
+      std::cerr << e.what() << std::endl;
+      return false;
+    }
+  }
+
   void destroy() {
     assert(!m_destroyed);
 
@@ -63,11 +119,18 @@ public:
     m_destroyed = true;
   }
 
+  friend std::ostream& operator<< (std::ostream& stream, const KVStore &store) {
+    stream << "memtable - " << store.m_memtable_hits.load(std::memory_order_relaxed) << " hits" << std::endl;
+    stream << *store.m_tree;
+    return stream;
+  }
+
 private:
   Config m_config;
   std::shared_ptr<LSMTree> m_tree;
   MemTable m_memtable;
   bool m_destroyed = false;
+  std::atomic<uint64_t> m_memtable_hits{0};
 };
 
 #endif
@@ -0,0 +1,116 @@
+#ifndef KEYPREFIX_H
+#define KEYPREFIX_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "Buffer.hpp"
+#include "Coding.hpp"
+
+// Fixed-width key prefixes: the 8 bytes of a key following the first skip bytes,
+// zero padded and read as a big-endian integer. If the prefix of x is smaller than
+// the one of y then x < y, so most key comparisons can be done on integers and only
+// equal prefixes need to be resolved by comparing the keys.
+inline uint64_t key_prefix(const Buffer &key, uint64_t skip) {
+  uint8_t bytes[sizeof(uint64_t)] = {0};
+  if (key.size() > skip) {
+    memcpy(bytes, key.data() + skip, std::min<uint64_t>(sizeof(bytes), key.size() - skip));
+  }
+
+  uint64_t prefix;
+  memcpy(&prefix, bytes, sizeof(prefix));
+  return __builtin_bswap64(prefix);
+}
+
+inline uint64_t common_prefix_length(const Buffer &x, const Buffer &y) {
+  uint64_t length = 0, size = std::min(x.size(), y.size());
+  while (length < size && x.data()[length] == y.data()[length]) {
+    length++;
+  }
+  return length;
+}
+
+namespace prefix_internal {
+
+// Ranges of at most this many prefixes are searched with a linear (vectorized) scan
+const uint64_t SCAN_THRESHOLD = 16;
+
+inline uint64_t count_less_scalar(const char *prefixes, uint64_t size, uint64_t prefix) {
+  uint64_t count = 0;
+  for (uint64_t i = 0; i < size; i++) {
+    count += decode_fixed64(prefixes + i*sizeof(uint64_t)) < prefix;
+  }
+  return count;
+}
+
+#if defined(__x86_64__)
+// There are only signed 64-bit comparisons; flipping the sign bits maps unsigned order onto signed order.
+__attribute__((target("avx2")))
+inline uint64_t count_less_avx2(const char *prefixes, uint64_t size, uint64_t prefix) {
+  const auto sign = _mm256_set1_epi64x(INT64_MIN);
+  const auto target = _mm256_xor_si256(_mm256_set1_epi64x(prefix), sign);
+  uint64_t count = 0, i = 0;
+
+  for (; i + 4 <= size; i += 4) {
+    auto values = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(prefixes + i*sizeof(uint64_t)));
+    auto less = _mm256_cmpgt_epi64(target, _mm256_xor_si256(values, sign));
+    count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+  }
+
+  return count + count_less_scalar(prefixes + i*sizeof(uint64_t), size - i, prefix);
+}
+
+__attribute__((target("sse4.2")))
+inline uint64_t count_less_sse(const char *prefixes, uint64_t size, uint64_t prefix) {
+  const auto sign = _mm_set1_epi64x(INT64_MIN);
+  const auto target = _mm_xor_si128(_mm_set1_epi64x(prefix), sign);
+  uint64_t count = 0, i = 0;
+
+  for (; i + 2 <= size; i += 2) {
+    auto values = _mm_loadu_si128(reinterpret_cast<const __m128i *>(prefixes + i*sizeof(uint64_t)));
+    auto less = _mm_cmpgt_epi64(target, _mm_xor_si128(values, sign));
+    count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(less)));
+  }
+
+  return count + count_less_scalar(prefixes + i*sizeof(uint64_t), size - i, prefix);
+}
+#endif
+
+inline uint64_t count_less(const char *prefixes, uint64_t size, uint64_t prefix) {
+#if defined(__x86_64__)
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  static const bool sse = __builtin_cpu_supports("sse4.2");
+
+  if (avx2) {
+    return count_less_avx2(prefixes, size, prefix);
+  } else if (sse) {
+    return count_less_sse(prefixes, size, prefix);
+  }
+#endif
+  return count_less_scalar(prefixes, size, prefix);
+}
+
+}
+
+// Index of the first of the sorted, unaligned prefixes that is not smaller than prefix
+inline uint64_t prefix_lower_bound(const char *prefixes, uint64_t size, uint64_t prefix) {
+  uint64_t first = 0;
+
+  while (size > prefix_internal::SCAN_THRESHOLD) {
+    auto half = size / 2;
+    if (decode_fixed64(prefixes + (first + half)*sizeof(uint64_t)) < prefix) {
+      first += half + 1;
+      size -= half + 1;
+    } else {
+      size = half;
+    }
+  }
+
+  return first + prefix_internal::count_less(prefixes + first*sizeof(uint64_t), size, prefix);
+}
+
+#endif
@@ -1,18 +1,45 @@
 #ifndef KEYVALUE_H
 #define KEYVALUE_H
 
+#include "AppendableMMap.hpp"
 #include "Buffer.hpp"
+#include "Coding.hpp"
 
+// Entries are stored as a key followed by a value. The varint in front of the value
+// holds its size shifted left by one; the low bit flags values that live in the value
+// log, in which case the value is an encoded pointer to it.
 struct KeyValue{
 public:
-  KeyValue(const char *buffer): key(Buffer::deserialize(buffer)),
-                                value(Buffer::deserialize(buffer + key.total_size())) {
+  KeyValue(const char *buffer): key(Buffer::deserialize(buffer)) {
+    uint64_t header;
+    auto data = decode_varint(buffer + key.total_size(), &header);
+    value = Buffer(data, header >> 1);
+    indirect = header & 1;
   }
 
   KeyValue() {}
 
+  uint64_t total_size() const {
+    return serialized_size(key, value, indirect);
+  }
+
+  static uint64_t serialized_size(const Buffer &key, const Buffer &value, bool indirect) {
+    return key.total_size() + varint_length((value.size() << 1) | indirect) + value.size();
+  }
+
+  template<typename Output>
+  static void serialize(Output &output, const Buffer &key, const Buffer &value, bool indirect) {
+    char header[MAX_VARINT_LENGTH];
+    auto header_end = encode_varint(header, (value.size() << 1) | indirect);
+
+    key.serialize(output);
+    output.appendFront(header, header_end - header);
+    output.appendFront(value.data(), value.size());
+  }
+
   Buffer key;
   Buffer value;
+  bool indirect = false;
 };
 
 #endif
@@ -1,28 +1,73 @@
 #ifndef LSMTREE_H
 #define LSMTREE_H
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
+#include <exception>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <string>
 #include <thread>
 #include <vector>
 
+#include "BlockCache.hpp"
+#include "BloomFilter.hpp"
 #include "Buffer.hpp"
+#include "Coding.hpp"
 #include "Config.hpp"
+#include "CRC32C.hpp"
 #include "Level.hpp"
+#include "LookupResult.hpp"
 #include "MemTable.hpp"
+#include "ScanRange.hpp"
+#include "TableCache.hpp"
+#include "ThreadPool.hpp"
+#include "ValueLog.hpp"
 
 class LSMTree {
 public:
-  LSMTree(const Config &config): m_config(config) {
+  // Called with every entry of a scan, the scan stops once it returns false
+  typedef std::function<bool(const Buffer &key, const Buffer &value)> scan_visitor;
+
+  // Tables are loaded on the pool, if any, or on a pool of Config::open_threads threads if
+  // there are several, otherwise by the calling thread.
+  // Throws an invalid_argument if the configuration doesn't fit the existing tree.
+  LSMTree(const Config &config, ThreadPool *pool = nullptr): m_config(config) {
     assert(m_config.levels.size() > 1);
+    auto start = std::chrono::steady_clock::now();
+    check_options();
+
+    std::unique_ptr<ThreadPool> local_pool;
+    if (!pool && m_config.open_threads > 1) {
+      local_pool.reset(new ThreadPool(m_config.open_threads));
+      pool = local_pool.get();
+    }
+
+    // Tables written with a value threshold keep referencing the log once it's turned off
+    if (m_config.value_threshold > 0 || ValueLog::exists(m_config)) {
+      m_vlog = std::make_shared<ValueLog>(m_config);
+    }
 
-    m_level0 = std::make_shared<Level0>(m_config.levels[0]);
+    if (m_config.max_open_tables > 0 || m_config.table_cache_size > 0) {
+      m_cache = std::make_shared<TableCache>(m_config.max_open_tables, m_config.table_cache_size);
+    }
+
+    if (m_config.io_backend != MMAP_IO && m_config.block_cache_size > 0) {
+      m_blocks = std::make_shared<BlockCache>(m_config.block_cache_size);
+    }
+
+    m_level0 = std::make_shared<Level0>(m_config.level(0), m_cache, m_blocks, pool);
     for (int i = 1; i < m_config.levels.size(); i++) {
-      m_levels.push_back(std::make_shared<LevelN>(m_config.levels[i]));
+      m_levels.push_back(std::make_shared<LevelN>(m_config.level(i), m_vlog, m_cache, m_blocks, pool));
     }
+    m_startup_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    update_filters();
 
     m_merger = std::make_shared<std::thread>(&LSMTree::background_merger, this);
   }
@@ -35,27 +80,149 @@ public:
     terminate_background_merger();
     // Level 0 tables are not contigous; as we load tables in sorted order
     // during construction we have to move Level 0 tables to Level 1.
-    if (m_level0->size() > 0) {
+    if (m_level0->size() > 0 && !m_merge_failed.load(std::memory_order_acquire)) {
       m_levels[0]->merge_with(m_level0);
     }
+
+    for (auto &level : m_levels) {
+      level->save_summary();
+    }
+    if (m_vlog) {
+      m_vlog->save_summary();
+    }
   }
 
-  std::shared_ptr<Buffer> get(const Buffer &key) {
+  // Values in the value log are always read synchronously
+  LookupResult get(const Buffer &key, ReadMode mode = BLOCKING_READ) {
     assert(!m_terminate_merge);
 
-    auto value = m_level0->get(key);
-    if (value) {
-      return value;
+    while (true) {
+      auto result = lookup(key, mode);
+      if (!result.is_indirect()) {
+        return result;
+      }
+
+      auto value = m_vlog->read(*result.value());
+      if (value) {
+        return LookupResult::found(value);
+      }
+
+      // The value has been relocated by the garbage collector in the meantime, retry
     }
+  }
+
+  // Visits the live entries in the range in key order, entries of the memtable, if any,
+  // taking precedence over the tables. Levels are snapshotted from the top down, so that
+  // tables moved down by a compaction meanwhile are seen at least once.
+  void scan(const ScanRange &range, const scan_visitor &visit, const MemTable *memtable = nullptr) {
+    assert(!m_terminate_merge);
 
+    std::vector<std::shared_ptr<Table>> tables;
+    m_level0->scan_tables(range, &tables);
     for (const auto &level : m_levels) {
-      auto value = level->get(key);
-      if (value) {
-        return value;
+      level->scan_tables(range, &tables);
+    }
+
+    std::vector<TableIterator> iterators, ends;
+    for (const auto &table : tables) {
+      iterators.push_back(table->lower_bound(range.start));
+      ends.push_back(table->end());
+    }
+
+    // Smallest key on top, the newest table first among equal keys
+    auto later = [&iterators](uint64_t x, uint64_t y) {
+      auto cmp = iterators[x]->key.compare(iterators[y]->key);
+      return cmp > 0 || (cmp == 0 && x > y);
+    };
+    std::priority_queue<uint64_t, std::vector<uint64_t>, decltype(later)> heap(later);
+    for (uint64_t i = 0; i < tables.size(); i++) {
+      if (iterators[i] != ends[i]) {
+        heap.push(i);
+      }
+    }
+
+    MemTable empty;
+    auto entry = (memtable ? memtable : &empty)->lower_bound(range.start);
+    auto memtable_end = (memtable ? memtable : &empty)->end();
+    // Copies, iterators reading with pread move their window past the entries
+    std::string key, value;
+
+    while (true) {
+      bool from_memtable = entry != memtable_end && (heap.empty() || Buffer(entry->first) <= iterators[heap.top()]->key);
+      if (!from_memtable && heap.empty()) {
+        break;
+      }
+
+      bool indirect = false;
+      if (from_memtable) {
+        key = entry->first;
+        value = entry->second;
+        ++entry;
+      } else {
+        auto item = *iterators[heap.top()];
+        key.assign(item.key.data(), item.key.size());
+        value.assign(item.value.data(), item.value.size());
+        indirect = item.indirect;
+      }
+
+      if (range.after(key)) {
+        break;
+      }
+
+      // Older versions of the key are skipped
+      while (!heap.empty() && iterators[heap.top()]->key == Buffer(key)) {
+        auto i = heap.top();
+        heap.pop();
+        if (++iterators[i] != ends[i]) {
+          heap.push(i);
+        }
+      }
+
+      Buffer result = value;
+      std::shared_ptr<Buffer> stored;
+      if (indirect) {
+        // The value may have been relocated by the garbage collector in the meantime
+        stored = m_vlog->read(value);
+        if (!stored) {
+          auto lookup = get(key);
+          if (!lookup.is_found()) {
+            continue;
+          }
+          stored = lookup.value();
+        }
+        result = *stored;
+      } else if (value.empty()) {
+        continue; // Tombstone
+      }
+
+      if (!visit(key, result)) {
+        break;
       }
     }
+  }
 
-    return nullptr;
+  // Seconds it took to open the tree
+  double startup_time() const {
+    return m_startup_time;
+  }
+
+  // Number of tables whose metadata was restored from the level summaries at startup
+  uint64_t restored() const {
+    uint64_t restored = 0;
+    for (const auto &level : m_levels) {
+      restored += level->restored();
+    }
+    return restored;
+  }
+
+  // Level i of the tree, 0 being the first, e.g. to look at its statistics
+  std::shared_ptr<Level> level(uint32_t i) const {
+    return (i == 0) ? std::static_pointer_cast<Level>(m_level0) : m_levels[i - 1];
+  }
+
+  // Number of point lookups that reached the bottom without resolving the key
+  uint64_t misses() const {
+    return m_misses.load(std::memory_order_relaxed);
   }
 
   void dump_memtable(const MemTable &mem_table) {
@@ -65,77 +232,353 @@ public:
       return;
     }
 
-    m_level0->dump_memtable(mem_table);
+    std::unique_lock<std::mutex> dump_lock(m_dump_mutex);
+    m_level0->dump_memtable(mem_table, m_vlog.get());
+    dump_lock.unlock();
+
     std::unique_lock<std::mutex> lock(m_mutex);
     m_new_data.notify_one();
   }
 
+  // Moves the table at path, e.g. written by an SSTWriter, into the deepest level above all
+  // levels holding keys in its range, so that it takes precedence over older values.
+  // Throws a CorruptionError, and leaves the file where it is, if the table is corrupted.
+  void ingest(const std::string &path) {
+    assert(!m_terminate_merge);
+
+    // Levels are only changed by compactions and garbage collection otherwise, which hold the lock
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    auto table = Table::load_table(path);
+    table->verify();
+    auto min = std::string(table->min_key().data(), table->min_key().size());
+    auto max = std::string(table->max_key().data(), table->max_key().size());
+    table = nullptr;
+
+    // Level 0 can always take a newer table, the others only if they and all levels above
+    // don't hold keys in its range
+    std::shared_ptr<Level> target = m_level0;
+    if (!m_level0->overlaps(min, max)) {
+      for (const auto &level : m_levels) {
+        if (level->overlaps(min, max)) {
+          break;
+        }
+        target = level;
+      }
+    }
+    target->ingest(path);
+
+    m_new_data.notify_one();
+  }
+
   void destroy() {
     if (m_terminate_merge) { // Return if tree has been already destroyed
       return;
     }
 
     terminate_background_merger();
+    if (m_vlog) {
+      m_vlog->destroy();
+    }
     m_level0->destroy();
     for (auto &level : m_levels) {
       level->destroy();
     }
   }
 
+  // Verifies the checksums of all tables, throws a CorruptionError on mismatch. Rethrows
+  // the error a compaction failed with, if any.
+  void verify() {
+    if (m_merge_failed.load(std::memory_order_acquire)) {
+      std::rethrow_exception(m_merge_error);
+    }
+
+    m_level0->verify();
+    for (auto &level : m_levels) {
+      level->verify();
+    }
+  }
+
   friend std::ostream& operator<< (std::ostream& stream, const LSMTree &tree) {
     stream << "level 0 - " << *tree.m_level0 << std::endl;
     for (int i = 0; i < tree.m_levels.size(); i++) {
-      stream << "level " << i + 1 << " - " << *tree.m_levels[i] << std::endl;
+      stream << "level " << i + 1 << " - " << *tree.m_levels[i];
+      if (tree.m_levels[i]->tiered()) {
+        stream << ", " << tree.m_levels[i]->runs() << " runs";
+      }
+      stream << std::endl;
     }
+    stream << "misses - " << tree.misses() << std::endl;
+    stream << "startup - " << tree.startup_time()*1000 << " ms, " << tree.restored()
+           << " tables restored from summaries" << std::endl;
+    if (tree.m_vlog) {
+      stream << "value log - " << *tree.m_vlog << std::endl;
+    }
+    if (tree.m_cache) {
+      stream << "table cache - " << *tree.m_cache << std::endl;
+    }
+    if (tree.m_blocks) {
+      stream << "block cache - " << *tree.m_blocks << std::endl;
+    }
+    if (tree.m_config.rate_limiter) {
+      stream << "rate limiter - " << *tree.m_config.rate_limiter << std::endl;
+    }
+    return stream;
   }
 
 private:
+  std::string options_path() const {
+    return path_append(m_config.levels[0].path_db, "options");
+  }
+
+  // Options that can't change once the tree holds data are saved along with it, and the
+  // tree refuses to open with different ones. Trees saved without options take any.
+  void check_options() {
+    auto path = options_path();
+    if (m_config.levels[0].overwrite) {
+      delete_file(path);
+    }
+
+    std::string options;
+    put_fixed64(&options, m_config.prefix_extractor.id());
+    options.push_back(m_config.compaction_style);
+
+    std::string contents;
+    if (read_file(path, &contents) && contents.size() == options.size() + sizeof(uint32_t) &&
+        crc32c(contents.data(), options.size()) == decode_fixed32(contents.data() + options.size())) {
+      // Keys of a partitioned store would be looked up in other partitions
+      if (m_config.parallelism > 1 && decode_fixed64(contents.data()) != m_config.prefix_extractor.id()) {
+        throw std::invalid_argument("the prefix extractor of a partitioned store can't be changed");
+      }
+
+      // Leveled levels can become tiered but not back, as their runs would overlap
+      auto saved = m_config;
+      saved.compaction_style = CompactionStyle(contents[sizeof(uint64_t)]);
+      for (uint32_t i = 1; i < m_config.levels.size(); i++) {
+        if (saved.level(i).compaction_style == TIERED_COMPACTION &&
+            m_config.level(i).compaction_style != TIERED_COMPACTION) {
+          throw std::invalid_argument("tiered levels of a store can't become leveled");
+        }
+      }
+    }
+
+    put_fixed32(&options, crc32c(options.data(), options.size()));
+    mkdir(m_config.levels[0].path_db);
+    write_file(path, options);
+  }
+
+  // Searches the levels, newest first; values in the value log are not resolved
+  LookupResult lookup(const Buffer &key, ReadMode mode = BLOCKING_READ) {
+    // Stop at the first level that resolves the key, tombstones included
+    auto result = m_level0->get(key, mode);
+    if (result.is_resolved()) {
+      return result;
+    }
+
+    for (const auto &level : m_levels) {
+      result = level->get(key, mode);
+      if (result.is_resolved()) {
+        return result;
+      }
+    }
+
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+    return result;
+  }
+
+  // Ingested tables can push any level but the last one over its threshold; the runs of
+  // a tiered last level are merged with each other
+  bool needs_merging() {
+    for (uint64_t i = 0; i + 1 < m_levels.size(); i++) {
+      if (m_levels[i]->needs_merging()) {
+        return true;
+      }
+    }
+    return m_level0->needs_merging() || (m_levels.back()->tiered() && m_levels.back()->needs_merging());
+  }
+
   void terminate_background_merger() {
     std::unique_lock<std::mutex> lock(m_mutex);
     m_terminate_merge = true;
     m_new_data.notify_one();
     lock.unlock();
     m_merger->join();
+
+    if (m_config.rate_limiter) {
+      m_config.rate_limiter->add_debt(-int64_t(m_debt));
+      m_debt = 0;
+    }
+  }
+
+  // Compaction debt, i.e. bytes of the tables levels hold in excess of their threshold,
+  // is reported to the rate limiter so that it can be tuned
+  void update_debt() {
+    if (!m_config.rate_limiter) {
+      return;
+    }
+
+    uint64_t debt = 0;
+    for (uint32_t i = 0; i < m_config.levels.size(); i++) {
+      auto size = (i == 0) ? m_level0->size() : m_levels[i - 1]->size();
+      if (size > m_config.levels[i].threshold) {
+        debt += (size - m_config.levels[i].threshold)*m_config.levels[i].table_size;
+      }
+    }
+
+    m_config.rate_limiter->add_debt(int64_t(debt) - int64_t(m_debt));
+    m_debt = debt;
+  }
+
+  // Spreads the filter memory over the levels according to their current number of
+  // entries. A level that is still empty is expected to grow as large as the one above.
+  void update_filters() {
+    if (m_config.filter_memory == 0) {
+      return;
+    }
+
+    std::vector<uint64_t> entries(1, m_level0->entries());
+    for (const auto &level : m_levels) {
+      entries.push_back(std::max(level->entries(), entries.back()));
+    }
+
+    auto bits = BloomFilter::allocate(entries, m_config.filter_memory*8.0);
+    m_level0->set_filter_bits(bits[0]);
+    for (uint64_t i = 0; i < m_levels.size(); i++) {
+      m_levels[i]->set_filter_bits(bits[i + 1]);
+    }
+  }
+
+  // Whether a value log file has enough garbage to be collected
+  bool needs_collecting() {
+    uint64_t file;
+    return m_vlog && m_vlog->gc_candidate(&file);
+  }
+
+  // Relocates the live values of the value log file with the most garbage, if any has
+  // enough. Called by the merger, which holds lock on m_mutex.
+  void collect_garbage(std::unique_lock<std::mutex> &lock) {
+    uint64_t file;
+    if (!m_vlog || !m_vlog->gc_candidate(&file)) {
+      return;
+    }
+
+    // Values that look live are gathered without holding up dumps, ingestion or the
+    // termination of the merger
+    struct Value {
+      std::string key;
+      std::string value;
+      std::string pointer;
+    };
+    std::vector<Value> live;
+    auto is_live = [this](const Buffer &key, const std::string &pointer) {
+      auto result = lookup(key);
+      return result.is_indirect() && *result.value() == pointer;
+    };
+
+    lock.unlock();
+    try {
+      m_vlog->scan(file, [&](const Buffer &key, const Buffer &value, const std::string &pointer) {
+        if (is_live(key, pointer)) {
+          live.push_back({std::string(key.data(), key.size()), std::string(value.data(), value.size()), pointer});
+        }
+      });
+    } catch (...) {
+      lock.lock();
+      throw;
+    }
+    lock.lock();
+
+    // Dumps are blocked so that no newer value can be written for a key between
+    // checking again whether a value is live and writing its new location
+    std::lock_guard<std::mutex> dump_lock(m_dump_mutex);
+    MemTable relocated;
+    for (const auto &item : live) {
+      if (is_live(item.key, item.pointer)) {
+        relocated.add(item.key, item.value);
+      }
+    }
+
+    if (relocated.size() > 0) {
+      m_level0->dump_memtable(relocated, m_vlog.get());
+    }
+    m_vlog->remove(file);
   }
 
   void background_merger() {
     std::unique_lock<std::mutex> lock(m_mutex);
 
     while (true) {
+      // Compactions stop at the first error, e.g. a corrupted table, which stays where it is
       m_new_data.wait(lock, [this](){
-        return this->m_level0->needs_merging() || this->m_terminate_merge;
+        return (!this->m_merge_failed.load(std::memory_order_relaxed) &&
+                (this->needs_merging() || this->needs_collecting())) || this->m_terminate_merge;
       });
 
       if (this->m_terminate_merge) {
         return;
       }
 
-      if (m_level0->needs_merging()) {
-        m_levels[0]->merge_with(m_level0);
+      // A single value log file is collected per round, so that compactions aren't held up
+      try {
+        merge();
+        collect_garbage(lock);
+      } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        m_merge_error = std::current_exception();
+        m_merge_failed.store(true, std::memory_order_release);
       }
+    }
+  }
 
-      for (int i = 1; i < m_levels.size(); i++) {
-        auto &prev = m_levels[i - 1];
-        auto &curr = m_levels[i];
+  // Compacts all levels that need it, one level after the other; the levels involved in a
+  // failed compaction are left as they are
+  void merge() {
+    update_debt();
+    update_filters();
+    if (m_level0->needs_merging()) {
+      m_levels[0]->merge_with(m_level0);
+      update_debt();
+      update_filters();
+    }
 
-        if (!prev->needs_merging()) {
-          continue;
-        }
+    for (int i = 1; i < m_levels.size(); i++) {
+      auto &prev = m_levels[i - 1];
+      auto &curr = m_levels[i];
 
-        curr->merge_with(prev);
+      if (!prev->needs_merging()) {
+        continue;
       }
+
+      curr->merge_with(prev);
+      update_debt();
+      update_filters();
+    }
+
+    if (m_levels.back()->tiered() && m_levels.back()->needs_merging()) {
+      m_levels.back()->merge_runs();
+      update_debt();
+      update_filters();
     }
   }
 
   Config m_config;
+  std::shared_ptr<ValueLog> m_vlog;
+  std::shared_ptr<TableCache> m_cache;
+  std::shared_ptr<BlockCache> m_blocks;
   std::shared_ptr<Level0> m_level0;
   std::vector<std::shared_ptr<LevelN>> m_levels;
 
   std::shared_ptr<std::thread> m_merger;
   std::condition_variable m_new_data;
   std::mutex m_mutex;
+  std::mutex m_dump_mutex;
 
   bool m_terminate_merge = false;
+  std::exception_ptr m_merge_error;
+  std::atomic<bool> m_merge_failed{false};
+  double m_startup_time;
+  uint64_t m_debt = 0;
+  std::atomic<uint64_t> m_misses{0};
 };
 
 #endif
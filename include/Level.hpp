@@ -4,37 +4,59 @@
 #include <cassert>
 #include <cstdint>
 #include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <memory>
 #include <mutex>
 #include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include "BlockCache.hpp"
+#include "BloomFilter.hpp"
 #include "Buffer.hpp"
+#include "Coding.hpp"
 #include "Config.hpp"
+#include "CRC32C.hpp"
+#include "CuckooIndex.hpp"
+#include "FenceIndex.hpp"
 #include "FileSystem.hpp"
+#include "LookupResult.hpp"
 #include "MemTable.hpp"
+#include "ScanRange.hpp"
 #include "Table.hpp"
 #include "TableBuilder.hpp"
+#include "TableCache.hpp"
+#include "ThreadPool.hpp"
+#include "ValueLog.hpp"
 
 class LevelN;
 
 class Level {
 public:
-  Level(LevelConfig config): m_config(config) {
+  // Tables are opened lazily through the cache, if any, and loaded in parallel on the pool, if any.
+  // Tables read with pread share the block cache, if any.
+  Level(LevelConfig config, std::shared_ptr<TableCache> cache = nullptr, std::shared_ptr<BlockCache> blocks = nullptr,
+        ThreadPool *pool = nullptr):
+      m_config(config),
+      m_cache(cache),
+      m_blocks(blocks),
+      m_filter_bits(config.filter_bits) {
     if (config.overwrite) {
       delete_directory(config.path_level);
+      delete_file(summary_path());
     }
 
     // Create directory if it doesn't exists; if it does load existing tables and sort them by their min key
     mkdir(config.path_db);
     mkdir(config.path_level);
-
-    auto files = ls(config.path_level);
-    for (auto &file : files) {
-      m_tables.push_back(Table::load_table(path_append(config.path_level, file)));
-    }
+    load_tables(pool);
 
     // Level 0 tables are not contigous; as we load tables in sorted order
     // during construction we move Level 0 tables to Level 1 during destruction.
@@ -47,11 +69,83 @@ public:
     });
   }
 
-  virtual std::shared_ptr<Buffer> get(const Buffer &) = 0;
+  // Pending lookups are repeated, they are only counted once they complete
+  LookupResult get(const Buffer &key, ReadMode mode = BLOCKING_READ) {
+    auto result = lookup(key, mode);
+    if (result.is_pending()) {
+      return result;
+    }
+
+    m_lookups.fetch_add(1, std::memory_order_relaxed);
+    if (result.is_resolved()) {
+      m_hits.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return result;
+  }
+
+  // Number of point lookups that reached this level
+  uint64_t lookups() const {
+    return m_lookups.load(std::memory_order_relaxed);
+  }
+
+  // Number of point lookups resolved by this level, either with a value or a tombstone
+  uint64_t hits() const {
+    return m_hits.load(std::memory_order_relaxed);
+  }
+
+  // Bits per key of the filters of tables written from now on
+  void set_filter_bits(double bits) {
+    m_filter_bits.store(bits, std::memory_order_relaxed);
+  }
+
+  double filter_bits() const {
+    return m_filter_bits.load(std::memory_order_relaxed);
+  }
+
+  // Number of entries in all tables
+  uint64_t entries() {
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    uint64_t entries = 0;
+    for (const auto &table : m_tables) {
+      entries += table->size();
+    }
+    return entries;
+  }
+
+  // Average false positive rate the filters of the tables should have, 1 without filters
+  double expected_false_positive_rate() {
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    return expected_rate();
+  }
+
+  // Fraction of the probes of filters for keys missing from a table that passed, 0 without probes
+  double observed_false_positive_rate() const {
+    double false_positives = m_false_positives.load(std::memory_order_relaxed);
+    double negatives = m_filtered.load(std::memory_order_relaxed);
+    return (false_positives + negatives > 0) ? false_positives / (false_positives + negatives) : 0;
+  }
+
+  // Appends the tables that may hold keys in the range, newest first
+  void scan_tables(const ScanRange &range, std::vector<std::shared_ptr<Table>> *tables) {
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    overlapping(range, tables);
+  }
+
+  // Number of tables read by scans
+  uint64_t scanned() const {
+    return m_scanned.load(std::memory_order_relaxed);
+  }
+
+  // Number of tables within the key range of a scan skipped thanks to their filters
+  uint64_t skipped() const {
+    return m_skipped.load(std::memory_order_relaxed);
+  }
 
   void destroy() {
     std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
     m_tables.clear();
+    tables_changed();
     delete_directory(m_config.path_level);
     delete_directory(m_config.path_db);
   }
@@ -61,52 +155,285 @@ public:
     return m_tables.size();
   }
 
-  bool needs_merging() {
+  // Verifies the checksums of all tables, throws a CorruptionError on mismatch
+  void verify() {
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    auto tables = m_tables;
+    lock.unlock();
+
+    for (const auto &table : tables) {
+      table->verify();
+    }
+  }
+
+  // Persists the metadata of all tables so that the next start doesn't need to read them
+  void save_summary() {
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    std::string summary;
+
+    for (const auto &table : m_tables) {
+      auto name = table->path().substr(table->path().rfind('/') + 1);
+      auto metadata = table->metadata();
+      put_length_prefixed(&summary, name.data(), name.size());
+      put_length_prefixed(&summary, metadata.data(), metadata.size());
+    }
+    lock.unlock();
+
+    put_fixed32(&summary, crc32c(summary.data(), summary.size()));
+    write_file(summary_path(), summary);
+  }
+
+  // Number of tables restored from the summary when the level was opened
+  uint64_t restored() const {
+    return m_restored;
+  }
+
+  virtual bool needs_merging() {
     std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
     return m_tables.size() > m_config.threshold;
   }
 
+  // Whether any table holds keys in [min, max]
+  bool overlaps(const Buffer &min, const Buffer &max) {
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    for (const auto &table : m_tables) {
+      if (table->min_key() <= max && table->max_key() >= min) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Takes over the file of a table written elsewhere, which is moved into the level
+  void ingest(const std::string &path) {
+    auto destination = TableBuilder::new_table_path(m_config.path_level);
+    move_file(path, destination);
+
+    auto table = Table::load_table(destination, m_config.verify_checksums);
+    prepare(*table);
+    table->cache(m_cache);
+    add(table);
+  }
+
   friend std::ostream& operator<< (std::ostream& stream, Level &level) {
     std::shared_lock<std::shared_timed_mutex> lock(level.m_mutex);
-    stream << level.m_tables.size() << " tables";
+    stream << level.m_tables.size() << " tables, " << level.lookups() << " lookups, " << level.hits() << " hits";
+    // Nothing to tell about the filters of a level without any
+    if (level.filter_bits() > 0 && level.has_filters()) {
+      stream << ", filters with " << level.filter_bits() << " bits per key, " << level.expected_rate()
+             << " expected and " << level.observed_false_positive_rate() << " observed false positive rate";
+    }
+    if (level.scanned() + level.skipped() > 0) {
+      stream << ", " << level.scanned() << " tables scanned, " << level.skipped() << " skipped";
+    }
     return stream;
   }
 
 protected:
-  LevelConfig m_config;
-  std::vector<std::shared_ptr<Table>> m_tables;
-  std::shared_timed_mutex m_mutex;
-};
+  virtual LookupResult lookup(const Buffer &key, ReadMode mode) = 0;
 
-class Level0 : public Level {
-public:
-  Level0(LevelConfig config): Level(config) {}
+  // Appends the tables overlapping the range that scans have to read, newest first; must
+  // be called with the level locked
+  virtual void overlapping(const ScanRange &range, std::vector<std::shared_ptr<Table>> *tables) = 0;
 
-  std::shared_ptr<Buffer> get(const Buffer &key) {
-    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+  // Whether a scan has to read a table within its key range
+  bool scans(const Table &table, const ScanRange &range) {
+    if (range.may_overlap(table)) {
+      m_scanned.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    m_skipped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
 
-    for (auto it = m_tables.rbegin(); it != m_tables.rend(); ++it) {
-      auto table = *it;
-      auto value = table->get(key);
-      if (value != nullptr) {
-        return value;
+  // Looks the key up in the table unless its filter, given the BloomFilter::hash() of the
+  // key, rules it out
+  LookupResult probe(Table &table, const Buffer &key, uint64_t hash, ReadMode mode) {
+    if (!table.has_filter() || key < table.min_key() || key > table.max_key()) {
+      return table.get(key, mode);
+    }
+
+    if (!table.may_contain(hash)) {
+      m_filtered.fetch_add(1, std::memory_order_relaxed);
+      return LookupResult::not_found();
+    }
+
+    auto result = table.get(key, mode);
+    if (!result.is_resolved()) {
+      m_false_positives.fetch_add(1, std::memory_order_relaxed);
+    }
+    return result;
+  }
+
+  // Configuration of new tables, with the current bits per key of their filters
+  LevelConfig table_config() const {
+    auto config = m_config;
+    config.filter_bits = filter_bits();
+    return config;
+  }
+
+  // Must be called with the level locked
+  bool has_filters() const {
+    return std::any_of(m_tables.begin(), m_tables.end(), [](const auto &table) { return table->has_filter(); });
+  }
+
+  // Must be called with the level locked
+  double expected_rate() const {
+    double sum = 0;
+    uint64_t filters = 0;
+    for (const auto &table : m_tables) {
+      if (table->has_filter()) {
+        sum += table->false_positive_rate();
+        filters++;
       }
     }
+    return (filters > 0) ? sum / filters : 1;
+  }
 
-    return nullptr;
+  // Sets up how a new table is read. Tables serve point lookups, readahead would only
+  // pollute the page cache.
+  void prepare(Table &table) const {
+    table.read_with(m_config.io_backend, m_blocks);
+    if (m_config.access_hints) {
+      table.advise(MADV_RANDOM);
+    }
   }
 
-  void dump_memtable(const MemTable &mem_table) {
-    auto builder = TableBuilder(m_config.table_size, m_config.path_level);
-    std::vector<std::shared_ptr<Table>> tables;
+  std::string summary_path() const {
+    return m_config.path_level + ".summary";
+  }
+
+  // Tables in the summary whose size didn't change are restored from it, the others are read
+  void load_tables(ThreadPool *pool) {
+    auto files = ls(m_config.path_level);
+    auto summary = read_summary();
+    std::vector<std::future<void>> pending;
+    m_tables.resize(files.size());
+
+    for (uint64_t i = 0; i < files.size(); i++) {
+      auto path = path_append(m_config.path_level, files[i]);
+      auto metadata = summary.find(files[i]);
+      std::function<void()> load;
+
+      if (metadata != summary.end() && file_size(path) == int64_t(decode_fixed64(metadata->second.data()))) {
+        m_restored++;
+        load = [this, i, path, metadata]() {
+          m_tables[i] = std::make_shared<Table>(path, metadata->second, m_cache, m_config.verify_checksums);
+          prepare(*m_tables[i]);
+        };
+      } else {
+        load = [this, i, path]() {
+          m_tables[i] = Table::load_table(path, m_config.verify_checksums, m_cache);
+          prepare(*m_tables[i]);
+        };
+      }
+
+      if (pool) {
+        pending.push_back(pool->submit(load));
+      } else {
+        load();
+      }
+    }
 
+    // Loads still running would fill in a level that's gone, the first error is rethrown
+    // once all of them are done
+    std::exception_ptr error;
+    for (auto &result : pending) {
+      try {
+        result.get();
+      } catch (...) {
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  // Table names and their metadata; a corrupted summary is ignored
+  std::unordered_map<std::string, std::string> read_summary() const {
+    std::unordered_map<std::string, std::string> summary;
+    std::string contents;
+
+    if (!read_file(summary_path(), &contents) || contents.size() < sizeof(uint32_t)) {
+      return summary;
+    }
+
+    auto end = contents.data() + contents.size() - sizeof(uint32_t);
+    if (crc32c(contents.data(), end - contents.data()) != decode_fixed32(end)) {
+      return summary;
+    }
+
+    for (auto ptr = contents.data(); ptr < end; ) {
+      uint64_t name_size, metadata_size;
+      ptr = decode_varint(ptr, &name_size);
+      std::string name(ptr, name_size);
+      ptr = decode_varint(ptr + name_size, &metadata_size);
+      summary[name] = std::string(ptr, metadata_size);
+      ptr += metadata_size;
+    }
+
+    return summary;
+  }
+
+  // Invoked with the level locked exclusively whenever its list of tables changed
+  virtual void tables_changed() {}
+
+  // Adds a new table to the level
+  virtual void add(std::shared_ptr<Table> table) = 0;
+
+  LevelConfig m_config;
+  std::shared_ptr<TableCache> m_cache;
+  std::shared_ptr<BlockCache> m_blocks;
+  std::vector<std::shared_ptr<Table>> m_tables;
+  std::shared_timed_mutex m_mutex;
+  std::atomic<uint64_t> m_lookups{0};
+  std::atomic<uint64_t> m_hits{0};
+  std::atomic<double> m_filter_bits;
+  std::atomic<uint64_t> m_filtered{0};
+  std::atomic<uint64_t> m_false_positives{0};
+  std::atomic<uint64_t> m_scanned{0};
+  std::atomic<uint64_t> m_skipped{0};
+  uint64_t m_restored = 0;
+};
+
+class Level0 : public Level {
+public:
+  Level0(LevelConfig config, std::shared_ptr<TableCache> cache = nullptr, std::shared_ptr<BlockCache> blocks = nullptr,
+         ThreadPool *pool = nullptr):
+      Level(config, cache, blocks, pool) {}
+
+  // Large values are moved to the value log, if any
+  void dump_memtable(const MemTable &mem_table, ValueLog *vlog = nullptr) {
+    auto builder = TableBuilder(m_config.table_size, m_config.path_level, m_config.index_type, m_config.rate_limiter,
+                                FLUSH_PRIORITY, filter_bits(), m_config.prefix_extractor,
+                                m_config.range_filter, m_config.range_filter_suffix_bits);
+    std::vector<std::shared_ptr<Table>> tables;
+    // Key hashes of every table in entry order, if the level is indexed
+    std::vector<std::vector<uint64_t>> hashes(1);
 
     for (const auto &item : mem_table) {
-      if (!builder.add(item.first, item.second)) {
+      Buffer value = item.second;
+      std::string pointer;
+      bool indirect = vlog && vlog->separates(value);
+
+      if (indirect) {
+        pointer = vlog->append(item.first, value);
+        value = pointer;
+      }
+
+      if (!builder.add(item.first, value, indirect)) {
         tables.push_back(builder.finalize());
-        auto res = builder.add(item.first, item.second);
+        hashes.emplace_back();
+        auto res = builder.add(item.first, value, indirect);
         assert(res);
       }
+
+      if (m_config.hash_index) {
+        hashes.back().push_back(Buffer(item.first).hash(CuckooIndex::SEED));
+      }
     }
 
     auto last = builder.finalize();
@@ -114,38 +441,110 @@ public:
       tables.push_back(last);
     }
 
-    std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
+    if (vlog) {
+      vlog->sync();
+    }
+
     for (const auto &table : tables) {
-      m_tables.push_back(table);
+      prepare(*table);
+      table->cache(m_cache);
     }
+
+    append(tables, hashes);
+  }
+
+  // Number of keys in the hash index and its size in bytes
+  std::pair<uint64_t, uint64_t> index_size() {
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    return {m_index.size(), m_index.memory()};
   }
 
   friend LevelN;
-};
 
-class LevelN : public Level {
-public:
-  LevelN(LevelConfig config): Level(config) {}
+protected:
+  // Appends new tables given the key hashes of each, in entry order, if the level is indexed
+  void append(const std::vector<std::shared_ptr<Table>> &tables, const std::vector<std::vector<uint64_t>> &hashes) {
+    std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
+    for (uint64_t i = 0; i < tables.size(); i++) {
+      m_tables.push_back(tables[i]);
+
+      // Newer tables overwrite the locations of keys they share with older ones
+      auto id = m_next_table++;
+      for (uint64_t entry = 0; m_config.hash_index && entry < hashes[i].size(); entry++) {
+        m_index.insert(hashes[i][entry], id, entry);
+      }
+    }
+  }
 
-  std::shared_ptr<Buffer> get(const Buffer &key) {
+  LookupResult lookup(const Buffer &key, ReadMode mode) {
     std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
 
-    // Binary search on tables
-    int32_t min = 0, max = m_tables.size() - 1;
-    while (min <= max) {
-      auto half = (min + max) / 2;
-      auto &table = m_tables[half];
+    if (m_config.hash_index) {
+      auto location = m_index.find(key.hash(CuckooIndex::SEED));
+      if (!location) {
+        return LookupResult::not_found();
+      }
+
+      // Keys with the same hash share a location; only the newest one is indexed
+      auto result = m_tables[location->table - first_table()]->get(key, location->entry, mode);
+      if (result.status() != LookupResult::NOT_FOUND) {
+        return result;
+      }
+    }
 
-      if (key < table->min_key()) {
-        max = half -1;
-      } else if (key > table->max_key()) {
-        min = half + 1;
-      } else {
-        return table->get(key);
+    // Tables overlap, the first one that knows about the key (newest first) wins
+    auto hash = BloomFilter::hash(key);
+    for (auto it = m_tables.rbegin(); it != m_tables.rend(); ++it) {
+      auto result = probe(**it, key, hash, mode);
+      if (result.is_resolved()) {
+        return result;
+      }
+    }
+
+    return LookupResult::not_found();
+  }
+
+  void overlapping(const ScanRange &range, std::vector<std::shared_ptr<Table>> *tables) {
+    for (auto it = m_tables.rbegin(); it != m_tables.rend(); ++it) {
+      if ((*it)->max_key() >= Buffer(range.start) && !range.after((*it)->min_key()) && scans(**it, range)) {
+        tables->push_back(*it);
       }
     }
+  }
+
+  // Ingested tables are the newest ones
+  void add(std::shared_ptr<Table> table) {
+    std::vector<uint64_t> hashes;
+    for (auto it = table->begin(); m_config.hash_index && it != table->end(); ++it) {
+      hashes.push_back(it->key.hash(CuckooIndex::SEED));
+    }
+    append({table}, {hashes});
+  }
+
+  // Tables are only ever appended and removed from the front
+  void tables_changed() {
+    if (m_config.hash_index) {
+      m_index.erase_before(first_table());
+    }
+  }
+
+private:
+  uint64_t first_table() const {
+    return m_next_table - m_tables.size();
+  }
 
-    return nullptr;
+  CuckooIndex m_index;
+  uint64_t m_next_table = 0;
+};
+
+class LevelN : public Level {
+public:
+  LevelN(LevelConfig config, std::shared_ptr<ValueLog> vlog = nullptr, std::shared_ptr<TableCache> cache = nullptr,
+         std::shared_ptr<BlockCache> blocks = nullptr, ThreadPool *pool = nullptr):
+      Level(config, cache, blocks, pool),
+      m_vlog(vlog) {
+    sort_tables(m_tables);
+    tables_changed();
   }
 
   void merge_with(std::shared_ptr<Level0> other) {
@@ -154,98 +553,318 @@ public:
 
     // We need to lock as there are multiple writer threads for level 0.
     level0_lock.lock();
-    decltype(m_tables) tmp;
-    tmp.reserve(other->m_tables.size() + m_tables.size());
-    tmp.insert(tmp.end(), other->m_tables.rbegin(), other->m_tables.rend());
+    decltype(m_tables) tmp(other->m_tables.rbegin(), other->m_tables.rend());
     int level0_size = other->m_tables.size();
     level0_lock.unlock();
 
-    // Find overlapping tables in current level
-    auto first = m_tables.end();
-    auto last = m_tables.end();
-    auto min = tmp[0]->min_key();
-    auto max = tmp[0]->max_key();
+    auto compaction = tiered() ? stack(tmp) : compact(tmp, other->m_config);
+
+    // Update levels
+    std::lock(level0_lock, level1_lock);
+    other->m_tables.erase(other->m_tables.begin(), other->m_tables.begin() + level0_size);
+    other->tables_changed();
+    apply(compaction);
+  }
+
+  void merge_with(std::shared_ptr<LevelN> other) {
+    // No need to lock early here as there is only one writer thread for level 1 to N,
+    // i.e. the list of tables can't change while we are reading them.
+    auto compaction = tiered() ? stack(other->m_tables) : compact(other->m_tables, other->m_config);
+
+    // Update levels
+    std::unique_lock<std::shared_timed_mutex> l1(other->m_mutex, std::defer_lock);
+    decltype(l1) l2(m_mutex, std::defer_lock);
+    std::lock(l1, l2);
+
+    other->m_tables.clear();
+    other->tables_changed();
+    apply(compaction);
+  }
+
+  // Merges all runs of a tiered level into a single one
+  void merge_runs() {
+    assert(tiered());
+    auto compaction = stack(m_tables);
+    compaction.inputs = m_tables;
+
+    std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
+    apply(compaction);
+  }
+
+  // A tiered level needs merging once it holds too many runs
+  bool needs_merging() {
+    if (!tiered()) {
+      return Level::needs_merging();
+    }
+    return runs() > m_config.max_runs;
+  }
+
+  // Number of sorted runs in the level
+  uint64_t runs() {
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    return m_runs.size();
+  }
+
+  // Number of tables moved into the level without being rewritten
+  uint64_t moved() const {
+    return m_moved;
+  }
+
+  bool tiered() const {
+    return m_config.compaction_style == TIERED_COMPACTION;
+  }
+
+protected:
+  // Runs are searched newest first, the first one that knows about the key wins
+  LookupResult lookup(const Buffer &key, ReadMode mode) {
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
 
-    for (const auto &table : tmp) {
-      if (table->min_key() < min) {
-        min = table->min_key();
+    auto hash = BloomFilter::hash(key);
+    for (const auto &run : m_runs) {
+      auto i = run.fences.find(key);
+      if (i < 0) {
+        continue;
       }
-      if (table->max_key() > max) {
-        max = table->max_key();
+
+      auto result = probe(*m_tables[run.begin + i], key, hash, mode);
+      if (result.is_resolved()) {
+        return result;
       }
     }
+    return LookupResult::not_found();
+  }
 
-    for (auto i = m_tables.begin(); i < m_tables.end(); ++i) {
-      auto &table = (*i);
-
-      if (Buffer::min(table->max_key(), max) >= Buffer::max(table->min_key(), min)) {
-        if (first == m_tables.end()) {
-          first = i;
+  void overlapping(const ScanRange &range, std::vector<std::shared_ptr<Table>> *tables) {
+    for (const auto &run : m_runs) {
+      auto begin = m_tables.begin() + run.begin, end = m_tables.begin() + run.end;
+      auto it = std::lower_bound(begin, end, Buffer(range.start), [](const auto &table, const Buffer &key) {
+        return table->max_key() < key;
+      });
+      for (; it != end && !range.after((*it)->min_key()); ++it) {
+        if (scans(**it, range)) {
+          tables->push_back(*it);
         }
-
-        tmp.push_back(table);
-        last = i;
       }
     }
+  }
 
-    // Merge tables
-    auto merged_tables = TableBuilder::merge_tables(tmp, m_config);
+  void tables_changed() {
+    m_runs.clear();
+    for (uint64_t begin = 0, end; begin < m_tables.size(); begin = end) {
+      auto id = run_of(*m_tables[begin]);
+      for (end = begin + 1; end < m_tables.size() && run_of(*m_tables[end]) == id; end++) {}
 
-    // Update levels
-    std::lock(level0_lock, level1_lock);
-    other->m_tables.erase(other->m_tables.begin(), other->m_tables.begin() + level0_size);
+      decltype(m_tables) tables(m_tables.begin() + begin, m_tables.begin() + end);
+      m_runs.push_back({id, begin, end, FenceIndex(tables)});
+    }
+  }
+
+  // The table must not overlap any table of the level; a tiered level takes it as its newest run
+  void add(std::shared_ptr<Table> table) {
+    std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
+    if (tiered()) {
+      assign_run(*table, next_run());
+      m_tables.insert(m_tables.begin(), table);
+    } else {
+      m_tables.insert(m_tables.begin() + first_overlapping(table->min_key()), table);
+    }
+    tables_changed();
+  }
+
+private:
+  // Sorted run of non-overlapping tables; a leveled level is a single run
+  struct Run {
+    uint64_t id;
+    uint64_t begin; // Index of the first table of the run
+    uint64_t end;
+    FenceIndex fences;
+  };
+  struct Compaction {
+    std::vector<std::shared_ptr<Table>> inputs; // Tables of this level that were merged
+    std::vector<std::shared_ptr<Table>> merged; // Tables of the level above that were merged
+    std::vector<std::shared_ptr<Table>> outputs;
+    std::vector<std::shared_ptr<Table>> moved;
+  };
+
+  // Tables of a tiered level are named after their run, newer runs have larger ids. Tables
+  // of a leveled level, as well as tables whose run wasn't recorded, belong to run 0.
+  static uint64_t run_of(const Table &table) {
+    auto name = table.path().substr(table.path().rfind('/') + 1);
+    auto separator = name.find('_');
+    return (separator == std::string::npos) ? 0 : std::stoull(name.substr(0, separator));
+  }
+
+  void assign_run(Table &table, uint64_t run) const {
+    auto name = table.path().substr(table.path().rfind('/') + 1);
+    name = name.substr(name.find('_') + 1);
+    table.rename(path_append(m_config.path_level, std::to_string(run) + "_" + name));
+  }
+
+  uint64_t next_run() const {
+    return m_runs.empty() ? 1 : m_runs.front().id + 1;
+  }
 
-    // Remove overlapping tables in current level and replace them with the merged ones
-    if (last != m_tables.end()) {
-      last = m_tables.erase(first, last + 1);
+  // Newest run first, tables of a run by key
+  static void sort_tables(std::vector<std::shared_ptr<Table>> &tables) {
+    std::vector<std::pair<uint64_t, std::shared_ptr<Table>>> runs;
+    for (const auto &table : tables) {
+      runs.emplace_back(run_of(*table), table);
     }
+    std::sort(runs.begin(), runs.end(), [](auto &x, auto &y) {
+      return x.first > y.first || (x.first == y.first && x.second->min_key() < y.second->min_key());
+    });
 
-    m_tables.insert(last, merged_tables.begin(), merged_tables.end());
+    for (uint64_t i = 0; i < runs.size(); i++) {
+      tables[i] = runs[i].second;
+    }
   }
 
-  void merge_with(std::shared_ptr<LevelN> other) {
-    // No need to lock early here as there is only one writer thread for level 1 to N,
-    // i.e. the list of tables can't change while we are reading them.
-    decltype(m_tables) tmp;
-    tmp.reserve(other->m_tables.size() + m_tables.size());
-    tmp.insert(tmp.end(), other->m_tables.begin(), other->m_tables.end());
-
-    // Find overlapping tables in current level
-    auto min = other->m_tables[0]->min_key();
-    auto max = other->m_tables.back()->max_key();
-    auto first = m_tables.end();
-    auto last = m_tables.end();
-
-    for (auto i = m_tables.begin(); i < m_tables.end(); ++i) {
-      auto &table = (*i);
-
-      if (Buffer::min(table->max_key(), max) >= Buffer::max(table->min_key(), min)) {
-        if (first == m_tables.end()) {
-          first = i;
+  // Merges the tables above, given newest first, into a new run of this level without
+  // touching the existing runs. Must be called by the only thread that changes the level.
+  Compaction stack(const std::vector<std::shared_ptr<Table>> &upper) {
+    Compaction compaction;
+    compaction.outputs = TableBuilder::merge_tables(upper, table_config(), m_vlog.get());
+    compaction.merged = upper;
+
+    auto run = next_run();
+    for (const auto &table : compaction.outputs) {
+      assign_run(*table, run);
+      prepare(*table);
+      table->cache(m_cache);
+    }
+    return compaction;
+  }
+
+  // Merges the tables of the level above, given newest first, with the overlapping tables
+  // of this level. Tables that overlap neither tables above nor tables of this level are
+  // moved as they are. The others are merged in groups delimited by the moved tables, so
+  // that merged tables can't overlap moved ones. Must be called by the only thread that
+  // changes the level.
+  Compaction compact(const std::vector<std::shared_ptr<Table>> &upper, const LevelConfig &upper_config) {
+    auto can_move = same_file_system(upper_config.path_level, m_config.path_level);
+    std::vector<uint64_t> order(upper.size());
+    for (uint64_t i = 0; i < order.size(); i++) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&upper](auto x, auto y) {
+      return upper[x]->min_key() < upper[y]->min_key();
+    });
+
+    Compaction compaction;
+    std::vector<uint64_t> group;
+    Buffer group_min, group_max;
+
+    auto merge_group = [&]() {
+      if (group.empty()) {
+        return;
+      }
+
+      // Newer tables take precedence
+      std::sort(group.begin(), group.end());
+      decltype(m_tables) tmp;
+      for (auto i : group) {
+        tmp.push_back(upper[i]);
+        compaction.merged.push_back(upper[i]);
+      }
+      for (auto i = first_overlapping(group_min); i < m_tables.size() && m_tables[i]->min_key() <= group_max; i++) {
+        tmp.push_back(m_tables[i]);
+        compaction.inputs.push_back(m_tables[i]);
+      }
+
+      // The level is left as it is if a group fails to merge, e.g. because of a corrupted table
+      TableBuilder::table_list merged_tables;
+      try {
+        merged_tables = TableBuilder::merge_tables(tmp, table_config(), m_vlog.get());
+      } catch (...) {
+        for (const auto &table : compaction.outputs) {
+          table->delete_from_fs();
         }
+        throw;
+      }
+      for (const auto &table : merged_tables) {
+        prepare(*table);
+        table->cache(m_cache);
+      }
+      compaction.outputs.insert(compaction.outputs.end(), merged_tables.begin(), merged_tables.end());
+      group.clear();
+    };
+
+    for (uint64_t i = 0; i < order.size(); ) {
+      // Tables above overlapping each other
+      auto max = upper[order[i]]->max_key();
+      auto end = i + 1;
+      for (; end < order.size() && upper[order[end]]->min_key() <= max; end++) {
+        max = Buffer::max(max, upper[order[end]]->max_key());
+      }
 
-        tmp.push_back(table);
-        last = i;
+      auto &table = upper[order[i]];
+      auto below = first_overlapping(table->min_key());
+      if (can_move && end == i + 1 && (below == m_tables.size() || m_tables[below]->min_key() > max)) {
+        merge_group();
+        compaction.moved.push_back(table);
+      } else {
+        if (group.empty()) {
+          group_min = table->min_key();
+        }
+        group_max = max;
+        for (; i < end; i++) {
+          group.push_back(order[i]);
+        }
       }
+      i = end;
     }
+    merge_group();
 
-    // Merge tables
-    auto merged_tables = TableBuilder::merge_tables(tmp, m_config);
+    return compaction;
+  }
 
-    // Update levels
-    std::unique_lock<std::shared_timed_mutex> l1(other->m_mutex, std::defer_lock);
-    decltype(l1) l2(m_mutex, std::defer_lock);
-    std::lock(l1, l2);
+  // Index of the first table whose max key isn't smaller than key
+  uint64_t first_overlapping(const Buffer &key) const {
+    return std::lower_bound(m_tables.begin(), m_tables.end(), key, [](const auto &table, const Buffer &key) {
+      return table->max_key() < key;
+    }) - m_tables.begin();
+  }
 
-    other->m_tables.clear();
+  // Replaces the merged tables with the merged ones and takes over the moved tables; both
+  // levels must be locked exclusively
+  void apply(const Compaction &compaction) {
+    // Moved tables join the single run of the level, whatever run they were part of above
+    for (const auto &table : compaction.moved) {
+      auto name = table->path().substr(table->path().rfind('/') + 1);
+      table->rename(path_append(m_config.path_level, name.substr(name.find('_') + 1)));
+    }
+    m_moved += compaction.moved.size();
 
-    // Remove overlapping tables in current level and replace them with the merged ones
-    if (last != m_tables.end()) {
-      last = m_tables.erase(first, last + 1);
+    // Merged tables are deleted once no longer in use
+    for (const auto &table : compaction.merged) {
+      table->delete_from_fs();
+    }
+    for (const auto &table : compaction.inputs) {
+      table->delete_from_fs();
+    }
+
+    std::unordered_set<const Table *> inputs;
+    for (const auto &table : compaction.inputs) {
+      inputs.insert(table.get());
     }
 
-    m_tables.insert(last, merged_tables.begin(), merged_tables.end());
+    decltype(m_tables) tables;
+    for (const auto &table : m_tables) {
+      if (!inputs.count(table.get())) {
+        tables.push_back(table);
+      }
+    }
+    tables.insert(tables.end(), compaction.outputs.begin(), compaction.outputs.end());
+    tables.insert(tables.end(), compaction.moved.begin(), compaction.moved.end());
+    sort_tables(tables);
+
+    m_tables = tables;
+    tables_changed();
   }
+
+  std::shared_ptr<ValueLog> m_vlog;
+  std::vector<Run> m_runs;
+  uint64_t m_moved = 0;
 };
 
 #endif
@@ -0,0 +1,103 @@
+#ifndef LOOKUPRESULT_H
+#define LOOKUPRESULT_H
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+
+#include "Buffer.hpp"
+
+struct BlockRead;
+
+// Whether a lookup may wait for a block to be read from disk
+enum ReadMode : uint8_t {
+  BLOCKING_READ = 0,
+  // Lookups that miss the block cache return PENDING instead, see BlockRead
+  NONBLOCKING_READ = 1
+};
+
+// Outcome of a point lookup in a single component of the tree, i.e. the memtable,
+// a table or a level. Tombstones are reported as DELETED rather than as an empty
+// value so that a search can stop as soon as the key has been resolved.
+class LookupResult {
+public:
+  enum Status {
+    NOT_FOUND,
+    FOUND,
+    DELETED,
+    // The block holding the key has to be read first; repeat the lookup afterwards
+    PENDING
+  };
+
+  LookupResult(): m_status(NOT_FOUND) {}
+
+  static LookupResult not_found() {
+    return LookupResult();
+  }
+
+  // Indirect values are pointers to the value log
+  static LookupResult found(const std::shared_ptr<Buffer> &value, bool indirect = false) {
+    assert(value != nullptr);
+    return LookupResult(FOUND, value, indirect);
+  }
+
+  static LookupResult deleted() {
+    return LookupResult(DELETED, nullptr);
+  }
+
+  static LookupResult pending(const std::shared_ptr<BlockRead> &read) {
+    auto result = LookupResult(PENDING, nullptr);
+    result.m_read = read;
+    return result;
+  }
+
+  // Tombstones are stored as empty values
+  static LookupResult from_value(const std::shared_ptr<Buffer> &value, bool indirect = false) {
+    return value->size() == 0 ? deleted() : found(value, indirect);
+  }
+
+  Status status() const {
+    return m_status;
+  }
+
+  bool is_found() const {
+    return m_status == FOUND;
+  }
+
+  bool is_deleted() const {
+    return m_status == DELETED;
+  }
+
+  bool is_pending() const {
+    return m_status == PENDING;
+  }
+
+  bool is_indirect() const {
+    return m_indirect;
+  }
+
+  // True if older components don't need to be searched anymore, or not yet if pending
+  bool is_resolved() const {
+    return m_status != NOT_FOUND;
+  }
+
+  std::shared_ptr<Buffer> value() const {
+    return m_value;
+  }
+
+  std::shared_ptr<BlockRead> pending_read() const {
+    return m_read;
+  }
+
+private:
+  LookupResult(Status status, const std::shared_ptr<Buffer> &value, bool indirect = false): m_status(status),
+                                                                                             m_value(value),
+                                                                                             m_indirect(indirect) {}
+
+  Status m_status;
+  std::shared_ptr<Buffer> m_value;
+  bool m_indirect = false;
+  std::shared_ptr<BlockRead> m_read;
+};
+
+#endif
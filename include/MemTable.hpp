@@ -9,6 +9,7 @@
 #include <vector>
 
 #include "Buffer.hpp"
+#include "LookupResult.hpp"
 
 class MemTable {
 public:
@@ -22,12 +23,12 @@ public:
     }
   }
 
-  std::shared_ptr<Buffer> get(const Buffer &key) const {
+  LookupResult get(const Buffer &key) const {
     auto it = m_table.find(key);
     if (it != m_table.end()) {
-      return std::shared_ptr<Buffer>(new OwnedBuffer(it->second));
+      return LookupResult::from_value(std::shared_ptr<Buffer>(new OwnedBuffer(it->second)));
     } else {
-      return nullptr;
+      return LookupResult::not_found();
     }
   }
 
@@ -48,7 +49,7 @@ public:
     m_size = 0;
   }
 
-  uint32_t size() const {
+  uint64_t size() const {
     assert((m_size != 0 && m_table.size() != 0) || (m_size == 0 && m_table.size() == 0));
     return m_size;
   }
@@ -61,9 +62,14 @@ public:
     return m_table.end();
   }
 
+  // First entry whose key isn't smaller than key
+  const auto lower_bound(const Buffer &key) const {
+    return m_table.lower_bound(key);
+  }
+
 private:
   std::map<std::string, std::string> m_table;
-  uint32_t m_size = 0;
+  uint64_t m_size = 0;
 };
 
 #endif
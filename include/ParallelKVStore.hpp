@@ -5,16 +5,24 @@
 #include <pthread.h>
 #include <sched.h>
 #include <algorithm>
+#include <chrono>
 #include <future>
 #include <iostream>
 #include <memory>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
+#include "AsyncReader.hpp"
 #include "Buffer.hpp"
 #include "ConcurrentQueue.hpp"
 #include "Config.hpp"
 #include "KVStore.hpp"
+#include "ScanRange.hpp"
+#include "TableBuilder.hpp"
+#include "ThreadPool.hpp"
 
 class Task {
 public:
@@ -38,18 +46,125 @@ private:
   OwnedBuffer m_value;
 };
 
-class GetTask: public Task{
+// With a reader, gets that miss the block cache read the block asynchronously and are
+// run again once it has been cached
+class GetTask: public Task, public std::enable_shared_from_this<GetTask> {
 public:
-  GetTask(std::shared_ptr<KVStore> store, const Buffer &key, std::promise<std::shared_ptr<Buffer>> &&promise): Task(store), m_key(key), m_promise(std::move(promise)) {}
+  GetTask(std::shared_ptr<KVStore> store, const Buffer &key, std::promise<std::shared_ptr<Buffer>> &&promise,
+          AsyncReader *reader = nullptr): Task(store), m_key(key), m_promise(std::move(promise)), m_reader(reader) {}
 
   virtual void run() {
-    auto value = m_store->get(m_key);
-    m_promise.set_value(value);
+    try {
+      // A block can be evicted again before the lookup is repeated, eventually give up waiting
+      auto mode = (m_reader && m_attempts++ < MAX_ATTEMPTS) ? NONBLOCKING_READ : BLOCKING_READ;
+      auto result = m_store->lookup(m_key, mode);
+
+      if (result.is_pending()) {
+        auto self = shared_from_this();
+        auto submitted = m_reader->submit(result.pending_read(), [self](std::exception_ptr error) {
+          if (error) {
+            self->m_promise.set_exception(error);
+          } else {
+            self->run();
+          }
+        });
+
+        if (submitted) {
+          return;
+        }
+
+        // Too many reads in flight
+        result = m_store->lookup(m_key);
+      }
+
+      m_promise.set_value(result.is_found() ? result.value() : nullptr);
+    } catch (const std::exception &) {
+      m_promise.set_exception(std::current_exception());
+    }
   }
 
 private:
+  static const uint32_t MAX_ATTEMPTS = 4;
+
   OwnedBuffer m_key;
   std::promise<std::shared_ptr<Buffer>> m_promise;
+  AsyncReader *m_reader;
+  uint32_t m_attempts = 0;
+};
+
+// Runs a function on the partition thread
+class FunctionTask: public Task {
+public:
+  FunctionTask(std::shared_ptr<KVStore> store, std::function<void()> function): Task(store), m_function(function) {}
+
+  virtual void run() {
+    m_function();
+  }
+
+private:
+  std::function<void()> m_function;
+};
+
+class VerifyTask: public Task {
+public:
+  VerifyTask(std::shared_ptr<KVStore> store, std::promise<bool> &&promise): Task(store), m_promise(std::move(promise)) {}
+
+  virtual void run() {
+    try {
+      m_promise.set_value(m_store->verify());
+    } catch (...) {
+      m_promise.set_exception(std::current_exception());
+    }
+  }
+
+private:
+  std::promise<bool> m_promise;
+};
+
+typedef std::vector<std::pair<std::string, std::string>> entry_list;
+
+// Collects at most limit entries of a scan, all of them if 0
+class ScanTask: public Task {
+public:
+  ScanTask(std::shared_ptr<KVStore> store, const ScanRange &range, uint64_t limit, std::promise<entry_list> &&promise):
+      Task(store), m_range(range), m_limit(limit), m_promise(std::move(promise)) {}
+
+  virtual void run() {
+    try {
+      entry_list entries;
+      m_store->scan(m_range, [this, &entries](const Buffer &key, const Buffer &value) {
+        entries.emplace_back(key, value);
+        return m_limit == 0 || entries.size() < m_limit;
+      });
+      m_promise.set_value(std::move(entries));
+    } catch (...) {
+      m_promise.set_exception(std::current_exception());
+    }
+  }
+
+private:
+  ScanRange m_range;
+  uint64_t m_limit;
+  std::promise<entry_list> m_promise;
+};
+
+class IngestTask: public Task {
+public:
+  IngestTask(std::shared_ptr<KVStore> store, const std::vector<std::string> &paths, std::promise<void> &&promise):
+      Task(store), m_paths(paths), m_promise(std::move(promise)) {}
+
+  virtual void run() {
+    try {
+      m_store->ingest(m_paths);
+      m_promise.set_value();
+    } catch (...) {
+      m_promise.set_exception(std::current_exception());
+    }
+  }
+
+private:
+  std::vector<std::string> m_paths;
+  std::promise<void> m_promise;
 };
 
 class TerminateTask: public Task {
@@ -80,14 +195,25 @@ public:
 
 class KVStorePartition {
 public:
-  KVStorePartition(const Config & config, int partition) {
+  KVStorePartition(const Config & config, int partition, ThreadPool *pool = nullptr) {
     unsigned num_cpus = std::thread::hardware_concurrency();
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
     CPU_SET(partition % num_cpus, &cpuset);
 
     auto partition_config = Config::create_partition(config, partition);
-    m_store = std::make_shared<KVStore>(partition_config);
+    m_store = std::make_shared<KVStore>(partition_config, pool);
+
+    if (config.async_reads && config.io_backend != MMAP_IO && config.block_cache_size > 0) {
+      try {
+        m_reader = std::make_shared<AsyncReader>(uint32_t(ASYNC_QUEUE_DEPTH), [this](std::function<void()> function) {
+          m_queue.push(std::make_shared<FunctionTask>(m_store, function));
+        });
+      } catch (const std::system_error &e) {
+        std::cerr << "Asynchronous reads unavailable: " << e.what() << std::endl;
+      }
+    }
+
     m_thread = std::make_shared<std::thread>(&KVStorePartition::run, this);
 
     int rc = pthread_setaffinity_np(m_thread->native_handle(), sizeof(cpu_set_t), &cpuset);
@@ -109,7 +235,7 @@ public:
   std::future<std::shared_ptr<Buffer>> get(const Buffer &key) {
     std::promise<std::shared_ptr<Buffer>> promise;
     auto fut = promise.get_future();
-    auto task = std::make_shared<GetTask>(m_store, key, std::move(promise));
+    auto task = std::make_shared<GetTask>(m_store, key, std::move(promise), m_reader.get());
     m_queue.push(task);
     return fut;
   }
@@ -124,12 +250,48 @@ public:
     m_queue.push(task);
   }
 
+  std::future<void> ingest(const std::vector<std::string> &paths) {
+    std::promise<void> promise;
+    auto fut = promise.get_future();
+    auto task = std::make_shared<IngestTask>(m_store, paths, std::move(promise));
+    m_queue.push(task);
+    return fut;
+  }
+
+  std::future<entry_list> scan(const ScanRange &range, uint64_t limit) {
+    std::promise<entry_list> promise;
+    auto fut = promise.get_future();
+    auto task = std::make_shared<ScanTask>(m_store, range, limit, std::move(promise));
+    m_queue.push(task);
+    return fut;
+  }
+
+  std::future<bool> verify() {
+    std::promise<bool> promise;
+    auto fut = promise.get_future();
+    auto task = std::make_shared<VerifyTask>(m_store, std::move(promise));
+    m_queue.push(task);
+    return fut;
+  }
+
+  friend std::ostream& operator<< (std::ostream& stream, const KVStorePartition &partition) {
+    stream << *partition.m_store;
+    if (partition.m_reader) {
+      stream << "asynchronous reads - " << partition.m_reader->reads() << std::endl;
+    }
+    return stream;
+  }
+
 private:
+  static const uint32_t ASYNC_QUEUE_DEPTH = 128;
+
+  // Gets waiting for reads are completed before terminating
   void run() {
-    while (true) {
+    bool terminate = false;
+    while (!terminate || (m_reader && m_reader->in_flight() > 0)) {
       auto task = m_queue.pop();
       if (dynamic_cast<TerminateTask*>(task.get())) {
-        break;
+        terminate = true;
       } else {
         task->run();
       }
@@ -139,16 +301,29 @@ private:
   std::shared_ptr<std::thread> m_thread;
   std::shared_ptr<KVStore> m_store;
   ConcurrentQueue<std::shared_ptr<Task>> m_queue;
+  // Destroyed before the queue it posts completions to
+  std::shared_ptr<AsyncReader> m_reader;
 };
 
 class ParallelKVStore {
 public:
   ParallelKVStore(const Config &config): m_config(config) {
     assert(config.parallelism > 0);
+    auto start = std::chrono::steady_clock::now();
 
+    // Partitions are opened concurrently and share the threads that load their tables
+    ThreadPool pool(config.open_threads);
+    std::vector<std::future<std::shared_ptr<KVStorePartition>>> partitions;
     for (auto i = 0; i < config.parallelism; i++) {
-      m_stores.push_back(std::make_shared<KVStorePartition>(config, i));
+      partitions.push_back(std::async(std::launch::async, [&config, &pool, i]() {
+        return std::make_shared<KVStorePartition>(config, i, &pool);
+      }));
     }
+
+    for (auto &partition : partitions) {
+      m_stores.push_back(partition.get());
+    }
+    m_startup_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
   }
 
   void add(const Buffer &key, const Buffer &value) {
@@ -172,14 +347,146 @@ public:
     }
   }
 
+  // Live entries with keys in [start, end) in key order, at most limit of them unless 0; an
+  // empty end means no bound. Keys are spread over all partitions, which are all scanned.
+  entry_list scan(const Buffer &start, const Buffer &end, uint64_t limit = 0) {
+    std::vector<std::future<entry_list>> results;
+    for (auto &store : m_stores) {
+      results.push_back(store->scan(ScanRange(start, end), limit));
+    }
+
+    entry_list entries;
+    for (auto &result : results) {
+      auto partition = result.get();
+      auto middle = entries.size();
+      entries.insert(entries.end(), partition.begin(), partition.end());
+      std::inplace_merge(entries.begin(), entries.begin() + middle, entries.end());
+    }
+    if (limit > 0 && entries.size() > limit) {
+      entries.resize(limit);
+    }
+    return entries;
+  }
+
+  // Live entries whose keys start with prefix in key order, at most limit of them unless 0.
+  // Only a single partition is scanned if the prefix extractor extracts a prefix from it.
+  entry_list scan_prefix(const Buffer &prefix, uint64_t limit = 0) {
+    auto range = ScanRange::prefix(prefix, m_config.prefix_extractor);
+    if (range.prefix_extractor != 0) {
+      return get_partition(prefix)->scan(range, limit).get();
+    }
+    return scan(range.start, range.end, limit);
+  }
+
+  // Verifies the checksums of all tables in all partitions, rethrows I/O errors
+  bool verify() {
+    std::vector<std::future<bool>> results;
+    for (auto &store : m_stores) {
+      results.push_back(store->verify());
+    }
+
+    bool valid = true;
+    for (auto &result : results) {
+      valid &= result.get();
+    }
+    return valid;
+  }
+
+  // Moves tables written elsewhere, e.g. by an SSTWriter, into the store; their values take
+  // precedence over the current ones. Tables holding keys of several partitions are split,
+  // which rewrites them. Throws a CorruptionError if a table is corrupted, and an
+  // invalid_argument if it references values of a value log, in which case other tables
+  // may have been ingested already.
+  void ingest_files(const std::vector<std::string> &paths) {
+    std::vector<std::vector<std::string>> partitions(m_config.parallelism);
+    for (const auto &path : paths) {
+      split(path, &partitions);
+    }
+
+    std::vector<std::future<void>> results;
+    for (uint32_t i = 0; i < partitions.size(); i++) {
+      if (!partitions[i].empty()) {
+        results.push_back(m_stores[i]->ingest(partitions[i]));
+      }
+    }
+
+    for (auto &result : results) {
+      result.get();
+    }
+  }
+
+  // Seconds it took to open all partitions
+  double startup_time() const {
+    return m_startup_time;
+  }
+
+  friend std::ostream& operator<< (std::ostream& stream, const ParallelKVStore &store) {
+    stream << "startup - " << store.startup_time()*1000 << " ms" << std::endl;
+    for (int i = 0; i < store.m_stores.size(); i++) {
+      stream << "partition " << i << std::endl << *store.m_stores[i];
+    }
+    return stream;
+  }
+
 private:
   std::shared_ptr<KVStorePartition> get_partition(const Buffer &key) {
-    auto index = key.hash() % m_config.parallelism;
-    return m_stores[index];
+    return m_stores[m_config.partition(key)];
+  }
+
+  // Adds the table to the partition its keys belong to, or rewrites it as one table per
+  // partition next to it
+  void split(const std::string &path, std::vector<std::vector<std::string>> *partitions) {
+    auto table = Table::load_table(path);
+    table->verify();
+
+    auto first = m_config.partition(table->min_key());
+    std::vector<uint64_t> entries(m_config.parallelism);
+    for (const auto &item : *table) {
+      // Pointers into the value log of another store would be taken for values
+      if (item.indirect) {
+        throw std::invalid_argument("table " + path + " references values of a value log");
+      }
+      entries[m_config.partition(item.key)]++;
+    }
+
+    bool single = entries[first] == table->size();
+
+    if (single) {
+      (*partitions)[first].push_back(path);
+      return;
+    }
+
+    auto level = m_config.level(m_config.levels.size() - 1);
+    auto directory = path.substr(0, path.rfind('/') + 1);
+    std::vector<TableBuilder> builders;
+    for (uint32_t i = 0; i < m_config.parallelism; i++) {
+      builders.emplace_back(level.table_size, directory, level.index_type, nullptr, FLUSH_PRIORITY,
+                            m_config.last_level_filter_bits(entries[i]), level.prefix_extractor, level.range_filter, level.range_filter_suffix_bits);
+    }
+
+    auto add_table = [partitions](uint32_t partition, std::shared_ptr<Table> table) {
+      if (table) {
+        (*partitions)[partition].push_back(table->path());
+      }
+    };
+
+    for (const auto &item : *table) {
+      auto partition = m_config.partition(item.key);
+      if (!builders[partition].add(item.key, item.value)) {
+        add_table(partition, builders[partition].finalize());
+        builders[partition].add(item.key, item.value);
+      }
+    }
+
+    for (uint32_t i = 0; i < builders.size(); i++) {
+      add_table(i, builders[i].finalize());
+    }
+    table->delete_from_fs();
   }
 
   std::vector<std::shared_ptr<KVStorePartition>> m_stores;
   Config m_config;
+  double m_startup_time;
 };
 
 #endif
@@ -0,0 +1,82 @@
+#ifndef PREFIXEXTRACTOR_H
+#define PREFIXEXTRACTOR_H
+
+#include <cstdint>
+#include <string>
+
+#include "Buffer.hpp"
+#include "Coding.hpp"
+
+// Part of a key shared by related keys, e.g. the tenant of "tenant:object:field" keys:
+// either the first bytes of the key, or the key up to and including the n-th occurrence
+// of a delimiter. Keys that are too short have no prefix. The default extractor is disabled.
+class PrefixExtractor {
+public:
+  static const uint64_t SEED = 0x8ebc6af09c88c6e3ull;
+
+  PrefixExtractor() {}
+
+  // The first length bytes of a key
+  static PrefixExtractor fixed(uint32_t length) {
+    return PrefixExtractor(length, -1);
+  }
+
+  // A key up to and including the fields-th delimiter
+  static PrefixExtractor delimited(char delimiter, uint32_t fields = 1) {
+    return PrefixExtractor(fields, static_cast<unsigned char>(delimiter));
+  }
+
+  explicit operator bool() const {
+    return m_count > 0;
+  }
+
+  // False if the key has no prefix
+  bool extract(const Buffer &key, Buffer *prefix) const {
+    if (m_count == 0) {
+      return false;
+    }
+
+    if (m_delimiter < 0) {
+      if (key.size() < m_count) {
+        return false;
+      }
+      *prefix = Buffer(key.data(), m_count);
+      return true;
+    }
+
+    uint32_t found = 0;
+    for (uint64_t i = 0; i < key.size(); i++) {
+      if (static_cast<unsigned char>(key.data()[i]) == m_delimiter && ++found == m_count) {
+        *prefix = Buffer(key.data(), i + 1);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Identifies the extractor in the filters of the tables holding its prefixes, 0 if disabled
+  uint64_t id() const {
+    if (m_count == 0) {
+      return 0;
+    }
+
+    std::string description;
+    put_fixed32(&description, m_count);
+    put_fixed32(&description, m_delimiter);
+    return Buffer(description).hash(SEED) | 1;
+  }
+
+  // Hash of a prefix in filters, distinct from the one of a key equal to it
+  static uint64_t hash(const Buffer &prefix) {
+    return prefix.hash(SEED);
+  }
+
+private:
+  PrefixExtractor(uint32_t count, int32_t delimiter): m_count(count), m_delimiter(delimiter) {}
+
+  uint32_t m_count = 0;
+  // -1 for fixed length prefixes
+  int32_t m_delimiter = -1;
+};
+
+#endif
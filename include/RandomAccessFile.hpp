@@ -0,0 +1,120 @@
+#ifndef RANDOMACCESSFILE_H
+#define RANDOMACCESSFILE_H
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <system_error>
+
+// How tables are read
+enum IOBackend : uint8_t {
+  // Tables are mapped into memory, I/O errors raise SIGBUS
+  MMAP_IO = 0,
+  // Entries are read with pread into the block cache, or into their own buffer without one
+  PREAD_IO = 1,
+  // Like PREAD_IO, bypassing the page cache; falls back to PREAD_IO on file systems
+  // without O_DIRECT support
+  DIRECT_IO = 2
+};
+
+// Read-only file accessed with pread, which reports I/O errors as exceptions. With
+// direct I/O reads are widened to ALIGNMENT and land in aligned buffers.
+class RandomAccessFile {
+public:
+  static const uint64_t ALIGNMENT = 4096;
+
+  RandomAccessFile(const std::string &path, bool direct = false) {
+    if (direct) {
+      m_fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+      m_direct = m_fd != -1;
+    }
+
+    if (m_fd == -1 && (!direct || errno == EINVAL)) {
+      m_fd = open(path.c_str(), O_RDONLY);
+    }
+
+    if (m_fd == -1) {
+      throw std::system_error(errno, std::system_category());
+    }
+
+    struct stat sb;
+    if (fstat(m_fd, &sb) == -1) {
+      close(m_fd);
+      throw std::system_error(errno, std::system_category());
+    }
+    m_size = sb.st_size;
+  }
+
+  RandomAccessFile(const RandomAccessFile &) = delete;
+  RandomAccessFile &operator=(const RandomAccessFile &) = delete;
+
+  ~RandomAccessFile() {
+    close(m_fd);
+  }
+
+  // Bytes [offset, offset + size) of the file, the buffer is freed with the last reference
+  std::shared_ptr<const char> read(uint64_t offset, uint64_t size) const {
+    if (offset > m_size || size > m_size - offset) {
+      throw std::system_error(EINVAL, std::system_category());
+    }
+
+    uint64_t begin, end;
+    aligned_range(offset, size, &begin, &end);
+    auto buffer = allocate(end - begin);
+
+    // The aligned range may extend past the end of the file
+    uint64_t done = 0;
+    while (begin + done < offset + size) {
+      auto res = pread(m_fd, buffer.get() + done, end - begin - done, begin + done);
+      if (res == -1 && errno == EINTR) {
+        continue;
+      }
+      if (res <= 0) {
+        throw std::system_error(res == 0 ? EIO : errno, std::system_category());
+      }
+      done += res;
+    }
+
+    return std::shared_ptr<const char>(buffer, buffer.get() + (offset - begin));
+  }
+
+  // Range that has to be read to get [offset, offset + size), which may extend past the end
+  void aligned_range(uint64_t offset, uint64_t size, uint64_t *begin, uint64_t *end) const {
+    *begin = m_direct ? offset / ALIGNMENT * ALIGNMENT : offset;
+    *end = m_direct ? (offset + size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT : offset + size;
+  }
+
+  static std::shared_ptr<char> allocate(uint64_t size) {
+    void *memory;
+    if (posix_memalign(&memory, ALIGNMENT, std::max<uint64_t>(size, 1)) != 0) {
+      throw std::bad_alloc();
+    }
+    return std::shared_ptr<char>(static_cast<char *>(memory), free);
+  }
+
+  int fd() const {
+    return m_fd;
+  }
+
+  uint64_t size() const {
+    return m_size;
+  }
+
+  bool direct() const {
+    return m_direct;
+  }
+
+private:
+  int m_fd = -1;
+  uint64_t m_size;
+  bool m_direct = false;
+};
+
+#endif
@@ -0,0 +1,454 @@
+#ifndef RANGEFILTER_H
+#define RANGEFILTER_H
+
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Buffer.hpp"
+#include "Coding.hpp"
+#include "KeyPrefix.hpp"
+
+// Succinct range filter after "SuRF: Practical Range Query Filtering with Fast Succinct
+// Tries": the trie of the keys, each cut off after the first byte that tells it apart from
+// its neighbours, encoded level by level, nodes left to right, as LOUDS-Sparse:
+// - labels: the byte of every edge;
+// - has child: whether an edge leads to a node rather than to a key;
+// - louds: whether an edge is the first one of its node;
+// - prefix keys: whether a key ends at a node, whose first edge then leads to that key.
+// Every key can keep the bits that follow its cut (real suffix), which rules out more
+// ranges at the cost of space. A range is ruled out if the first key that may not come
+// before its start comes after its end, as far as its cut tells: the sparser the keys, the
+// shorter the cuts and the better short ranges are ruled out.
+//
+// Serialized as the labels, the has child, louds and prefix key bits (8-byte words), the
+// number of has child bits set before every 512 bits (8 bytes each), the position of every
+// 64th louds bit set (8 bytes each), the suffixes (8-byte words), the number of edges (8
+// bytes), the number of nodes (8 bytes) and the number of bits of a suffix (1 byte).
+class RangeFilter {
+public:
+  static const uint64_t TRAILER_SIZE = 2*sizeof(uint64_t) + 1;
+  static const uint32_t MAX_SUFFIX_BITS = 64;
+
+  // Serialized size of the filter of a trie with the given number of edges and nodes
+  static uint64_t size(uint64_t edges, uint64_t nodes, uint32_t suffix_bits) {
+    if (edges == 0) {
+      return 0;
+    }
+    auto leaves = edges - nodes + 1;
+    return edges + 8*(2*words(edges) + words(nodes) + rank_samples(edges) + select_samples(nodes) +
+                      words(leaves*suffix_bits)) + TRAILER_SIZE;
+  }
+
+  // False if no key in [start, end) was added, an empty end meaning no bound; an empty
+  // filter may hold any key
+  static bool may_contain(const Buffer &filter, const Buffer &start, const Buffer &end) {
+    Trie trie;
+    if (!trie.parse(filter)) {
+      return true;
+    }
+
+    // Edges from the root down to the first key that may not come before start
+    std::vector<uint64_t> path;
+    uint64_t pos;
+    if (!trie.seek(start, &path, &pos)) {
+      return false;
+    } else if (end.size() == 0) {
+      return true;
+    }
+
+    // Smallest key with the cut and the suffix of that key
+    std::string key;
+    for (auto edge : path) {
+      key.push_back(trie.labels[edge]);
+    }
+    if (!trie.is_prefix_key(path, pos)) {
+      key.push_back(trie.labels[pos]);
+      if (trie.suffix_bits > 0) {
+        auto suffix = trie.suffix(pos) << (64 - trie.suffix_bits);
+        for (uint32_t i = 0; i < (trie.suffix_bits + 7)/8; i++) {
+          key.push_back(static_cast<char>(suffix >> (56 - 8*i)));
+        }
+        // Zeros may be padding past the end of the key
+        while (key.size() > path.size() + 1 && key.back() == '\0') {
+          key.pop_back();
+        }
+      }
+    }
+    return Buffer(key) < end;
+  }
+
+private:
+  friend class RangeFilterBuilder;
+
+  static uint64_t words(uint64_t bits) {
+    return (bits + 63)/64;
+  }
+
+  static uint64_t rank_samples(uint64_t edges) {
+    return (edges + 511)/512;
+  }
+
+  static uint64_t select_samples(uint64_t nodes) {
+    return (nodes + 63)/64;
+  }
+
+  // The first suffix_bits bits of the key after its first offset bytes, padded with zeros
+  static uint64_t suffix(const Buffer &key, uint64_t offset, uint32_t suffix_bits) {
+    return (suffix_bits == 0) ? 0 : key_prefix(key, offset) >> (64 - suffix_bits);
+  }
+
+  struct Trie {
+    bool parse(const Buffer &filter) {
+      if (filter.size() < TRAILER_SIZE) {
+        return false;
+      }
+
+      auto trailer = filter.data() + filter.size() - TRAILER_SIZE;
+      edges = decode_fixed64(trailer);
+      nodes = decode_fixed64(trailer + sizeof(uint64_t));
+      suffix_bits = static_cast<uint8_t>(trailer[2*sizeof(uint64_t)]);
+      if (edges == 0 || edges > filter.size() || nodes == 0 || nodes > edges || suffix_bits > MAX_SUFFIX_BITS ||
+          size(edges, nodes, suffix_bits) != filter.size()) {
+        return false;
+      }
+
+      labels = filter.data();
+      has_child = labels + edges;
+      louds = has_child + 8*words(edges);
+      prefix_keys = louds + 8*words(edges);
+      ranks = prefix_keys + 8*words(nodes);
+      selects = ranks + 8*rank_samples(edges);
+      suffixes = selects + 8*select_samples(nodes);
+      return true;
+    }
+
+    // Moves to the first key that may not come before start, false if there is none
+    bool seek(const Buffer &start, std::vector<uint64_t> *path, uint64_t *pos) const {
+      uint64_t node = 0;
+      while (true) {
+        auto level = path->size();
+        auto first = first_edge(node);
+        *pos = first;
+        if (bit(prefix_keys, node)) {
+          if (level == start.size()) {
+            return true;
+          }
+          // The key ending at the node is a prefix of start
+          ++*pos;
+        } else if (level == start.size()) {
+          leftmost(path, pos);
+          return true;
+        }
+
+        auto in_node = [this, first](uint64_t pos) {
+          return pos < edges && (pos == first || !bit(louds, pos));
+        };
+        auto c = static_cast<unsigned char>(start.data()[level]);
+        while (in_node(*pos) && static_cast<unsigned char>(labels[*pos]) < c) {
+          ++*pos;
+        }
+
+        if (!in_node(*pos)) {
+          // Every key below the node comes before start
+          --*pos;
+          return next(path, pos);
+        } else if (static_cast<unsigned char>(labels[*pos]) > c) {
+          leftmost(path, pos);
+          return true;
+        } else if (bit(has_child, *pos)) {
+          path->push_back(*pos);
+          node = rank(*pos);
+        } else if (suffix(*pos) >= RangeFilter::suffix(start, level + 1, suffix_bits)) {
+          return true;
+        } else {
+          return next(path, pos);
+        }
+      }
+    }
+
+    // Moves to the key after the one the edge at pos leads to, false if there is none
+    bool next(std::vector<uint64_t> *path, uint64_t *pos) const {
+      while (*pos + 1 == edges || bit(louds, *pos + 1)) {
+        if (path->empty()) {
+          return false;
+        }
+        *pos = path->back();
+        path->pop_back();
+      }
+      ++*pos;
+      leftmost(path, pos);
+      return true;
+    }
+
+    // Moves to the first key below the edge at pos
+    void leftmost(std::vector<uint64_t> *path, uint64_t *pos) const {
+      while (bit(has_child, *pos)) {
+        path->push_back(*pos);
+        *pos = first_edge(rank(*pos));
+      }
+    }
+
+    bool is_prefix_key(const std::vector<uint64_t> &path, uint64_t pos) const {
+      auto node = path.empty() ? 0 : rank(path.back());
+      return bit(prefix_keys, node) && pos == first_edge(node);
+    }
+
+    // Suffix of the key the edge at pos leads to
+    uint64_t suffix(uint64_t pos) const {
+      if (suffix_bits == 0) {
+        return 0;
+      }
+
+      auto first = (pos - rank(pos))*suffix_bits;
+      auto offset = first % 64;
+      auto value = word(suffixes, first / 64) >> offset;
+      if (offset + suffix_bits > 64) {
+        value |= word(suffixes, first / 64 + 1) << (64 - offset);
+      }
+      return (suffix_bits == 64) ? value : value & ((1ull << suffix_bits) - 1);
+    }
+
+    static uint64_t word(const char *bits, uint64_t i) {
+      return decode_fixed64(bits + 8*i);
+    }
+
+    static bool bit(const char *bits, uint64_t i) {
+      return (word(bits, i / 64) >> (i % 64)) & 1;
+    }
+
+    // Number of edges up to pos that lead to a node, i.e. the node the edge at pos leads to
+    uint64_t rank(uint64_t pos) const {
+      auto count = word(ranks, pos / 512);
+      for (uint64_t i = (pos / 512)*8; i < pos / 64; i++) {
+        count += __builtin_popcountll(word(has_child, i));
+      }
+      return count + __builtin_popcountll(word(has_child, pos / 64) << (63 - pos % 64));
+    }
+
+    // Position of the first edge of a node, i.e. of the louds bit set for it
+    uint64_t first_edge(uint64_t node) const {
+      auto pos = word(selects, node / 64);
+      uint64_t remaining = node % 64;
+      if (remaining == 0) {
+        return pos;
+      }
+
+      auto i = pos / 64;
+      auto bits = (pos % 64 == 63) ? 0 : word(louds, i) & (~0ull << (pos % 64 + 1));
+      while (uint64_t(__builtin_popcountll(bits)) < remaining) {
+        remaining -= __builtin_popcountll(bits);
+        bits = word(louds, ++i);
+      }
+      for (; remaining > 1; remaining--) {
+        bits &= bits - 1;
+      }
+      return 64*i + __builtin_ctzll(bits);
+    }
+
+    uint64_t edges;
+    uint64_t nodes;
+    uint32_t suffix_bits;
+    const char *labels;
+    const char *has_child;
+    const char *louds;
+    const char *prefix_keys;
+    const char *ranks;
+    const char *selects;
+    const char *suffixes;
+  };
+};
+
+// Builds a range filter of sorted keys as they are added, a key equal to the last one is
+// ignored. A key is cut once the next one is known, its edges are then appended to the
+// levels they belong to.
+class RangeFilterBuilder {
+public:
+  RangeFilterBuilder(bool enabled = false, uint32_t suffix_bits = 0):
+      m_enabled(enabled),
+      m_suffix_bits(suffix_bits < RangeFilter::MAX_SUFFIX_BITS ? suffix_bits : RangeFilter::MAX_SUFFIX_BITS) {}
+
+  void add(const Buffer &key) {
+    if (!m_enabled || (m_keys > 0 && key == Buffer(m_last_key))) {
+      return;
+    }
+
+    if (m_keys > 0) {
+      auto shared = common_prefix_length(Buffer(m_last_key), key);
+      add_edges(Buffer(m_last_key), m_last_shared, shared, m_keys == 1);
+      m_last_shared = shared;
+    }
+    m_last_key.assign(key.data(), key.size());
+    m_keys++;
+  }
+
+  // Serialized size of the filter if key were the last one added, 0 if there is no filter
+  uint64_t size_with(const Buffer &key) const {
+    if (!m_enabled) {
+      return 0;
+    } else if (m_keys == 0) {
+      return RangeFilter::size(1, 1, m_suffix_bits);
+    } else if (key == Buffer(m_last_key)) {
+      return size();
+    }
+
+    auto shared = common_prefix_length(Buffer(m_last_key), key);
+    auto last = count_edges(Buffer(m_last_key), m_last_shared, shared, m_keys == 1);
+    return RangeFilter::size(m_edges + last.first + 1, m_nodes + last.second, m_suffix_bits);
+  }
+
+  // Serialized size of the filter of the keys added so far, 0 if there is no filter
+  uint64_t size() const {
+    if (!m_enabled || m_keys == 0) {
+      return 0;
+    }
+    return RangeFilter::size(m_edges + 1, m_nodes + (m_keys == 1), m_suffix_bits);
+  }
+
+  void put(std::string *output) {
+    if (!m_enabled || m_keys == 0) {
+      return;
+    }
+    add_edges(Buffer(m_last_key), m_last_shared, 0, m_keys == 1);
+
+    std::string labels;
+    std::vector<bool> has_child, louds, prefix_keys;
+    std::vector<uint64_t> suffixes;
+    for (const auto &level : m_levels) {
+      labels.append(level.labels);
+      has_child.insert(has_child.end(), level.has_child.begin(), level.has_child.end());
+      louds.insert(louds.end(), level.louds.begin(), level.louds.end());
+      prefix_keys.insert(prefix_keys.end(), level.prefix_keys.begin(), level.prefix_keys.end());
+      suffixes.insert(suffixes.end(), level.suffixes.begin(), level.suffixes.end());
+    }
+
+    auto end = output->size() + RangeFilter::size(labels.size(), prefix_keys.size(), m_suffix_bits);
+    output->reserve(end);
+    output->append(labels);
+    put_bits(output, has_child);
+    put_bits(output, louds);
+    put_bits(output, prefix_keys);
+
+    for (uint64_t i = 0, count = 0; i < has_child.size(); i++) {
+      if (i % 512 == 0) {
+        put_fixed64(output, count);
+      }
+      count += has_child[i];
+    }
+    for (uint64_t i = 0, count = 0; i < louds.size(); i++) {
+      if (louds[i] && count++ % 64 == 0) {
+        put_fixed64(output, i);
+      }
+    }
+
+    std::vector<uint64_t> words(RangeFilter::words(suffixes.size()*m_suffix_bits));
+    for (uint64_t i = 0; m_suffix_bits > 0 && i < suffixes.size(); i++) {
+      auto first = i*m_suffix_bits, offset = first % 64;
+      words[first / 64] |= suffixes[i] << offset;
+      if (offset + m_suffix_bits > 64) {
+        words[first / 64 + 1] |= suffixes[i] >> (64 - offset);
+      }
+    }
+    for (auto word : words) {
+      put_fixed64(output, word);
+    }
+
+    put_fixed64(output, labels.size());
+    put_fixed64(output, prefix_keys.size());
+    output->push_back(m_suffix_bits);
+    assert(output->size() == end);
+    clear();
+  }
+
+  void clear() {
+    m_levels.clear();
+    m_last_key.clear();
+    m_last_shared = 0;
+    m_keys = 0;
+    m_edges = 0;
+    m_nodes = 0;
+  }
+
+private:
+  struct Level {
+    std::string labels;
+    std::vector<bool> has_child;
+    std::vector<bool> louds;
+    std::vector<bool> prefix_keys;
+    std::vector<uint64_t> suffixes;
+  };
+
+  // Edges and nodes added by a key sharing shared bytes with the previous key and next
+  // bytes with the next one, the root included for the first key
+  static std::pair<uint64_t, uint64_t> count_edges(const Buffer &key, uint64_t shared, uint64_t next, bool first) {
+    if (next == key.size()) {
+      return {key.size() - shared + 1, key.size() - shared + first};
+    }
+    auto depth = std::max(shared, next) + 1;
+    return {depth - shared, depth - shared - 1 + first};
+  }
+
+  void add_edges(const Buffer &key, uint64_t shared, uint64_t next, bool first) {
+    auto counts = count_edges(key, shared, next, first);
+    m_edges += counts.first;
+    m_nodes += counts.second;
+
+    // A key that is a prefix of the next one ends at a node of its own
+    bool prefix_key = next == key.size();
+    auto depth = prefix_key ? key.size() : std::max(shared, next) + 1;
+    if (m_levels.size() < depth + 1) {
+      m_levels.resize(depth + 1);
+    }
+
+    // Below the bytes shared with the previous key every edge starts a node
+    for (auto i = shared; i < depth; i++) {
+      auto &level = m_levels[i];
+      auto leaf = (i + 1 == depth) && !prefix_key;
+      auto new_node = first || i > shared;
+      level.labels.push_back(key.data()[i]);
+      level.has_child.push_back(!leaf);
+      level.louds.push_back(new_node);
+      if (new_node) {
+        level.prefix_keys.push_back(false);
+      }
+      if (leaf) {
+        level.suffixes.push_back(RangeFilter::suffix(key, depth, m_suffix_bits));
+      }
+    }
+
+    if (prefix_key) {
+      auto &level = m_levels[depth];
+      level.labels.push_back('\0');
+      level.has_child.push_back(false);
+      level.louds.push_back(true);
+      level.prefix_keys.push_back(true);
+      level.suffixes.push_back(0);
+    }
+  }
+
+  static void put_bits(std::string *output, const std::vector<bool> &bits) {
+    for (uint64_t i = 0; i < bits.size(); i += 64) {
+      uint64_t word = 0;
+      for (uint64_t j = i; j < std::min<uint64_t>(i + 64, bits.size()); j++) {
+        word |= uint64_t(bits[j]) << (j - i);
+      }
+      put_fixed64(output, word);
+    }
+  }
+
+  bool m_enabled;
+  uint32_t m_suffix_bits;
+  std::vector<Level> m_levels;
+  // The last key is cut once the next one is known
+  std::string m_last_key;
+  uint64_t m_last_shared = 0;
+  uint64_t m_keys = 0;
+  // Edges and nodes of the keys before the last one
+  uint64_t m_edges = 0;
+  uint64_t m_nodes = 0;
+};
+
+#endif
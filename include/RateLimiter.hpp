@@ -0,0 +1,120 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+
+// Whose I/O is being paid for; flushes go first as they block writers
+enum IOPriority : uint8_t {
+  FLUSH_PRIORITY = 0,
+  COMPACTION_PRIORITY = 1
+};
+
+// Token bucket limiting the bytes per second written, and optionally read, by flushes and
+// compactions so that they don't starve foreground reads. The bucket holds at most
+// BURST_SECONDS worth of bytes; a request larger than that is granted as soon as the bucket
+// isn't empty and paid off by the requests that follow. Compactions wait as long as a flush
+// is waiting.
+//
+// With auto tuning, i.e. a maximum rate larger than the base rate, the limit grows with the
+// compaction debt reported by the stores so that the debt can be paid off within DEBT_SECONDS,
+// up to the maximum rate.
+class RateLimiter {
+public:
+  static constexpr double BURST_SECONDS = 0.1;
+  static constexpr double DEBT_SECONDS = 10;
+
+  // Throws an invalid_argument for a rate of 0, requests would never be granted
+  RateLimiter(uint64_t bytes_per_second, uint64_t max_bytes_per_second = 0): m_base_rate(bytes_per_second),
+                                                                             m_max_rate(std::max(bytes_per_second, max_bytes_per_second)),
+                                                                             m_rate(bytes_per_second),
+                                                                             m_tokens(bytes_per_second*BURST_SECONDS),
+                                                                             m_last_refill(std::chrono::steady_clock::now()) {
+    if (bytes_per_second == 0) {
+      throw std::invalid_argument("the rate of a rate limiter must be positive");
+    }
+  }
+
+  // Blocks until bytes can be transferred
+  void request(uint64_t bytes, IOPriority priority) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto start = std::chrono::steady_clock::now();
+
+    m_waiting[priority]++;
+    while (true) {
+      refill();
+
+      bool yield = priority == COMPACTION_PRIORITY && m_waiting[FLUSH_PRIORITY] > 0;
+      if (!yield && m_tokens > 0) {
+        break;
+      }
+
+      // Wait for the bucket to fill up again or for the flushes ahead to be served
+      auto wait = std::max(-m_tokens / m_rate, 0.001);
+      m_changed.wait_for(lock, std::chrono::duration<double>(wait));
+    }
+    m_waiting[priority]--;
+
+    m_tokens -= bytes;
+    m_bytes[priority] += bytes;
+    m_waited += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    m_changed.notify_all();
+  }
+
+  // Adds to or, if negative, subtracts from the compaction debt in bytes
+  void add_debt(int64_t bytes) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    refill();
+
+    m_debt += bytes;
+    m_rate = std::min<double>(m_max_rate, m_base_rate + std::max<int64_t>(m_debt, 0) / DEBT_SECONDS);
+    m_changed.notify_all();
+  }
+
+  // Current limit in bytes per second
+  uint64_t rate() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_rate;
+  }
+
+  // Bytes granted so far with the given priority
+  uint64_t bytes(IOPriority priority) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_bytes[priority];
+  }
+
+  friend std::ostream& operator<< (std::ostream& stream, RateLimiter &limiter) {
+    std::lock_guard<std::mutex> lock(limiter.m_mutex);
+    stream << (uint64_t(limiter.m_rate) >> 20) << " MB/s, " << (limiter.m_bytes[FLUSH_PRIORITY] >> 20)
+           << " MB flushed, " << (limiter.m_bytes[COMPACTION_PRIORITY] >> 20) << " MB compacted, "
+           << limiter.m_waited << " s waited";
+    return stream;
+  }
+
+private:
+  void refill() {
+    auto now = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::duration<double>(now - m_last_refill).count();
+    m_tokens = std::min(m_tokens + elapsed*m_rate, m_rate*BURST_SECONDS);
+    m_last_refill = now;
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_changed;
+  double m_base_rate;
+  double m_max_rate;
+  double m_rate;
+  double m_tokens;
+  int64_t m_debt = 0;
+  std::chrono::steady_clock::time_point m_last_refill;
+  uint32_t m_waiting[2] = {0, 0};
+  uint64_t m_bytes[2] = {0, 0};
+  double m_waited = 0;
+};
+
+#endif
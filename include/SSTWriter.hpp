@@ -0,0 +1,75 @@
+#ifndef SSTWRITER_H
+#define SSTWRITER_H
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Buffer.hpp"
+#include "Config.hpp"
+#include "Table.hpp"
+#include "TableBuilder.hpp"
+
+// Writes tables from entries given in increasing key order, to be moved into a store with
+// ParallelKVStore::ingest_files. Keys are spread over the partitions of the store like the
+// store does, so that every table belongs to a single partition and is ingested as it is.
+// Values are always stored in the tables; an empty value is a tombstone.
+class SSTWriter {
+public:
+  // Tables are written to directory, which must exist, with the table options of config. As
+  // the number of entries isn't known up front, filters are sized by filter_bits_per_key even
+  // with a filter_memory budget, so tables get no filters unless that is set as well.
+  SSTWriter(const Config &config, const std::string &directory): m_config(config) {
+    auto level = config.level(config.levels.size() - 1);
+    for (uint32_t i = 0; i < config.parallelism; i++) {
+      m_builders.emplace_back(level.table_size, directory, level.index_type, nullptr, FLUSH_PRIORITY, level.filter_bits,
+                              level.prefix_extractor, level.range_filter, level.range_filter_suffix_bits);
+    }
+  }
+
+  // Throws a std::invalid_argument if the key isn't larger than the previous one
+  void add(const Buffer &key, const Buffer &value) {
+    assert(key.size() > 0);
+    if (m_entries > 0 && !(Buffer(m_last_key) < key)) {
+      throw std::invalid_argument("keys must be added in increasing order");
+    }
+    m_last_key.assign(key.data(), key.size());
+    m_entries++;
+
+    auto &builder = m_builders[m_config.partition(key)];
+    if (!builder.add(key, value)) {
+      add_table(builder.finalize());
+      builder.add(key, value);
+    }
+  }
+
+  // Writes the last tables and returns the paths of all tables written
+  std::vector<std::string> finish() {
+    for (auto &builder : m_builders) {
+      add_table(builder.finalize());
+    }
+    return m_paths;
+  }
+
+  uint64_t entries() const {
+    return m_entries;
+  }
+
+private:
+  void add_table(std::shared_ptr<Table> table) {
+    if (table) {
+      m_paths.push_back(table->path());
+    }
+  }
+
+  Config m_config;
+  std::vector<TableBuilder> m_builders;
+  std::vector<std::string> m_paths;
+  std::string m_last_key;
+  uint64_t m_entries = 0;
+};
+
+#endif
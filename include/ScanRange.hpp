@@ -0,0 +1,64 @@
+#ifndef SCANRANGE_H
+#define SCANRANGE_H
+
+#include <cstdint>
+#include <string>
+
+#include "Buffer.hpp"
+#include "PrefixExtractor.hpp"
+#include "Table.hpp"
+
+// Keys [start, end) visited by a scan, an empty end meaning no bound. Scans of keys with
+// a prefix the store's extractor extracts carry the hash of that prefix, so that tables
+// whose filters rule it out are skipped; so are tables whose range filters rule out the
+// whole range.
+struct ScanRange {
+  ScanRange(const Buffer &start, const Buffer &end): start(start), end(end) {}
+
+  // Keys starting with prefix, which all share the prefix extracted from it, if any
+  static ScanRange prefix(const Buffer &prefix, const PrefixExtractor &extractor) {
+    ScanRange range(prefix, successor(prefix));
+    Buffer extracted;
+    if (extractor.extract(prefix, &extracted)) {
+      range.prefix_extractor = extractor.id();
+      range.prefix_hash = PrefixExtractor::hash(extracted);
+    }
+    return range;
+  }
+
+  // Smallest key larger than all keys starting with prefix, empty if there is none
+  static std::string successor(const Buffer &prefix) {
+    std::string key = prefix;
+    while (!key.empty() && static_cast<unsigned char>(key.back()) == 0xff) {
+      key.pop_back();
+    }
+    if (!key.empty()) {
+      key.back()++;
+    }
+    return key;
+  }
+
+  // Whether the key comes after all keys of the range
+  bool after(const Buffer &key) const {
+    return !end.empty() && key >= Buffer(end);
+  }
+
+  // Whether the table holds keys within the range, as far as its key range and filters tell
+  bool may_overlap(const Table &table) const {
+    if (table.max_key() < Buffer(start) || after(table.min_key())) {
+      return false;
+    }
+    if (prefix_extractor != 0 && !table.may_contain_prefix(prefix_extractor, prefix_hash)) {
+      return false;
+    }
+    return table.may_contain_range(start, end);
+  }
+
+  std::string start;
+  std::string end;
+  // Id of the extractor of the prefix of the range and the hash of the prefix, 0 if none
+  uint64_t prefix_extractor = 0;
+  uint64_t prefix_hash = 0;
+};
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef SEQUENTIALFILE_H
+#define SEQUENTIALFILE_H
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <system_error>
+
+#include "RateLimiter.hpp"
+
+// Write-only file filled from front to back through a user-space buffer, which is written
+// out in large chunks instead of faulting in the pages of a shared mapping one at a time.
+// Space is preallocated on creation and writeback is started every SYNC_INTERVAL bytes,
+// so that sync() only has to wait for the tail of the file. Writes are paced by the rate
+// limiter, if any.
+class SequentialFile {
+public:
+  static const uint64_t BUFFER_SIZE = 1 << 20;
+  static const uint64_t SYNC_INTERVAL = 8 << 20;
+
+  // Creates the file, which must not exist, reserving space for size bytes
+  SequentialFile(const std::string &path, uint64_t size = 0, std::shared_ptr<RateLimiter> limiter = nullptr,
+                 IOPriority priority = FLUSH_PRIORITY): m_filename(path),
+                                                        m_limiter(limiter),
+                                                        m_priority(priority) {
+    m_fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR);
+    if (m_fd == -1) {
+      throw std::system_error(errno, std::system_category());
+    }
+
+    // Best effort, not every file system supports preallocation
+    if (size > 0) {
+      fallocate(m_fd, 0, 0, size);
+    }
+    m_buffer.reserve(BUFFER_SIZE);
+  }
+
+  SequentialFile(const SequentialFile &) = delete;
+  SequentialFile &operator=(const SequentialFile &) = delete;
+
+  // Data that hasn't been synced is lost
+  ~SequentialFile() {
+    close(m_fd);
+  }
+
+  void appendFront(const void *buffer, uint64_t size) {
+    auto data = static_cast<const char *>(buffer);
+
+    if (m_buffer.size() + size > BUFFER_SIZE) {
+      // Data that wouldn't fit in an empty buffer is written together with the buffer
+      if (size >= BUFFER_SIZE) {
+        write(data, size);
+        return;
+      }
+
+      auto head = BUFFER_SIZE - m_buffer.size();
+      m_buffer.append(data, head);
+      write(nullptr, 0);
+      data += head;
+      size -= head;
+    }
+
+    m_buffer.append(data, size);
+  }
+
+  // Writes out the buffer, trims the preallocated space and waits for the data to be durable
+  void sync() {
+    write(nullptr, 0);
+
+    if (ftruncate(m_fd, m_written) == -1) {
+      throw std::system_error(errno, std::system_category());
+    }
+
+    if (fdatasync(m_fd) == -1) {
+      throw std::system_error(errno, std::system_category());
+    }
+  }
+
+  const std::string &filename() const {
+    return m_filename;
+  }
+
+  uint64_t head_index() const {
+    return m_written + m_buffer.size();
+  }
+
+private:
+  // Writes the buffer followed by size bytes of data and empties the buffer
+  void write(const char *data, uint64_t size) {
+    iovec chunks[2] = {{&m_buffer[0], m_buffer.size()}, {const_cast<char *>(data), size}};
+    auto chunk = chunks;
+    auto remaining = m_buffer.size() + size;
+    if (m_limiter && remaining > 0) {
+      m_limiter->request(remaining, m_priority);
+    }
+
+    while (remaining > 0) {
+      auto res = pwritev(m_fd, chunk, chunks + 2 - chunk, m_written);
+      if (res == -1 && errno == EINTR) {
+        continue;
+      }
+      if (res == -1) {
+        throw std::system_error(errno, std::system_category());
+      }
+
+      m_written += res;
+      remaining -= res;
+      // Skips the chunks that have been written completely
+      uint64_t done = res;
+      while (chunk < chunks + 2 && done >= chunk->iov_len) {
+        done -= chunk->iov_len;
+        chunk++;
+      }
+      if (chunk < chunks + 2) {
+        chunk->iov_base = static_cast<char *>(chunk->iov_base) + done;
+        chunk->iov_len -= done;
+      }
+    }
+    m_buffer.clear();
+
+    // Starts writing back what has been written so far without waiting for it
+    if (m_written - m_synced >= SYNC_INTERVAL) {
+      sync_file_range(m_fd, m_synced, m_written - m_synced, SYNC_FILE_RANGE_WRITE);
+      m_synced = m_written;
+    }
+  }
+
+  std::string m_filename;
+  std::shared_ptr<RateLimiter> m_limiter;
+  IOPriority m_priority;
+  int m_fd;
+  std::string m_buffer;
+  uint64_t m_written = 0;
+  uint64_t m_synced = 0;
+};
+
+#endif
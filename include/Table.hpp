@@ -1,64 +1,197 @@
 #ifndef TABLE_H
 #define TABLE_H
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <system_error>
+#include <vector>
 
 #include "AppendableMMap.hpp"
+#include "BlockCache.hpp"
+#include "BloomFilter.hpp"
 #include "Buffer.hpp"
+#include "Coding.hpp"
+#include "CRC32C.hpp"
+#include "KeyPrefix.hpp"
 #include "KeyValue.hpp"
+#include "LookupResult.hpp"
+#include "RandomAccessFile.hpp"
+#include "RangeFilter.hpp"
+#include "TableCache.hpp"
 #include "TableIterator.hpp"
 
+class CorruptionError : public std::runtime_error {
+public:
+  CorruptionError(const std::string &what): std::runtime_error(what) {}
+};
+
+// How a table finds the entry of a key
+enum IndexType : uint8_t {
+  // Binary search over the key prefixes of all entries
+  DENSE_INDEX = 0,
+  // Piecewise linear model predicting the position of a key prefix within a bounded
+  // error; needs no per entry data besides the offsets
+  LEARNED_INDEX = 1,
+  // Hash table of all keys, a lookup usually takes a single probe and key comparison;
+  // meant for point lookups only
+  HASH_INDEX = 2
+};
+
+// Open table, either mapped or read with pread; in the latter case data is null and
+// everything following the entries is kept in memory
+struct TableFile {
+  struct Segment {
+    uint64_t first_prefix;
+    uint64_t first_position;
+    double slope;
+  };
+
+  std::shared_ptr<AppendableMMap> mmap;
+  std::shared_ptr<const RandomAccessFile> reader;
+  std::shared_ptr<const char> metadata;
+  const char *data;
+  const char *index;
+  const char *search_index;
+  const char *filter;
+  const char *range_filter;
+  const char *checksums;
+  std::unique_ptr<std::atomic<bool>[]> verified;
+  std::vector<Segment> segments;
+  uint64_t max_error = 0;
+};
+
+// Tables are laid out as follows:
+// - entries: key and value sorted by key (see KeyValue);
+// - checksums: CRC-32C of every block of entries, 4 bytes each;
+// - search index, depending on the index type:
+//   - dense: key prefix of every entry (see KeyPrefix), 8 bytes each, skipping the
+//     bytes all keys of the table have in common;
+//   - learned: maximum error (8 bytes) followed by the segments of the model, each made
+//     of the first prefix (8 bytes), its position (8 bytes) and the slope (8 bytes double);
+//   - hash: open addressing table with linear probing and a power of two number of
+//     slots (8 bytes each), holding the upper 32 bits of the hash of a key and its
+//     position plus one, 0 marks an empty slot;
+// - filter: Bloom filter of all keys and, if a prefix extractor was configured, of their
+//   prefixes (see BloomFilter), possibly empty;
+// - range filter: succinct trie of all keys (see RangeFilter), possibly empty;
+// - index: offset of every entry, either 4 or 8 bytes wide;
+// - footer: size of the entries (8 bytes), number of entries (8 bytes), block size (4 bytes),
+//   length of the common key prefix (4 bytes), width of an index offset (1 byte), index
+//   type (1 byte), size of the search index (8 bytes), size of the filter (8 bytes), size
+//   of the range filter (8 bytes) and CRC-32C of everything following the entries (4 bytes).
+//
+// The footer is always validated against the size of the table. Blocks are verified
+// the first time an entry in them is read if checksum verification is enabled.
+//
+// Tables only keep their footer, their smallest and largest key and their filters in memory. Tables
+// loaded with a cache are mapped on first access and unmapped when evicted from it;
+// values returned by get() keep the mapping alive.
 class Table{
  public:
   typedef TableIterator const_iterator;
 
-  std::shared_ptr<Buffer> get(const Buffer &key) {
-    int64_t max = m_num_entries - 1;
-    int64_t min = 0;
+  static const uint32_t FOOTER_SIZE = 5*sizeof(uint64_t) + 2*sizeof(uint32_t) + 2*sizeof(uint8_t) + sizeof(uint32_t);
+  static const uint32_t BLOCK_SIZE = 32 << 10;
+  static const uint32_t SEGMENT_SIZE = 3*sizeof(uint64_t);
+  static const uint64_t HASH_INDEX_SEED = 0xc2b2ae3d27d4eb4full;
 
-    while (min <= max) {
-      auto half = (min + max) / 2;
-      auto item = operator[](half);
+  // Without waiting for reads the result is pending if a block has to be read first
+  LookupResult get(const Buffer &key, ReadMode mode = BLOCKING_READ) {
+    try {
+      return find(key, mode);
+    } catch (const BlockMiss &miss) {
+      return LookupResult::pending(miss.read);
+    }
+  }
 
-      if (key < item.key) {
-        max = half - 1;
-      } else if (key > item.key){
-        min = half + 1;
-      } else {
-        return std::make_shared<Buffer>(item.value);
-      }
+  // Looks key up at a known position, not found if the entry has a different key
+  LookupResult get(const Buffer &key, uint64_t i, ReadMode mode = BLOCKING_READ) {
+    try {
+      std::shared_ptr<const void> pin;
+      auto item = entry(file(), i, &pin, mode);
+      return (item.key == key) ? result(pin, item) : LookupResult::not_found();
+    } catch (const BlockMiss &miss) {
+      return LookupResult::pending(miss.read);
     }
+  }
 
-    return nullptr;
+  // The entry points into the mapping, which may be evicted from the cache right after;
+  // only available for mapped tables
+  KeyValue operator[](uint64_t i) {
+    assert(m_io == MMAP_IO);
+    std::shared_ptr<const void> pin;
+    return entry(file(), i, &pin);
   }
 
-  KeyValue operator[](uint32_t i) {
-    assert(i < m_num_entries);
-    uint32_t offset = m_index[i];
-    return KeyValue(m_mmap->data() + offset);
+  // Verifies all checksums of the table, throws a CorruptionError on mismatch
+  void verify() {
+    auto file = this->file();
+    verify_metadata(*file);
+    verify_blocks(*file, 0, m_data_size);
   }
 
+  // The file is deleted once the table is no longer in use
   void delete_from_fs() {
-    m_mmap->delete_from_fs();
+    m_delete = true;
+  }
+
+  // Moves the file within its file system. Readers outside of the level, e.g. scans, may
+  // still use the table and reopen it meanwhile, from either path.
+  void rename(const std::string &path) {
+    std::lock_guard<std::mutex> lock(m_path_mutex);
+    if (::rename(m_path.c_str(), path.c_str()) == -1) {
+      throw std::system_error(errno, std::system_category());
+    }
+    m_path = path;
   }
 
+  // Iterators keep the table mapped, or read it sequentially bypassing the block cache
   const_iterator begin() {
-    return TableIterator(m_mmap->data());
+    auto file = this->file();
+    if (!file->data) {
+      return TableIterator(file->reader, m_data_size);
+    }
+    return TableIterator(file->data, 0, file);
   }
 
   const_iterator end() {
-    return TableIterator(reinterpret_cast<const char *>(m_end));
+    return TableIterator(nullptr, m_data_size, nullptr);
+  }
+
+  // Iterator at the first entry whose key isn't smaller than key. Scans are often short,
+  // tables that aren't mapped are read from there a block at a time.
+  const_iterator lower_bound(const Buffer &key) {
+    if (key <= m_min_key) {
+      return begin();
+    } else if (key > m_max_key) {
+      return end();
+    }
+
+    auto file = this->file();
+    auto i = offset(*file, lower_bound(file, key));
+    if (!file->data) {
+      return TableIterator(file->reader, m_data_size, i, m_block_size);
+    }
+    return TableIterator(file->data, i, file);
   }
 
-  uint32_t size() const {
+  uint64_t size() const {
     return m_num_entries;
   }
 
-  const char *data() {
-    return m_mmap->data();
+  // Size in bytes of the search index and the offsets
+  uint64_t index_size() const {
+    return m_search_index_size + m_num_entries*m_offset_width;
   }
 
   const Buffer min_key() const  {
@@ -69,31 +202,724 @@ class Table{
     return m_max_key;
   }
 
-  Table(std::shared_ptr<AppendableMMap> mmap): m_mmap(mmap) {
-    auto table_size = mmap->data() + mmap->size() - sizeof(uint32_t);
-    m_num_entries = *reinterpret_cast<const uint32_t *>(table_size);
-    m_index = reinterpret_cast<const uint32_t *>(table_size - sizeof(uint32_t)*m_num_entries);
+  // False if the key is certainly not in the table, given its BloomFilter::hash()
+  bool may_contain(uint64_t hash) const {
+    return BloomFilter::may_contain(m_filter, hash);
+  }
+
+  bool has_filter() const {
+    return !m_filter.empty();
+  }
+
+  // False if no key with the prefix is in the table, given the id of the extractor of the
+  // prefix and its PrefixExtractor::hash(); filters of other extractors can't tell
+  bool may_contain_prefix(uint64_t extractor, uint64_t hash) const {
+    return BloomFilter::prefix_extractor(m_filter) != extractor || BloomFilter::may_contain(m_filter, hash);
+  }
+
+  // False if no key in [start, end) is in the table, an empty end meaning no bound
+  bool may_contain_range(const Buffer &start, const Buffer &end) const {
+    return RangeFilter::may_contain(m_range_filter, start, end);
+  }
+
+  // Expected false positive rate of the filter, 1 without a filter
+  double false_positive_rate() const {
+    return BloomFilter::false_positive_rate(m_filter);
+  }
+
+  // Upper bound of the size of the search index of a table with the given amount of entries
+  static uint64_t search_index_size(IndexType type, uint64_t num_entries) {
+    if (type == LEARNED_INDEX) {
+      // Every segment covers at least two prefixes
+      return sizeof(uint64_t) + (num_entries + 1)/2*SEGMENT_SIZE;
+    } else if (type == HASH_INDEX) {
+      return hash_slots(num_entries)*sizeof(uint64_t);
+    }
+    return num_entries*sizeof(uint64_t);
+  }
+
+  // Number of slots of the hash index, at most two thirds of them are used
+  static uint64_t hash_slots(uint64_t num_entries) {
+    uint64_t slots = 1;
+    while (slots < num_entries + num_entries/2 + 1) {
+      slots *= 2;
+    }
+    return slots;
+  }
+
+  // Upper bound of the size of a table with the given amount of entries, filter hashes and
+  // range filter size
+  static uint64_t serialized_size(uint64_t data_size, uint64_t num_entries, uint8_t offset_width,
+                                  IndexType type = DENSE_INDEX, double filter_bits = 0, uint64_t filter_hashes = 0,
+                                  uint64_t range_filter_size = 0) {
+    auto num_blocks = (data_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    return data_size + num_blocks*sizeof(uint32_t) + search_index_size(type, num_entries) +
+      BloomFilter::size(filter_hashes, filter_bits) + range_filter_size + num_entries*offset_width + FOOTER_SIZE;
+  }
+
+  Table(std::shared_ptr<AppendableMMap> mmap, bool verify_checksums = false): m_path(mmap->filename()),
+                                                                               m_file_size(mmap->size()),
+                                                                               m_verify_checksums(verify_checksums) {
+    if (m_file_size < FOOTER_SIZE) {
+      corrupted("truncated table");
+    }
+
+    parse_footer(mmap->data() + m_file_size - FOOTER_SIZE);
+    m_file = open(mmap);
+    m_filter.assign(m_file->filter, m_filter_size);
+    m_range_filter.assign(m_file->range_filter, m_range_filter_size);
+    std::shared_ptr<const void> pin;
+    set_key_range(entry(m_file, 0, &pin).key, entry(m_file, m_num_entries - 1, &pin).key);
+  }
+
+  // Reads the metadata without mapping the table, which is mapped through the cache on first access
+  Table(const std::string &path, std::shared_ptr<TableCache> cache, bool verify_checksums = false): m_path(path),
+                                                                                                   m_cache(cache),
+                                                                                                   m_verify_checksums(verify_checksums) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      throw std::system_error(errno, std::system_category());
+    }
+
+    try {
+      m_file_size = lseek(fd, 0, SEEK_END);
+      if (m_file_size < FOOTER_SIZE) {
+        corrupted("truncated table");
+      }
+
+      char footer[FOOTER_SIZE];
+      read_at(fd, m_file_size - FOOTER_SIZE, footer, FOOTER_SIZE);
+      parse_footer(footer);
 
-    assert(m_num_entries != 0);
+      std::string filters(m_filter_size + m_range_filter_size, '\0');
+      read_at(fd, m_file_size - FOOTER_SIZE - m_num_entries*m_offset_width - filters.size(), &filters[0], filters.size());
+      m_filter = filters.substr(0, m_filter_size);
+      m_range_filter = filters.substr(m_filter_size);
 
-    auto last = operator[](m_num_entries - 1).value;
-    m_end = last.data() + last.size();
-    assert(m_end <= reinterpret_cast<const char *>(m_index));
+      char last[sizeof(uint64_t)];
+      read_at(fd, m_file_size - FOOTER_SIZE - m_offset_width, last, m_offset_width);
+      auto last_offset = (m_offset_width == sizeof(uint32_t)) ? decode_fixed32(last) : decode_fixed64(last);
+      set_key_range(read_key(fd, 0), read_key(fd, last_offset));
+    } catch (...) {
+      close(fd);
+      throw;
+    }
 
-    m_min_key = operator[](0).key;
-    m_max_key = operator[](m_num_entries - 1).key;
+    close(fd);
   }
 
-  static std::shared_ptr<Table> load_table(const std::string &path) {
+  // Restores the table from its metadata (see metadata()) without reading it
+  Table(const std::string &path, const Buffer &metadata, std::shared_ptr<TableCache> cache = nullptr,
+        bool verify_checksums = false): m_path(path),
+                                         m_cache(cache),
+                                         m_verify_checksums(verify_checksums) {
+    auto begin = metadata.data(), end = metadata.data() + metadata.size();
+    if (metadata.size() < sizeof(uint64_t) + FOOTER_SIZE) {
+      corrupted("invalid metadata");
+    }
+
+    m_file_size = decode_fixed64(begin);
+    if (m_file_size < FOOTER_SIZE) {
+      corrupted("truncated table");
+    }
+    parse_footer(begin + sizeof(uint64_t));
+
+    Buffer keys[4];
+    auto ptr = begin + sizeof(uint64_t) + FOOTER_SIZE;
+    for (auto &key : keys) {
+      uint64_t size;
+      if (ptr >= end || (ptr = decode_varint(ptr, &size)) > end || size > uint64_t(end - ptr)) {
+        corrupted("invalid metadata");
+      }
+      key = Buffer(ptr, size);
+      ptr += size;
+    }
+    set_key_range(keys[0], keys[1]);
+    if (keys[2].size() != m_filter_size || keys[3].size() != m_range_filter_size) {
+      corrupted("invalid metadata");
+    }
+    m_filter.assign(keys[2].data(), keys[2].size());
+    m_range_filter.assign(keys[3].data(), keys[3].size());
+
+    if (!m_cache) {
+      m_file = open(std::make_shared<AppendableMMap>(path));
+    }
+  }
+
+  ~Table() {
+    if (m_cache) {
+      m_cache->erase(m_id);
+    }
+
+    if (m_delete) {
+      delete_file(m_path);
+    }
+  }
+
+  // Hands the mapping of a table that hasn't been shared yet over to a cache
+  void cache(std::shared_ptr<TableCache> cache) {
+    if (!cache || m_path.empty()) {
+      return;
+    }
+
+    m_cache = cache;
+    m_cache->insert(m_id, m_file, memory_size());
+    m_file = nullptr;
+  }
+
+  // Reads the table with pread instead of mapping it, keeping blocks in the block cache
+  // if any; must be set before the table is shared
+  void read_with(IOBackend io, std::shared_ptr<BlockCache> blocks = nullptr) {
+    if (m_path.empty()) {
+      return;
+    }
+
+    m_io = io;
+    m_blocks = blocks;
+    if (m_file && m_io != MMAP_IO) {
+      m_file = open_file();
+    }
+  }
+
+  // Access pattern of the mapping, applied now and whenever the table is mapped again;
+  // must be set before the table is shared
+  void advise(int advice) {
+    m_advice = advice;
+    if (m_file && m_file->mmap) {
+      m_file->mmap->advise(advice);
+    }
+  }
+
+  int advice() const {
+    return m_advice;
+  }
+
+  // One-off hint for the current mapping, e.g. MADV_WILLNEED before a scan; the mapping
+  // is shared with lookups, which a hint must not slow down
+  void hint(int advice) {
+    auto file = this->file();
+    if (file->mmap) {
+      file->mmap->advise(advice);
+    }
+  }
+
+  // Everything kept in memory about the table: file size, footer, key range and filters
+  std::string metadata() const {
+    std::string metadata;
+    put_fixed64(&metadata, m_file_size);
+    metadata.append(m_footer);
+    put_length_prefixed(&metadata, m_min_key.data(), m_min_key.size());
+    put_length_prefixed(&metadata, m_max_key.data(), m_max_key.size());
+    put_length_prefixed(&metadata, m_filter.data(), m_filter.size());
+    put_length_prefixed(&metadata, m_range_filter.data(), m_range_filter.size());
+    return metadata;
+  }
+
+  std::string path() const {
+    std::lock_guard<std::mutex> lock(m_path_mutex);
+    return m_path;
+  }
+
+  uint64_t file_size() const {
+    return m_file_size;
+  }
+
+  static std::shared_ptr<Table> load_table(const std::string &path, bool verify_checksums = false,
+                                           std::shared_ptr<TableCache> cache = nullptr) {
+    if (cache) {
+      return std::make_shared<Table>(path, cache, verify_checksums);
+    }
+
     auto mmap = std::make_shared<AppendableMMap>(path);
-    return std::make_shared<Table>(mmap);
+    return std::make_shared<Table>(mmap, verify_checksums);
   }
 
  private:
-  const std::shared_ptr<AppendableMMap> m_mmap;
-  const uint32_t *m_index;
-  const char *m_end;
-  uint32_t m_num_entries;
+  static uint64_t next_id() {
+    static std::atomic<uint64_t> id{0};
+    return id.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Thrown by reads that would have to wait for a block, turned into a pending result
+  struct BlockMiss {
+    std::shared_ptr<BlockRead> read;
+  };
+
+  LookupResult find(const Buffer &key, ReadMode mode) {
+    if (key < m_min_key || key > m_max_key) {
+      return LookupResult::not_found();
+    }
+
+    auto file = this->file();
+    if (m_index_type == HASH_INDEX) {
+      return hash_lookup(file, key, mode);
+    }
+
+    // Narrow the search down to a range of entries, then compare keys
+    int64_t min, max;
+    auto prefix = key_prefix(key, m_prefix_offset);
+    if (m_index_type == LEARNED_INDEX) {
+      predict(file, key, prefix, &min, &max, mode);
+    } else {
+      min = prefix_lower_bound(file->search_index, m_num_entries, prefix);
+      max = m_num_entries - 1;
+      if (prefix != UINT64_MAX) {
+        max = min + prefix_lower_bound(file->search_index + min*sizeof(uint64_t), m_num_entries - min, prefix + 1) - 1;
+      }
+    }
+
+    while (min <= max) {
+      auto half = (min + max) / 2;
+      std::shared_ptr<const void> pin;
+      auto item = entry(file, half, &pin, mode);
+
+      if (key < item.key) {
+        max = half - 1;
+      } else if (key > item.key){
+        min = half + 1;
+      } else {
+        return result(pin, item);
+      }
+    }
+
+    return LookupResult::not_found();
+  }
+
+  // Position of the first entry whose key isn't smaller than key, which must be within
+  // the key range of the table
+  uint64_t lower_bound(const std::shared_ptr<const TableFile> &file, const Buffer &key) const {
+    int64_t min = 0, max = m_num_entries - 1;
+    auto prefix = key_prefix(key, m_prefix_offset);
+    if (m_index_type == LEARNED_INDEX) {
+      predict(file, key, prefix, &min, &max, BLOCKING_READ);
+    } else if (m_index_type == DENSE_INDEX) {
+      min = prefix_lower_bound(file->search_index, m_num_entries, prefix);
+      if (prefix != UINT64_MAX) {
+        max = min + prefix_lower_bound(file->search_index + min*sizeof(uint64_t), m_num_entries - min, prefix + 1) - 1;
+      }
+    }
+
+    while (min <= max) {
+      auto half = (min + max) / 2;
+      std::shared_ptr<const void> pin;
+      if (entry(file, half, &pin).key < key) {
+        min = half + 1;
+      } else {
+        max = half - 1;
+      }
+    }
+    return min;
+  }
+
+  // Uncached tables are always mapped
+  std::shared_ptr<const TableFile> file() {
+    if (m_file) {
+      return m_file;
+    }
+
+    auto file = m_cache->get(m_id);
+    if (!file) {
+      file = m_cache->insert(m_id, open_file(), memory_size());
+    }
+    return file;
+  }
+
+  // The table can't be renamed while it's being opened
+  std::shared_ptr<const TableFile> open_file() {
+    std::lock_guard<std::mutex> lock(m_path_mutex);
+    if (m_io == MMAP_IO) {
+      return open(std::make_shared<AppendableMMap>(m_path));
+    }
+    return open(std::make_shared<RandomAccessFile>(m_path, m_io == DIRECT_IO));
+  }
+
+  // Bytes an open table takes up in memory or in the address space
+  uint64_t memory_size() const {
+    return (m_io == MMAP_IO) ? m_file_size : m_file_size - m_data_size;
+  }
+
+  void parse_footer(const char *footer) {
+    m_footer.assign(footer, FOOTER_SIZE);
+    m_data_size = decode_fixed64(footer);
+    m_num_entries = decode_fixed64(footer + sizeof(uint64_t));
+    m_block_size = decode_fixed32(footer + 2*sizeof(uint64_t));
+    m_prefix_offset = decode_fixed32(footer + 2*sizeof(uint64_t) + sizeof(uint32_t));
+    m_offset_width = footer[2*sizeof(uint64_t) + 2*sizeof(uint32_t)];
+    m_index_type = static_cast<IndexType>(footer[2*sizeof(uint64_t) + 2*sizeof(uint32_t) + sizeof(uint8_t)]);
+    m_search_index_size = decode_fixed64(footer + 2*sizeof(uint64_t) + 2*sizeof(uint32_t) + 2*sizeof(uint8_t));
+    m_filter_size = decode_fixed64(footer + 3*sizeof(uint64_t) + 2*sizeof(uint32_t) + 2*sizeof(uint8_t));
+    m_range_filter_size = decode_fixed64(footer + 4*sizeof(uint64_t) + 2*sizeof(uint32_t) + 2*sizeof(uint8_t));
+
+    // Sizes are validated before being used so that a corrupted footer can't point outside the table
+    auto available = m_file_size - FOOTER_SIZE;
+    if ((m_offset_width != sizeof(uint32_t) && m_offset_width != sizeof(uint64_t)) ||
+        m_block_size == 0 || m_num_entries == 0 || m_data_size > available ||
+        m_num_entries > (available - m_data_size) / m_offset_width ||
+        m_range_filter_size > available - m_data_size - m_num_entries*m_offset_width ||
+        m_filter_size > available - m_data_size - m_num_entries*m_offset_width - m_range_filter_size ||
+        (m_filter_size > 0 && m_filter_size <= BloomFilter::TRAILER_SIZE) ||
+        (m_range_filter_size > 0 && m_range_filter_size < RangeFilter::TRAILER_SIZE) ||
+        m_search_index_size > available - m_data_size - m_num_entries*m_offset_width - m_filter_size - m_range_filter_size) {
+      corrupted("invalid footer");
+    }
+    available -= m_filter_size + m_range_filter_size;
+
+    if (m_index_type == DENSE_INDEX) {
+      if (m_search_index_size != m_num_entries*sizeof(uint64_t)) {
+        corrupted("invalid footer");
+      }
+    } else if (m_index_type == LEARNED_INDEX) {
+      if (m_search_index_size <= sizeof(uint64_t) || (m_search_index_size - sizeof(uint64_t)) % SEGMENT_SIZE != 0) {
+        corrupted("invalid footer");
+      }
+    } else if (m_index_type == HASH_INDEX) {
+      if (m_search_index_size != hash_slots(m_num_entries)*sizeof(uint64_t)) {
+        corrupted("invalid footer");
+      }
+    } else {
+      corrupted("unknown index type");
+    }
+
+    m_num_blocks = (m_data_size + m_block_size - 1) / m_block_size;
+    if (m_num_blocks*sizeof(uint32_t) > available - m_data_size - m_num_entries*m_offset_width - m_search_index_size) {
+      corrupted("invalid footer");
+    }
+  }
+
+  std::shared_ptr<const TableFile> open(std::shared_ptr<AppendableMMap> mmap) {
+    if (mmap->size() != m_file_size) {
+      corrupted("size changed");
+    }
+
+    if (m_advice != MADV_NORMAL) {
+      mmap->advise(m_advice);
+    }
+
+    auto file = std::make_shared<TableFile>();
+    file->mmap = mmap;
+    file->data = mmap->data();
+    return open(file, file->data + m_file_size);
+  }
+
+  std::shared_ptr<const TableFile> open(std::shared_ptr<RandomAccessFile> reader) {
+    if (reader->size() != m_file_size) {
+      corrupted("size changed");
+    }
+
+    auto file = std::make_shared<TableFile>();
+    file->reader = reader;
+    file->metadata = reader->read(m_data_size, m_file_size - m_data_size);
+    file->data = nullptr;
+    return open(file, file->metadata.get() + (m_file_size - m_data_size));
+  }
+
+  // Sets up the file given the end of its contents in memory
+  std::shared_ptr<const TableFile> open(std::shared_ptr<TableFile> file, const char *end) {
+    file->index = end - FOOTER_SIZE - m_offset_width*m_num_entries;
+    file->range_filter = file->index - m_range_filter_size;
+    file->filter = file->range_filter - m_filter_size;
+    file->search_index = file->filter - m_search_index_size;
+    file->checksums = file->search_index - sizeof(uint32_t)*m_num_blocks;
+
+    file->verified.reset(new std::atomic<bool>[m_num_blocks]);
+    for (uint64_t i = 0; i < m_num_blocks; i++) {
+      file->verified[i].store(false, std::memory_order_relaxed);
+    }
+
+    if (m_verify_checksums) {
+      verify_metadata(*file);
+    }
+
+    if (m_index_type == LEARNED_INDEX) {
+      load_segments(file.get());
+    }
+
+    return file;
+  }
+
+  void set_key_range(const Buffer &min, const Buffer &max) {
+    m_min_key_data.assign(min.data(), min.size());
+    m_max_key_data.assign(max.data(), max.size());
+    m_min_key = m_min_key_data;
+    m_max_key = m_max_key_data;
+  }
+
+  void read_at(int fd, uint64_t offset, char *buffer, uint64_t size) const {
+    auto res = pread(fd, buffer, size, offset);
+    if (res == -1) {
+      throw std::system_error(errno, std::system_category());
+    } else if (res != size) {
+      corrupted("truncated table");
+    }
+  }
+
+  std::string read_key(int fd, uint64_t offset) const {
+    if (offset >= m_data_size) {
+      corrupted("entry out of bounds");
+    }
+
+    char header[MAX_VARINT_LENGTH];
+    auto header_size = std::min<uint64_t>(sizeof(header), m_data_size - offset);
+    read_at(fd, offset, header, header_size);
+
+    uint64_t size;
+    auto key_offset = offset + (decode_varint(header, &size) - header);
+    if (size > m_data_size - key_offset) {
+      corrupted("entry out of bounds");
+    }
+
+    std::string key(size, '\0');
+    read_at(fd, key_offset, &key[0], size);
+    return key;
+  }
+
+  void load_segments(TableFile *file) const {
+    file->max_error = decode_fixed64(file->search_index);
+
+    auto num_segments = (m_search_index_size - sizeof(uint64_t)) / SEGMENT_SIZE;
+    for (uint64_t i = 0; i < num_segments; i++) {
+      auto segment = file->search_index + sizeof(uint64_t) + i*SEGMENT_SIZE;
+      uint64_t slope = decode_fixed64(segment + 2*sizeof(uint64_t));
+
+      TableFile::Segment s;
+      s.first_prefix = decode_fixed64(segment);
+      s.first_position = decode_fixed64(segment + sizeof(uint64_t));
+      memcpy(&s.slope, &slope, sizeof(slope));
+      file->segments.push_back(s);
+    }
+  }
+
+  // The value keeps the memory of the entry alive
+  LookupResult result(const std::shared_ptr<const void> &pin, const KeyValue &item) const {
+    return LookupResult::from_value(std::make_shared<PinnedBuffer>(item.value, pin), item.indirect);
+  }
+
+  // Entry i, valid as long as pin is held
+  KeyValue entry(const std::shared_ptr<const TableFile> &file, uint64_t i, std::shared_ptr<const void> *pin,
+                 ReadMode mode = BLOCKING_READ) const {
+    assert(i < m_num_entries);
+    auto begin = offset(*file, i);
+    auto end = (i + 1 < m_num_entries) ? offset(*file, i + 1) : m_data_size;
+
+    if (!file->data) {
+      auto data = read(*file, begin, end, mode);
+      *pin = data;
+      return KeyValue(data.get());
+    }
+
+    if (m_verify_checksums) {
+      verify_blocks(*file, begin, end);
+    }
+
+    *pin = file;
+    return KeyValue(file->data + begin);
+  }
+
+  // Bytes [begin, end) of the entries of a table that isn't mapped. Whole blocks are
+  // read when they are cached or verified; blocks are verified every time they are read.
+  std::shared_ptr<const char> read(const TableFile &file, uint64_t begin, uint64_t end, ReadMode mode) const {
+    if (begin > end || end > m_data_size) {
+      corrupted("entry out of bounds");
+    }
+
+    auto first = begin / m_block_size;
+    auto last = std::max(end, begin + 1) - 1;
+    last = std::min(last / m_block_size, m_num_blocks - 1);
+
+    if (m_blocks && first == last) {
+      auto block = m_blocks->get(m_id, first);
+      if (!block) {
+        auto size = std::min<uint64_t>(m_block_size, m_data_size - first*m_block_size);
+        if (mode == NONBLOCKING_READ) {
+          throw BlockMiss{block_read(file, first, size)};
+        }
+
+        block = read_blocks(file, first, first + 1);
+        block = m_blocks->insert(m_id, first, block, size);
+      }
+      return std::shared_ptr<const char>(block, block.get() + (begin - first*m_block_size));
+    }
+
+    if (!m_verify_checksums) {
+      return file.reader->read(begin, end - begin);
+    }
+
+    auto blocks = read_blocks(file, first, last + 1);
+    return std::shared_ptr<const char>(blocks, blocks.get() + (begin - first*m_block_size));
+  }
+
+  // Read of a block left to the caller, see BlockRead
+  std::shared_ptr<BlockRead> block_read(const TableFile &file, uint64_t block, uint64_t size) const {
+    auto read = std::make_shared<BlockRead>();
+    read->file = file.reader;
+    read->offset = block*m_block_size;
+    read->size = size;
+
+    // The table may be gone by the time the block has been read
+    auto blocks = m_blocks;
+    auto id = m_id;
+    auto verify = m_verify_checksums;
+    auto expected = decode_fixed32(file.checksums + block*sizeof(uint32_t));
+    auto path = this->path();
+    read->complete = [blocks, id, block, size, verify, expected, path](std::shared_ptr<const char> data) {
+      if (verify && crc32c(data.get(), size) != expected) {
+        throw CorruptionError("Corrupted table " + path + ": checksum mismatch in block " + std::to_string(block));
+      }
+      blocks->insert(id, block, data, size);
+    };
+    return read;
+  }
+
+  // Reads and verifies blocks [first, last)
+  std::shared_ptr<const char> read_blocks(const TableFile &file, uint64_t first, uint64_t last) const {
+    auto begin = first*m_block_size;
+    auto end = std::min<uint64_t>(last*m_block_size, m_data_size);
+    auto data = file.reader->read(begin, end - begin);
+
+    if (m_verify_checksums) {
+      for (auto block = first; block < last; block++) {
+        check_block(file, block, data.get() + (block - first)*m_block_size);
+      }
+    }
+    return data;
+  }
+
+  LookupResult hash_lookup(const std::shared_ptr<const TableFile> &file, const Buffer &key, ReadMode mode) const {
+    std::shared_ptr<const void> pin;
+    auto hash = key.hash(HASH_INDEX_SEED);
+    auto mask = m_search_index_size/sizeof(uint64_t) - 1;
+
+    // The index is never full, probing ends at an empty slot
+    for (auto i = hash & mask; ; i = (i + 1) & mask) {
+      auto slot = decode_fixed64(file->search_index + i*sizeof(uint64_t));
+      if (slot == 0) {
+        return LookupResult::not_found();
+      }
+
+      if ((slot >> 32) == (hash >> 32)) {
+        auto item = entry(file, static_cast<uint32_t>(slot) - 1, &pin, mode);
+        if (item.key == key) {
+          return result(pin, item);
+        }
+      }
+    }
+  }
+
+  // Range of entries that contains key, if present
+  void predict(const std::shared_ptr<const TableFile> &file, const Buffer &key, uint64_t prefix,
+               int64_t *min, int64_t *max, ReadMode mode) const {
+    auto &segments = file->segments;
+    auto segment = std::upper_bound(segments.begin(), segments.end(), prefix, [](uint64_t prefix, const TableFile::Segment &s) {
+      return prefix < s.first_prefix;
+    });
+    if (segment != segments.begin()) {
+      --segment;
+    }
+
+    double position = segment->first_position;
+    if (prefix > segment->first_prefix) {
+      position += segment->slope*double(prefix - segment->first_prefix);
+    }
+
+    int64_t last = m_num_entries - 1;
+    int64_t predicted = std::min<double>(position, last);
+    int64_t error = file->max_error;
+    std::shared_ptr<const void> pin;
+    *min = std::max<int64_t>(predicted - error, 0);
+    *max = std::min<int64_t>(predicted + error, last);
+
+    // The error is only bounded for prefixes of the table; widen the range exponentially
+    // until it encloses the key
+    for (int64_t step = error + 1; *min > 0 && key < entry(file, *min, &pin, mode).key; step *= 2) {
+      *max = *min;
+      *min = std::max<int64_t>(*min - step, 0);
+    }
+    for (int64_t step = error + 1; *max < last && key > entry(file, *max, &pin, mode).key; step *= 2) {
+      *min = *max;
+      *max = std::min<int64_t>(*max + step, last);
+    }
+  }
+
+  uint64_t offset(const TableFile &file, uint64_t i) const {
+    auto entry = file.index + i*m_offset_width;
+    return (m_offset_width == sizeof(uint32_t)) ? decode_fixed32(entry) : decode_fixed64(entry);
+  }
+
+  void verify_metadata(const TableFile &file) const {
+    auto footer = file.index + m_offset_width*m_num_entries;
+    auto crc_offset = FOOTER_SIZE - sizeof(uint32_t);
+    if (crc32c(file.checksums, footer + crc_offset - file.checksums) != decode_fixed32(footer + crc_offset)) {
+      corrupted("metadata checksum mismatch");
+    }
+  }
+
+  // Verifies the blocks overlapping the byte range [begin, end) of the entries
+  void verify_blocks(const TableFile &file, uint64_t begin, uint64_t end) const {
+    if (begin > end || end > m_data_size) {
+      corrupted("entry out of bounds");
+    }
+
+    if (!file.data) {
+      // Reads a few blocks at a time
+      auto first = begin / m_block_size, last = std::min((std::max(end, begin + 1) - 1) / m_block_size + 1, m_num_blocks);
+      auto batch = std::max<uint64_t>(1, TableIterator::WINDOW_SIZE / m_block_size);
+      for (auto block = first; block < last; block += batch) {
+        auto blocks = file.reader->read(block*m_block_size, std::min((block + batch)*m_block_size, m_data_size) - block*m_block_size);
+        for (auto i = block; i < std::min(block + batch, last); i++) {
+          check_block(file, i, blocks.get() + (i - block)*m_block_size);
+        }
+      }
+      return;
+    }
+
+    for (auto block = begin / m_block_size; block < m_num_blocks && block*m_block_size < std::max(end, begin + 1); block++) {
+      if (file.verified[block].load(std::memory_order_acquire)) {
+        continue;
+      }
+
+      check_block(file, block, file.data + block*m_block_size);
+      file.verified[block].store(true, std::memory_order_release);
+    }
+  }
+
+  void check_block(const TableFile &file, uint64_t block, const char *data) const {
+    auto block_size = std::min<uint64_t>(m_block_size, m_data_size - block*m_block_size);
+    auto expected = decode_fixed32(file.checksums + block*sizeof(uint32_t));
+    if (crc32c(data, block_size) != expected) {
+      corrupted("checksum mismatch in block " + std::to_string(block));
+    }
+  }
+
+  void corrupted(const std::string &reason) const {
+    throw CorruptionError("Corrupted table " + path() + ": " + reason);
+  }
+
+  const uint64_t m_id = next_id();
+  std::string m_path;
+  mutable std::mutex m_path_mutex;
+  std::shared_ptr<TableCache> m_cache;
+  std::shared_ptr<const TableFile> m_file;
+  uint64_t m_file_size;
+  std::string m_footer;
+  uint64_t m_data_size;
+  uint64_t m_num_entries;
+  uint64_t m_num_blocks;
+  uint32_t m_block_size;
+  uint32_t m_prefix_offset;
+  uint8_t m_offset_width;
+  IndexType m_index_type;
+  uint64_t m_search_index_size;
+  uint64_t m_filter_size;
+  uint64_t m_range_filter_size;
+  std::string m_filter;
+  std::string m_range_filter;
+  bool m_verify_checksums;
+  bool m_delete = false;
+  int m_advice = MADV_NORMAL;
+  IOBackend m_io = MMAP_IO;
+  std::shared_ptr<BlockCache> m_blocks;
+  std::string m_min_key_data;
+  std::string m_max_key_data;
   Buffer m_min_key;
   Buffer m_max_key;
 };
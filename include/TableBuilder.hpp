@@ -4,71 +4,235 @@
 #include <uuid/uuid.h>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "AppendableMMap.hpp"
+#include "BloomFilter.hpp"
 #include "Buffer.hpp"
+#include "Coding.hpp"
 #include "Config.hpp"
+#include "CRC32C.hpp"
+#include "KeyPrefix.hpp"
 #include "KeyValue.hpp"
+#include "PrefixExtractor.hpp"
+#include "RateLimiter.hpp"
+#include "SequentialFile.hpp"
 #include "Table.hpp"
 #include "TableIterator.hpp"
+#include "ValueLog.hpp"
 
 class TableBuilder{
 public:
   typedef std::vector<std::shared_ptr<Table>> table_list;
 
-  TableBuilder(uint32_t table_size = 1 << 20, const std::string &path=""): m_table_size(table_size),
-                                                                           m_path(path) {
+  // Maximum distance between the position of a prefix and the one predicted by a learned index
+  static const uint64_t LEARNED_INDEX_ERROR = 8;
+
+  // Tables written to disk are paced by the rate limiter, if any. Tables get a Bloom filter
+  // with the given bits per key, if any, which also holds the prefixes of the keys if a
+  // prefix extractor is given, and optionally a range filter keeping the given number of
+  // suffix bits of every key.
+  TableBuilder(uint64_t table_size = 1 << 20, const std::string &path="", IndexType index_type = DENSE_INDEX,
+               std::shared_ptr<RateLimiter> limiter = nullptr, IOPriority priority = FLUSH_PRIORITY,
+               double filter_bits = 0, const PrefixExtractor &prefix_extractor = PrefixExtractor(),
+               bool range_filter = false, uint32_t range_filter_suffix_bits = 0):
+      m_table_size(table_size),
+      m_path(path),
+      m_index_type(index_type),
+      m_limiter(limiter),
+      m_priority(priority),
+      m_filter_bits(filter_bits),
+      m_prefix_extractor(prefix_extractor),
+      m_range_filter(range_filter, range_filter_suffix_bits) {
     clear();
   }
 
-  bool add(const Buffer &key, const Buffer &value) {
+  bool add(const Buffer &key, const Buffer &value, bool indirect = false) {
     assert(key.size() != 0);
 
-    initialize();
+    // An entry that doesn't fit in an empty table gets a table of its own
+    auto entry_size = KeyValue::serialized_size(key, value, indirect);
+    auto range_filter_size = m_range_filter.size_with(key);
+    initialize(Table::serialized_size(entry_size, 1, sizeof(uint64_t), m_index_type, m_filter_bits, 2, range_filter_size));
+
+    // Keys are sorted, keys sharing a prefix are next to each other
+    Buffer prefix;
+    bool new_prefix = m_filter_bits > 0 && m_prefix_extractor.extract(key, &prefix) && prefix != Buffer(m_last_prefix);
+    auto filter_hashes = m_filter_hashes.size() + (m_filter_bits > 0) + new_prefix;
+
+    if (Table::serialized_size(m_data_size + entry_size, m_index.size() + 1, m_offset_width, m_index_type, m_filter_bits,
+                               filter_hashes, range_filter_size) > m_size) {
+      return false;
+    }
 
-    if (current_size() + key.total_size() + value.total_size() + sizeof(uint32_t) > m_table_size) {
+    // Positions in the hash index are 32 bits wide
+    if (m_index_type == HASH_INDEX && m_index.size() + 1 == UINT32_MAX) {
       return false;
     }
 
-    m_index.push_back(m_mmap->head_index());
-    key.serialize(*m_mmap);
-    value.serialize(*m_mmap);
+    if (m_index.empty()) {
+      m_first_key.assign(key.data(), key.size());
+    }
+
+    auto shared = common_prefix_length(Buffer(m_first_key), key);
+    m_prefixes.push_back({shared, key_prefix(key, shared)});
+    if (m_index_type == HASH_INDEX) {
+      m_hashes.push_back(key.hash(Table::HASH_INDEX_SEED));
+    }
+    m_range_filter.add(key);
+    if (m_filter_bits > 0) {
+      m_filter_hashes.push_back(BloomFilter::hash(key));
+    }
+    if (new_prefix) {
+      m_filter_hashes.push_back(PrefixExtractor::hash(prefix));
+      m_last_prefix.assign(prefix.data(), prefix.size());
+    }
+
+    m_index.push_back(m_data_size);
+    EntryWriter writer{*this};
+    KeyValue::serialize(writer, key, value, indirect);
     return true;
   }
 
-  uint32_t current_size() {
-    return m_mmap->head_index() + sizeof(uint32_t)*m_index.size() + sizeof(uint32_t);
+  uint64_t current_size() {
+    return Table::serialized_size(m_data_size, m_index.size(), m_offset_width, m_index_type, m_filter_bits,
+                                  m_filter_hashes.size(), m_range_filter.size());
   }
 
   std::shared_ptr<Table> finalize() {
-    if (m_mmap->head_index() == 0) {
+    if (m_data_size == 0) {
       return nullptr;
     }
 
-    uint32_t index_size = m_index.size();
-    m_mmap->appendBack(&index_size, sizeof(uint32_t));
-    m_mmap->appendBack(&m_index[0], sizeof(uint32_t)*index_size);
-    auto res = std::make_shared<Table>(m_mmap);
+    std::string metadata = m_checksums;
+    if (m_data_size % Table::BLOCK_SIZE != 0) {
+      put_fixed32(&metadata, m_block_checksum);
+    }
+
+    // Prefixes skip the bytes shared by all keys, i.e. by the first and the last one
+    auto prefix_offset = m_prefixes.back().shared;
+    auto first_prefix = key_prefix(Buffer(m_first_key), prefix_offset);
+    std::vector<uint64_t> prefixes;
+    prefixes.reserve(m_index.size());
+    for (uint64_t i = 0; i < m_index.size(); i++) {
+      prefixes.push_back(prefix(i, prefix_offset, first_prefix));
+    }
+
+    auto search_index_begin = metadata.size();
+    if (m_index_type == LEARNED_INDEX) {
+      put_learned_index(&metadata, prefixes);
+    } else if (m_index_type == HASH_INDEX) {
+      put_hash_index(&metadata);
+    } else {
+      for (auto prefix : prefixes) {
+        put_fixed64(&metadata, prefix);
+      }
+    }
+    auto search_index_size = metadata.size() - search_index_begin;
+
+    auto filter_begin = metadata.size();
+    BloomFilter::put(&metadata, m_filter_hashes, m_filter_bits, m_prefix_extractor.id());
+    auto filter_size = metadata.size() - filter_begin;
+
+    auto range_filter_begin = metadata.size();
+    m_range_filter.put(&metadata);
+    auto range_filter_size = metadata.size() - range_filter_begin;
+
+    for (auto offset : m_index) {
+      if (m_offset_width == sizeof(uint32_t)) {
+        put_fixed32(&metadata, offset);
+      } else {
+        put_fixed64(&metadata, offset);
+      }
+    }
+
+    put_fixed64(&metadata, m_data_size);
+    put_fixed64(&metadata, m_index.size());
+    put_fixed32(&metadata, Table::BLOCK_SIZE);
+    put_fixed32(&metadata, prefix_offset);
+    metadata.push_back(m_offset_width);
+    metadata.push_back(m_index_type);
+    put_fixed64(&metadata, search_index_size);
+    put_fixed64(&metadata, filter_size);
+    put_fixed64(&metadata, range_filter_size);
+    put_fixed32(&metadata, crc32c(metadata.data(), metadata.size()));
+
+    auto mmap = m_mmap;
+    if (m_file) {
+      // The finished table is served from a read-only mapping, like tables loaded from disk
+      m_file->appendFront(metadata.data(), metadata.size());
+      m_file->sync();
+      mmap = std::make_shared<AppendableMMap>(m_file->filename());
+      m_file = nullptr;
+    } else {
+      mmap->appendBack(metadata.data(), metadata.size());
+    }
+
+    auto res = std::make_shared<Table>(mmap);
     clear();
     return res;
   }
 
-  static table_list merge_tables(const table_list &tables, LevelConfig config) {
+  // Unique path of a new table in the directory
+  static std::string new_table_path(const std::string &directory) {
+    uuid_t uuid;
+    char name[37];
+
+    uuid_generate(uuid);
+    uuid_unparse_lower(uuid, name);
+    return path_append(directory, name);
+  }
+
+  // Values in the value log that are shadowed by newer entries are reported to it as garbage.
+  static table_list merge_tables(const table_list &tables, LevelConfig config, ValueLog *vlog = nullptr) {
     // Front tables have precedence over tail tables!
-    TableBuilder builder(config.table_size, config.path_level);
+    TableBuilder builder(config.table_size, config.path_level, config.index_type, config.rate_limiter, COMPACTION_PRIORITY,
+                         config.filter_bits, config.prefix_extractor, config.range_filter,
+                         config.range_filter_suffix_bits);
     table_list result;
-    Buffer last_added_key;
+
+    // All inputs are verified before anything is merged, so that corrupted entries aren't
+    // propagated. Inputs aren't deleted, that's up to the caller once the outputs replace them.
+    for (const auto &it : tables) {
+      // Prefetched rather than read sequentially, lookups keep using the inputs meanwhile
+      if (config.access_hints) {
+        it->hint(MADV_WILLNEED);
+      }
+      it->verify();
+    }
 
     std::vector<std::pair<std::shared_ptr<Table>, TableIterator>> iterators;
     for (const auto &it : tables) {
-      it->delete_from_fs(); // Remove input tables from fs
       iterators.push_back(std::make_pair(it, it->begin()));
     }
 
+    try {
+      merge(iterators, builder, config, vlog, &result);
+    } catch (...) {
+      // Outputs of a failed merge would otherwise be picked up as tables of the level
+      for (const auto &table : result) {
+        table->delete_from_fs();
+      }
+      throw;
+    }
+    return result;
+  }
+
+private:
+  static void merge(std::vector<std::pair<std::shared_ptr<Table>, TableIterator>> &iterators, TableBuilder &builder,
+                    const LevelConfig &config, ValueLog *vlog, table_list *result) {
+    // Bytes read from the inputs that haven't been charged to the rate limiter yet
+    uint64_t unpaid = 0;
+    // A copy, inputs read with pread move their window past it
+    std::string last_added_key;
+
     while (true) {
       if (iterators.empty()) {
         break;
@@ -87,54 +251,195 @@ public:
       }
 
       auto item = (*min_iterator);
-      if (item.key != last_added_key) { // Ignore keys that have already been inserted
-        if (!builder.add(item.key, item.value)) {
-          result.push_back(builder.finalize());
-          builder.add(item.key, item.value);
+      if (item.key != Buffer(last_added_key)) { // Ignore keys that have already been inserted
+        if (!builder.add(item.key, item.value, item.indirect)) {
+          result->push_back(builder.finalize());
+          builder.add(item.key, item.value, item.indirect);
         }
 
-        last_added_key = item.key;
+        last_added_key.assign(item.key.data(), item.key.size());
+      } else if (item.indirect && vlog) {
+        vlog->discard(item.value);
+      }
+
+      unpaid += item.total_size();
+      if (config.rate_limiter && config.rate_limit_reads && unpaid >= SequentialFile::BUFFER_SIZE) {
+        config.rate_limiter->request(unpaid, COMPACTION_PRIORITY);
+        unpaid = 0;
       }
 
       // Remove empty input table
       if (++iterators[min_index].second == iterators[min_index].first->end()) {
+        if (config.access_hints) {
+          iterators[min_index].first->hint(MADV_DONTNEED);
+        }
         iterators.erase(iterators.begin() + min_index);
       }
     }
 
     auto last = builder.finalize();
     if (last != nullptr) {
-      result.push_back(last);
+      result->push_back(last);
     }
+  }
 
-    return result;
+  // Key prefix of an entry and the number of bytes its key has in common with the first one
+  struct EntryPrefix {
+    uint64_t shared;
+    uint64_t prefix;
+  };
+
+  // Destination of the entries, which are checksummed block by block on their way
+  struct EntryWriter {
+    TableBuilder &builder;
+
+    void appendFront(const void *data, uint64_t size) {
+      builder.append(static_cast<const char *>(data), size);
+    }
+  };
+
+  void append(const char *data, uint64_t size) {
+    if (m_file) {
+      m_file->appendFront(data, size);
+    } else {
+      m_mmap->appendFront(data, size);
+    }
+
+    while (size > 0) {
+      auto length = std::min<uint64_t>(size, Table::BLOCK_SIZE - m_data_size % Table::BLOCK_SIZE);
+      m_block_checksum = crc32c(data, length, m_block_checksum);
+      m_data_size += length;
+      data += length;
+      size -= length;
+
+      if (m_data_size % Table::BLOCK_SIZE == 0) {
+        put_fixed32(&m_checksums, m_block_checksum);
+        m_block_checksum = 0;
+      }
+    }
+  }
+
+  // Prefix of the i-th key after skipping offset bytes, given the one of the first key. As
+  // keys are sorted, offset doesn't exceed the bytes any key shares with the first one.
+  uint64_t prefix(uint64_t i, uint64_t offset, uint64_t first) const {
+    auto shared = m_prefixes[i].shared - offset;
+    if (shared >= sizeof(uint64_t)) {
+      return first;
+    }
+
+    auto mask = (shared == 0) ? 0 : ~0ull << (64 - 8*shared);
+    return (first & mask) | (m_prefixes[i].prefix >> 8*shared);
+  }
+
+  // Fits segments to the position of the first entry of every distinct prefix such that
+  // no position is off by more than LEARNED_INDEX_ERROR. A segment is extended as long as
+  // some slope through its first point stays within the error of all its points.
+  static void put_learned_index(std::string *metadata, const std::vector<uint64_t> &prefixes) {
+    const double error = LEARNED_INDEX_ERROR;
+    double min_slope = 0, max_slope = std::numeric_limits<double>::infinity();
+    uint64_t first = 0;
+
+    auto put_segment = [&]() {
+      auto slope = std::isinf(max_slope) ? 0 : (min_slope + max_slope)/2;
+      uint64_t bits;
+      memcpy(&bits, &slope, sizeof(bits));
+
+      put_fixed64(metadata, prefixes[first]);
+      put_fixed64(metadata, first);
+      put_fixed64(metadata, bits);
+    };
+
+    put_fixed64(metadata, LEARNED_INDEX_ERROR);
+    for (uint64_t i = 1; i < prefixes.size(); i++) {
+      if (prefixes[i] == prefixes[i - 1]) {
+        continue;
+      }
+
+      double dx = prefixes[i] - prefixes[first];
+      double dy = i - first;
+      auto low = (dy - error)/dx, high = (dy + error)/dx;
+
+      if (low > max_slope || high < min_slope) {
+        put_segment();
+        first = i;
+        min_slope = 0;
+        max_slope = std::numeric_limits<double>::infinity();
+      } else {
+        min_slope = std::max(min_slope, low);
+        max_slope = std::min(max_slope, high);
+      }
+    }
+    put_segment();
+  }
+
+  void put_hash_index(std::string *metadata) const {
+    std::vector<uint64_t> slots(Table::hash_slots(m_index.size()), 0);
+    auto mask = slots.size() - 1;
+
+    for (uint64_t i = 0; i < m_index.size(); i++) {
+      auto hash = m_hashes[i];
+      auto slot = hash & mask;
+      while (slots[slot] != 0) {
+        slot = (slot + 1) & mask;
+      }
+      slots[slot] = (hash & 0xffffffff00000000ull) | (i + 1);
+    }
+
+    for (auto slot : slots) {
+      put_fixed64(metadata, slot);
+    }
   }
 
-private:
   void clear() {
     m_mmap = nullptr;
+    m_file = nullptr;
+    m_data_size = 0;
+    m_block_checksum = 0;
+    m_checksums.clear();
     m_index.resize(0);
+    m_prefixes.resize(0);
+    m_hashes.resize(0);
+    m_filter_hashes.resize(0);
+    m_last_prefix.clear();
+    m_range_filter.clear();
   }
 
-  void initialize() {
-    if (m_mmap == nullptr) {
+  void initialize(uint64_t min_size) {
+    if (m_mmap == nullptr && m_file == nullptr) {
+      m_size = std::max(m_table_size, min_size);
+
+      // Offsets of tables smaller than 4 GB fit in 32 bits
+      m_offset_width = (m_size <= UINT32_MAX) ? sizeof(uint32_t) : sizeof(uint64_t);
+
       if (m_path.empty()) { // Anonymous mapping, used just for testing purposes
-        m_mmap = std::make_shared<AppendableMMap>(m_table_size);
+        m_mmap = std::make_shared<AppendableMMap>(m_size);
       } else {
-        uuid_t uuid;
-        char tmp[37];
-
-        uuid_generate(uuid);
-        uuid_unparse_lower(uuid, tmp);
-        m_mmap = std::make_shared<AppendableMMap>(m_table_size, m_path + "/" + tmp);
+        m_file.reset(new SequentialFile(new_table_path(m_path), m_size, m_limiter, m_priority));
       }
     }
   }
 
   std::shared_ptr<AppendableMMap> m_mmap;
-  uint32_t m_table_size;
-  std::vector<uint32_t> m_index;
+  std::unique_ptr<SequentialFile> m_file;
+  uint64_t m_table_size;
+  uint64_t m_size;
+  uint64_t m_data_size;
+  uint8_t m_offset_width;
+  uint32_t m_block_checksum;
+  std::string m_checksums;
+  std::string m_first_key;
+  std::vector<uint64_t> m_index;
+  std::vector<EntryPrefix> m_prefixes;
+  std::vector<uint64_t> m_hashes;
+  std::vector<uint64_t> m_filter_hashes;
   std::string m_path;
+  IndexType m_index_type;
+  std::shared_ptr<RateLimiter> m_limiter;
+  IOPriority m_priority;
+  double m_filter_bits;
+  PrefixExtractor m_prefix_extractor;
+  RangeFilterBuilder m_range_filter;
+  std::string m_last_prefix;
 };
 
 
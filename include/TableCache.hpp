@@ -0,0 +1,106 @@
+#ifndef TABLECACHE_H
+#define TABLECACHE_H
+
+#include <cstdint>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct TableFile;
+
+// Least recently used set of open table files. A file stays mapped while it is either
+// in the cache or in use; once the cache holds more than max_files files or more than
+// max_bytes of them the least recently used ones are dropped. A limit of 0 disables it.
+class TableCache {
+public:
+  TableCache(uint64_t max_files, uint64_t max_bytes): m_max_files(max_files), m_max_bytes(max_bytes) {}
+
+  std::shared_ptr<const TableFile> get(uint64_t id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto entry = m_entries.find(id);
+    if (entry == m_entries.end()) {
+      m_misses++;
+      return nullptr;
+    }
+
+    m_hits++;
+    m_lru.splice(m_lru.begin(), m_lru, entry->second);
+    return entry->second->file;
+  }
+
+  // Returns the cached file, which is a different one if another thread inserted it first
+  std::shared_ptr<const TableFile> insert(uint64_t id, std::shared_ptr<const TableFile> file, uint64_t size) {
+    // Evicted files are unmapped after the lock has been released
+    std::vector<std::shared_ptr<const TableFile>> evicted;
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto entry = m_entries.find(id);
+    if (entry != m_entries.end()) {
+      return entry->second->file;
+    }
+
+    m_lru.push_front({id, file, size});
+    m_entries[id] = m_lru.begin();
+    m_bytes += size;
+
+    // The most recent file is kept even if it exceeds the limit on its own
+    while (m_lru.size() > 1 && ((m_max_files && m_lru.size() > m_max_files) || (m_max_bytes && m_bytes > m_max_bytes))) {
+      evicted.push_back(evict(std::prev(m_lru.end())));
+    }
+
+    return file;
+  }
+
+  void erase(uint64_t id) {
+    std::shared_ptr<const TableFile> evicted;
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto entry = m_entries.find(id);
+    if (entry != m_entries.end()) {
+      evicted = evict(entry->second);
+    }
+  }
+
+  // Number of cached files
+  uint64_t size() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_lru.size();
+  }
+
+  friend std::ostream& operator<< (std::ostream& stream, TableCache &cache) {
+    std::lock_guard<std::mutex> lock(cache.m_mutex);
+    stream << cache.m_lru.size() << " open tables, " << (cache.m_bytes >> 20) << " MB, "
+           << cache.m_hits << " hits, " << cache.m_misses << " misses";
+    return stream;
+  }
+
+private:
+  struct Entry {
+    uint64_t id;
+    std::shared_ptr<const TableFile> file;
+    uint64_t size;
+  };
+
+  std::shared_ptr<const TableFile> evict(std::list<Entry>::iterator entry) {
+    auto file = entry->file;
+    m_bytes -= entry->size;
+    m_entries.erase(entry->id);
+    m_lru.erase(entry);
+    return file;
+  }
+
+  std::mutex m_mutex;
+  std::list<Entry> m_lru;
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> m_entries;
+  uint64_t m_max_files;
+  uint64_t m_max_bytes;
+  uint64_t m_bytes = 0;
+  uint64_t m_hits = 0;
+  uint64_t m_misses = 0;
+};
+
+#endif
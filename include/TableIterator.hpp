@@ -1,33 +1,39 @@
 #ifndef TABLEITERATOR_H
 #define TABLEITERATOR_H
 
+#include <algorithm>
+#include <cstdint>
 #include <iterator>
+#include <memory>
 
 #include "Buffer.hpp"
+#include "Coding.hpp"
 #include "KeyValue.hpp"
+#include "RandomAccessFile.hpp"
 
 class TableIterator : std::iterator<std::forward_iterator_tag, const KeyValue> {
 public:
   KeyValue operator*() const {
-    return KeyValue(m_current);
+    return KeyValue(current());
   }
 
   const KeyValue *operator->() {
-    m_current_item = KeyValue(m_current);
+    m_current_item = KeyValue(current());
     return &m_current_item;
   }
 
   bool operator==(const TableIterator &that) const {
-    return m_current == that.m_current;
+    return m_offset == that.m_offset;
   }
 
   bool operator!=(const TableIterator &that) const {
-    return m_current != that.m_current;
+    return m_offset != that.m_offset;
   }
 
   TableIterator& operator++() {
     auto kv = *(*this);
-    m_current += kv.key.total_size() + kv.value.total_size();
+    m_offset += kv.total_size();
+    fill();
     return *this;
   }
 
@@ -40,12 +46,67 @@ public:
 private:
   friend class Table;
 
-  TableIterator(const char *buffer) {
-    m_current = buffer;
+  static const uint64_t WINDOW_SIZE = 1 << 20;
+
+  // Iterators are compared by offset as the table may be mapped at different addresses
+  TableIterator(const char *data, uint64_t offset, std::shared_ptr<const void> pin): m_data(data),
+                                                                                    m_offset(offset),
+                                                                                    m_pin(pin) {}
+
+  // Reads the entries of a table that isn't mapped from offset on, through a window of the file
+  TableIterator(std::shared_ptr<const RandomAccessFile> file, uint64_t data_size, uint64_t offset = 0,
+                uint64_t window_size = WINDOW_SIZE): m_offset(offset),
+                                                     m_file(file),
+                                                     m_data_size(data_size),
+                                                     m_window_size(window_size) {
+    fill();
+  }
+
+  const char *current() const {
+    return m_data + (m_offset - m_window_begin);
+  }
+
+  // Moves the window over the current entry, whose size is only known once its key
+  // and value headers have been read
+  void fill() {
+    if (!m_file || m_offset >= m_data_size) {
+      return;
+    }
+
+    uint64_t key_size, value_header;
+    ensure(MAX_VARINT_LENGTH);
+    auto value_header_offset = decode_varint(current(), &key_size) - current() + key_size;
+    ensure(value_header_offset + MAX_VARINT_LENGTH);
+    auto value_offset = decode_varint(current() + value_header_offset, &value_header) - current();
+    ensure(value_offset + (value_header >> 1));
+  }
+
+  // Makes sure the window covers size bytes from the current offset, or up to the end
+  void ensure(uint64_t size) {
+    size = std::min(size, m_data_size - m_offset);
+    if (m_offset >= m_window_begin && m_offset + size <= m_window_end) {
+      return;
+    }
+
+    auto length = std::min(std::max(size, m_window_size), m_data_size - m_offset);
+    auto window = m_file->read(m_offset, length);
+    m_data = window.get();
+    m_pin = window;
+    m_window_begin = m_offset;
+    m_window_end = m_offset + length;
+    // Windows of short scans grow as they go on
+    m_window_size = std::max<uint64_t>(m_window_size, std::min<uint64_t>(2*m_window_size, WINDOW_SIZE));
   }
 
   KeyValue m_current_item;
-  const char *m_current = 0;
+  const char *m_data = 0;
+  uint64_t m_offset = 0;
+  std::shared_ptr<const void> m_pin;
+  std::shared_ptr<const RandomAccessFile> m_file;
+  uint64_t m_data_size = 0;
+  uint64_t m_window_begin = 0;
+  uint64_t m_window_end = 0;
+  uint64_t m_window_size = WINDOW_SIZE;
 };
 
 #endif
@@ -0,0 +1,67 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "ConcurrentQueue.hpp"
+
+// Fixed set of threads running submitted functions in order of submission. Tasks must
+// not wait for other tasks of the same pool.
+class ThreadPool {
+public:
+  // 0 threads means one per core
+  ThreadPool(uint32_t num_threads = 0) {
+    if (num_threads == 0) {
+      num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (uint32_t i = 0; i < num_threads; i++) {
+      m_threads.emplace_back(&ThreadPool::run, this);
+    }
+  }
+
+  ~ThreadPool() {
+    for (uint32_t i = 0; i < m_threads.size(); i++) {
+      m_queue.push(nullptr);
+    }
+
+    for (auto &thread : m_threads) {
+      thread.join();
+    }
+  }
+
+  // Exceptions thrown by the function are rethrown by the future
+  template <typename F>
+  std::future<typename std::result_of<F()>::type> submit(F function) {
+    auto task = std::make_shared<std::packaged_task<typename std::result_of<F()>::type()>>(function);
+    auto future = task->get_future();
+    m_queue.push([task]() { (*task)(); });
+    return future;
+  }
+
+  uint32_t size() const {
+    return m_threads.size();
+  }
+
+private:
+  void run() {
+    while (true) {
+      auto task = m_queue.pop();
+      if (!task) {
+        break;
+      }
+      task();
+    }
+  }
+
+  std::vector<std::thread> m_threads;
+  ConcurrentQueue<std::function<void()>> m_queue;
+};
+
+#endif
@@ -44,7 +44,7 @@ std::string gen_random(bool biased = false, int max_len = 16, int min_len = 1) {
 
   int diff = max_len - min_len;
   int len = (diff != 0) ? (min_len + (generator.rand() % diff)) : min_len;
-  char s[len];
+  char s[len + 1];
 
   for (int i = 0; i < len; ++i) {
     if (biased) {
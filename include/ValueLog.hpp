@@ -0,0 +1,358 @@
+#ifndef VALUELOG_H
+#define VALUELOG_H
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+
+#include "AppendableMMap.hpp"
+#include "Buffer.hpp"
+#include "Coding.hpp"
+#include "Config.hpp"
+#include "CRC32C.hpp"
+#include "FileSystem.hpp"
+
+// Location of a value in the value log, stored in tables in place of the value
+struct ValuePointer {
+  ValuePointer(uint64_t file, uint64_t offset, uint64_t size): file(file), offset(offset), size(size) {}
+
+  ValuePointer(const Buffer &encoded) {
+    auto ptr = decode_varint(encoded.data(), &file);
+    ptr = decode_varint(ptr, &offset);
+    decode_varint(ptr, &size);
+  }
+
+  std::string encode() const {
+    char tmp[3*MAX_VARINT_LENGTH];
+    auto end = encode_varint(encode_varint(encode_varint(tmp, file), offset), size);
+    return std::string(tmp, end - tmp);
+  }
+
+  uint64_t file;
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Append-only log of large values (see WiscKey). Values are written once when a
+// memtable is dumped and tables only reference them, so that compactions don't
+// have to move them around. Space is reclaimed by relocating the live values of
+// files that contain mostly overwritten or deleted values.
+//
+// Every file is a sequence of records: the key and the value, each prefixed by
+// its varint encoded size. The amount of garbage of every file is kept in a summary
+// next to the files when the log is closed.
+class ValueLog {
+public:
+  // A log opened with a value threshold of 0 only serves the values written before
+  ValueLog(const Config &config): m_path(path_of(config)),
+                                  m_threshold(config.value_threshold),
+                                  m_file_size(config.vlog_file_size),
+                                  m_gc_ratio(config.vlog_gc_ratio) {
+    if (config.levels[0].overwrite) {
+      delete_directory(m_path);
+      delete_file(summary_path());
+    }
+
+    mkdir(config.levels[0].path_db);
+    mkdir(m_path);
+
+    for (const auto &name : ls(m_path)) {
+      auto id = std::stoull(name);
+      m_files[id] = std::make_shared<File>(id, path(id), O_RDONLY);
+      m_next_id = std::max<uint64_t>(m_next_id, id + 1);
+    }
+    load_summary();
+  }
+
+  ~ValueLog() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_active && m_active->size == 0) {
+      m_files.erase(m_active->id);
+      delete_file(path(m_active->id));
+    }
+  }
+
+  // Whether the store has a value log, which tables may reference even if values aren't
+  // separated anymore
+  static bool exists(const Config &config) {
+    return file_size(path_of(config)) >= 0;
+  }
+
+  bool separates(const Buffer &value) const {
+    return m_threshold > 0 && value.size() >= m_threshold;
+  }
+
+  // Appends a record and returns the encoded pointer to its value
+  std::string append(const Buffer &key, const Buffer &value) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    char key_header[MAX_VARINT_LENGTH], value_header[MAX_VARINT_LENGTH];
+    auto key_header_size = encode_varint(key_header, key.size()) - key_header;
+    auto value_header_size = encode_varint(value_header, value.size()) - value_header;
+    auto record_size = key_header_size + key.size() + value_header_size + value.size();
+
+    if (!m_active || (m_active->size > 0 && m_active->size + record_size > m_file_size)) {
+      roll();
+    }
+
+    struct iovec iov[4] = {{key_header, (size_t) key_header_size},
+                           {const_cast<char *>(key.data()), key.size()},
+                           {value_header, (size_t) value_header_size},
+                           {const_cast<char *>(value.data()), value.size()}};
+    write_fully(m_active->fd, iov, 4, record_size);
+
+    ValuePointer pointer(m_active->id, m_active->size + record_size - value.size(), value.size());
+    m_active->size += record_size;
+    return pointer.encode();
+  }
+
+  // Makes appended values durable; needs to happen before tables referencing them are
+  void sync() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_active && fdatasync(m_active->fd) == -1) {
+      throw std::system_error(errno, std::system_category());
+    }
+  }
+
+  // Returns nullptr if the file has been garbage collected in the meantime
+  std::shared_ptr<Buffer> read(const Buffer &encoded) {
+    ValuePointer pointer(encoded);
+    auto file = find(pointer.file);
+    if (!file) {
+      return nullptr;
+    }
+
+    std::string value(pointer.size, '\0');
+    for (uint64_t read = 0; read < pointer.size;) {
+      auto res = pread(file->fd, &value[read], pointer.size - read, pointer.offset + read);
+      if (res <= 0) {
+        throw std::system_error(res == 0 ? EIO : errno, std::system_category());
+      }
+      read += res;
+    }
+
+    return std::make_shared<OwnedBuffer>(std::move(value));
+  }
+
+  // Records that a value isn't referenced anymore
+  void discard(const Buffer &encoded) {
+    ValuePointer pointer(encoded);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_files.find(pointer.file);
+    if (it != m_files.end()) {
+      it->second->garbage += pointer.size;
+    }
+  }
+
+  // Picks the file with the highest fraction of garbage, if above the configured ratio
+  bool gc_candidate(uint64_t *id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    double best = m_gc_ratio;
+    bool found = false;
+
+    for (const auto &item : m_files) {
+      auto &file = item.second;
+      if (file == m_active || file->size == 0) {
+        continue;
+      }
+
+      double ratio = double(file->garbage) / file->size;
+      if (ratio >= best) {
+        best = ratio;
+        *id = file->id;
+        found = true;
+      }
+    }
+
+    return found;
+  }
+
+  // Invokes callback(key, value, pointer) for every record of a sealed file
+  template <typename F>
+  void scan(uint64_t id, F callback) {
+    auto file = find(id);
+    assert(file && file != m_active);
+
+    AppendableMMap mmap(path(id));
+    auto data = mmap.data();
+    for (uint64_t offset = 0; offset < mmap.size();) {
+      auto key = Buffer::deserialize(data + offset);
+      auto value = Buffer::deserialize(data + offset + key.total_size());
+      ValuePointer pointer(id, value.data() - data, value.size());
+      callback(key, value, pointer.encode());
+      offset += key.total_size() + value.total_size();
+    }
+  }
+
+  void remove(uint64_t id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    assert(!m_active || m_active->id != id);
+    m_files.erase(id);
+    delete_file(path(id));
+  }
+
+  void destroy() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_active = nullptr;
+    m_files.clear();
+    delete_directory(m_path);
+    delete_file(summary_path());
+  }
+
+  // Persists the garbage of every file, which would otherwise be forgotten by the next start
+  void save_summary() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::string summary;
+
+    for (const auto &item : m_files) {
+      put_varint(&summary, item.first);
+      put_varint(&summary, item.second->size);
+      put_varint(&summary, item.second->garbage);
+    }
+    lock.unlock();
+
+    put_fixed32(&summary, crc32c(summary.data(), summary.size()));
+    write_file(summary_path(), summary);
+  }
+
+  // Bytes of values that aren't referenced anymore
+  uint64_t garbage() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t garbage = 0;
+    for (const auto &item : m_files) {
+      garbage += item.second->garbage;
+    }
+    return garbage;
+  }
+
+  friend std::ostream& operator<< (std::ostream& stream, ValueLog &log) {
+    std::lock_guard<std::mutex> lock(log.m_mutex);
+    uint64_t size = 0, garbage = 0;
+    for (const auto &item : log.m_files) {
+      size += item.second->size;
+      garbage += item.second->garbage;
+    }
+    stream << log.m_files.size() << " files, " << (size >> 20) << " MB, " << (garbage >> 20) << " MB garbage";
+    return stream;
+  }
+
+private:
+  struct File {
+    File(uint64_t id, const std::string &path, int flags): id(id) {
+      fd = open(path.c_str(), flags, S_IRUSR | S_IWUSR);
+      if (fd == -1) {
+        throw std::system_error(errno, std::system_category());
+      }
+
+      struct stat sb;
+      if (fstat(fd, &sb) == -1) {
+        throw std::system_error(errno, std::system_category());
+      }
+      size = sb.st_size;
+    }
+
+    ~File() {
+      close(fd);
+    }
+
+    uint64_t id;
+    int fd;
+    uint64_t size;
+    uint64_t garbage = 0;
+  };
+
+  static std::string path_of(const Config &config) {
+    return path_append(config.levels[0].path_db, "vlog");
+  }
+
+  std::string path(uint64_t id) const {
+    return path_append(m_path, std::to_string(id));
+  }
+
+  std::string summary_path() const {
+    return m_path + ".summary";
+  }
+
+  // Files whose size changed since the summary was saved keep no garbage; a corrupted
+  // summary is ignored
+  void load_summary() {
+    std::string contents;
+    if (!read_file(summary_path(), &contents) || contents.size() < sizeof(uint32_t)) {
+      return;
+    }
+
+    auto end = contents.data() + contents.size() - sizeof(uint32_t);
+    if (crc32c(contents.data(), end - contents.data()) != decode_fixed32(end)) {
+      return;
+    }
+
+    for (auto ptr = contents.data(); ptr < end; ) {
+      uint64_t id, size, garbage;
+      ptr = decode_varint(ptr, &id);
+      ptr = decode_varint(ptr, &size);
+      ptr = decode_varint(ptr, &garbage);
+
+      auto it = m_files.find(id);
+      if (it != m_files.end() && it->second->size == size) {
+        it->second->garbage = garbage;
+      }
+    }
+  }
+
+  std::shared_ptr<File> find(uint64_t id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_files.find(id);
+    return (it != m_files.end()) ? it->second : nullptr;
+  }
+
+  void roll() {
+    if (m_active && fdatasync(m_active->fd) == -1) {
+      throw std::system_error(errno, std::system_category());
+    }
+
+    auto id = m_next_id++;
+    m_active = std::make_shared<File>(id, path(id), O_CREAT | O_EXCL | O_RDWR | O_APPEND);
+    m_files[id] = m_active;
+  }
+
+  static void write_fully(int fd, struct iovec *iov, int iovcnt, uint64_t size) {
+    while (size > 0) {
+      auto res = writev(fd, iov, iovcnt);
+      if (res == -1) {
+        throw std::system_error(errno, std::system_category());
+      }
+
+      size -= res;
+      while (iovcnt > 0 && res >= iov->iov_len) {
+        res -= iov->iov_len;
+        iov++;
+        iovcnt--;
+      }
+      if (iovcnt > 0) {
+        iov->iov_base = reinterpret_cast<char *>(iov->iov_base) + res;
+        iov->iov_len -= res;
+      }
+    }
+  }
+
+  std::string m_path;
+  uint64_t m_threshold;
+  uint64_t m_file_size;
+  double m_gc_ratio;
+
+  std::map<uint64_t, std::shared_ptr<File>> m_files;
+  std::shared_ptr<File> m_active;
+  uint64_t m_next_id = 0;
+  std::mutex m_mutex;
+};
+
+#endif
@@ -11,6 +11,8 @@
 #include "Utils.hpp"
 #include "Config.hpp"
 #include "ParallelKVStore.hpp"
+#include "SSTWriter.hpp"
+#include "BulkLoader.hpp"
 
 using namespace std;
 
@@ -18,8 +20,14 @@ enum OP{
   NOP,
   FILLRANDOM,
   FILLSEQ,
+  INGEST,
+  BULKLOAD,
   READRANDOM,
-  READSEQ
+  READSEQ,
+  SCANPREFIX,
+  SCANRANGE,
+  HASH,
+  INDEX
 };
 
 int num_partitions = 1;
@@ -30,6 +38,22 @@ int num_elements = 1 << 20;
 int element_size = 1024;
 int ss_table_size = 10 << 20;
 int memtable_size = 10 << 20;
+int value_threshold = 0;
+bool level0_hash_index = false;
+IndexType index_type = DENSE_INDEX;
+int max_open_tables = 0;
+bool access_hints = false;
+IOBackend io_backend = MMAP_IO;
+int block_cache_size = 0;
+bool async_reads = false;
+int rate_limit = 0;
+int max_rate_limit = 0;
+int bulk_memory = 256;
+CompactionStyle compaction_style = LEVELED_COMPACTION;
+double filter_bits_per_key = 0;
+int filter_memory = 0;
+int prefix_length = 0;
+int range_filter_suffix_bits = -1;
 bool clear = true;
 string path = "/tmp";
 
@@ -53,8 +77,109 @@ string pad(unsigned int x) {
   return ss.str();
 }
 
+// djb2 http://www.cse.yorku.ca/~oz/hash.html, the former partitioning hash
+uint64_t djb2(const Buffer &key) {
+  uint64_t hash = 5381;
+
+  for (uint64_t i = 0; i < key.size(); i++) {
+    auto c = key.data()[i];
+    hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+  }
+
+  return hash;
+}
+
+template <typename F>
+void hash_distribution(const string &name, const vector<string> &keys, F function) {
+  vector<long> buckets(num_partitions);
+  uint64_t checksum = 0;
+  auto start = chrono::steady_clock::now();
+
+  for (const auto &key : keys) {
+    auto hash = function(key);
+    buckets[hash % num_partitions]++;
+    checksum ^= hash;
+  }
+
+  auto end = chrono::steady_clock::now();
+  auto duration = chrono::duration <float> (end - start).count();
+
+  // Chi-squared statistic of the partition sizes, ~num_partitions for a uniform hash
+  double expected = double(keys.size())/num_partitions, chi_squared = 0;
+  for (auto count : buckets) {
+    chi_squared += (count - expected)*(count - expected)/expected;
+  }
+
+  auto minmax = minmax_element(buckets.begin(), buckets.end());
+  cout << name << ": " << 1e9*duration/keys.size() << " ns/key, "
+       << "chi-squared " << chi_squared << ", "
+       << "smallest partition " << *minmax.first/expected << "x, "
+       << "largest partition " << *minmax.second/expected << "x "
+       << "(" << (checksum & 1) << ")" << endl;
+}
+
+void hash_distribution() {
+  vector<string> sequential, random;
+  for (int j = 0; j < num_elements; j++) {
+    sequential.push_back(pad(j));
+    random.push_back(gen_random(false, 16, 16));
+  }
+
+  hash_distribution("djb2 sequential", sequential, djb2);
+  hash_distribution("hash64 sequential", sequential, [](const Buffer &key) { return key.hash(); });
+  hash_distribution("djb2 random", random, djb2);
+  hash_distribution("hash64 random", random, [](const Buffer &key) { return key.hash(); });
+}
+
+void table_index(const string &name, const vector<string> &keys, IndexType index_type) {
+  auto builder = TableBuilder(numeric_limits<uint32_t>::max(), "", index_type);
+  for (const auto &key : keys) {
+    builder.add(key, "x");
+  }
+  auto table = builder.finalize();
+
+  vector<string> lookups(keys);
+  random_shuffle(lookups.begin(), lookups.end());
+  uint64_t found = 0;
+
+  auto start = chrono::steady_clock::now();
+  for (const auto &key : lookups) {
+    found += table->get(key).is_found();
+  }
+  auto end = chrono::steady_clock::now();
+  auto duration = chrono::duration <float> (end - start).count();
+
+  cout << name << ": " << 1e9*duration/lookups.size() << " ns/get, "
+       << double(table->index_size())/table->size() << " index bytes/entry "
+       << "(" << found << " found)" << endl;
+}
+
+// Lookup latency and index size of the table index types
+void table_index() {
+  vector<string> sequential, sparse, random;
+  for (int j = 0; j < num_elements; j++) {
+    sequential.push_back(pad(j));
+    sparse.push_back(pad(permuteQPR(j)));
+    random.push_back(gen_random(false, 16, 16));
+  }
+  sort(sparse.begin(), sparse.end());
+  sort(random.begin(), random.end());
+  random.erase(unique(random.begin(), random.end()), random.end());
+
+  table_index("dense sequential", sequential, DENSE_INDEX);
+  table_index("learned sequential", sequential, LEARNED_INDEX);
+  table_index("hash sequential", sequential, HASH_INDEX);
+  table_index("dense sparse", sparse, DENSE_INDEX);
+  table_index("learned sparse", sparse, LEARNED_INDEX);
+  table_index("hash sparse", sparse, HASH_INDEX);
+  table_index("dense random", random, DENSE_INDEX);
+  table_index("learned random", random, LEARNED_INDEX);
+  table_index("hash random", random, HASH_INDEX);
+}
+
 void read(const Config &config, bool random) {
   auto store = new ParallelKVStore(config);
+  cout << "Startup: " << store->startup_time()*1000 << " ms" << endl;
   auto start = chrono::steady_clock::now();
   vector<thread> threads;
   std::atomic<long> bytes;
@@ -92,6 +217,7 @@ void read(const Config &config, bool random) {
     thread.join();
   }
 
+  cout << *store;
   delete store;
   auto end = chrono::steady_clock::now();
   auto diff = end - start;
@@ -103,8 +229,50 @@ void read(const Config &config, bool random) {
   cout << "Read rate: " << num_elements/duration << " items/sec" << endl;
 }
 
+// Scans around random keys, half of which were never written: either the keys sharing their
+// first digits, as many as the prefix extractor takes if any, or the next hundred keys
+void scan(const Config &config, bool prefix) {
+  auto store = new ParallelKVStore(config);
+  cout << "Startup: " << store->startup_time()*1000 << " ms" << endl;
+  auto length = prefix_length > 0 ? prefix_length : 7;
+  auto num_scans = max(num_elements/100, 1);
+  auto start = chrono::steady_clock::now();
+  vector<thread> threads;
+  std::atomic<long> items, found;
+
+  items = 0;
+  found = 0;
+  for (int i = 0; i < num_threads; i++) {
+    threads.push_back(thread([&store, i, &items, &found, length, num_scans, prefix]{
+          auto chunk_size = num_scans/num_threads;
+          auto offset = i * chunk_size;
+
+          for (long j = offset; j < offset + chunk_size; j++) {
+            auto x = permuteQPR((j % 2) ? j : num_elements + j);
+            auto entries = prefix ? store->scan_prefix(pad(x).substr(0, length)) : store->scan(pad(x), pad(x + 100));
+            items += entries.size();
+            found += !entries.empty();
+          }
+        }));
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  cout << *store;
+  delete store;
+  auto end = chrono::steady_clock::now();
+  auto duration = chrono::duration <float> (end - start).count();
+
+  cout << "Scans: " << num_scans << ", " << found << " non-empty, " << items << " items" << endl;
+  cout << "Duration: " << duration << " seconds" << endl;
+  cout << "Scan rate: " << num_scans/duration << " scans/sec" << endl;
+}
+
 void fill(const Config &config, bool random) {
   auto store = new ParallelKVStore(config);
+  cout << "Startup: " << store->startup_time()*1000 << " ms" << endl;
   auto start = chrono::steady_clock::now();
   vector<thread> threads;
   std::atomic<long> bytes;
@@ -145,13 +313,109 @@ void fill(const Config &config, bool random) {
   cout << "Duration: " << duration << " seconds" << endl;
   cout << "Fill rate: " << (bytes >> 20)/duration << " MB/sec" << endl;
   cout << "Fill rate: " << num_elements/duration << " items/sec" << endl;
+  if (config.rate_limiter) {
+    cout << "Rate limiter: " << *config.rate_limiter << endl;
+  }
+}
+
+// Writes sequential keys into tables with an SSTWriter and ingests them
+void ingest(const Config &config) {
+  auto store = new ParallelKVStore(config);
+  cout << "Startup: " << store->startup_time()*1000 << " ms" << endl;
+  auto start = chrono::steady_clock::now();
+  long bytes = 0;
+
+  string value(element_size, 'F');
+  auto directory = path_append(path, "sst");
+  mkdir(directory);
+
+  SSTWriter writer(config, directory);
+  for (long j = 0; j < num_elements; j++) {
+    auto key = pad(j);
+    bytes += key.size() + element_size;
+    writer.add(key, value);
+  }
+  auto tables = writer.finish();
+  auto written = chrono::steady_clock::now();
+
+  store->ingest_files(tables);
+  delete store;
+  delete_directory(directory);
+  auto end = chrono::steady_clock::now();
+  auto duration = chrono::duration <float> (end - start).count();
+
+  cout << "Total size: " << (bytes >> 20) << " MB" << endl;
+  cout << "Tables: " << tables.size() << ", written in " << chrono::duration<float>(written - start).count()
+       << " seconds, ingested in " << chrono::duration<float>(end - written).count() << " seconds" << endl;
+  cout << "Duration: " << duration << " seconds" << endl;
+  cout << "Fill rate: " << (bytes >> 20)/duration << " MB/sec" << endl;
+  cout << "Fill rate: " << num_elements/duration << " items/sec" << endl;
+}
+
+// Sorts random keys with a BulkLoader and ingests the resulting tables
+void bulkload(const Config &config) {
+  auto store = new ParallelKVStore(config);
+  cout << "Startup: " << store->startup_time()*1000 << " ms" << endl;
+  auto start = chrono::steady_clock::now();
+
+  string value(element_size, 'F');
+  auto directory = path_append(path, "bulk");
+  mkdir(directory);
+
+  BulkLoader loader(config, directory, uint64_t(bulk_memory) << 20);
+  for (long j = 0; j < num_elements; j++) {
+    loader.add(pad(permuteQPR(j)), value);
+  }
+  auto tables = loader.finish();
+  auto sorted = chrono::steady_clock::now();
+
+  store->ingest_files(tables);
+  delete store;
+  delete_directory(directory);
+  auto end = chrono::steady_clock::now();
+  auto duration = chrono::duration <float> (end - start).count();
+  auto bytes = loader.bytes();
+
+  cout << "Total size: " << (bytes >> 20) << " MB" << endl;
+  cout << "Runs: " << loader.runs() << ", tables: " << tables.size() << ", sorted in "
+       << chrono::duration<float>(sorted - start).count() << " seconds, ingested in "
+       << chrono::duration<float>(end - sorted).count() << " seconds" << endl;
+  cout << "Duration: " << duration << " seconds" << endl;
+  cout << "Fill rate: " << (bytes >> 20)/duration << " MB/sec" << endl;
+  cout << "Fill rate: " << num_elements/duration << " items/sec" << endl;
+}
+
+Config create_config(bool overwrite) {
+  Config config("db", path, num_levels, ss_table_size, threshold, memtable_size, num_partitions, overwrite);
+  config.value_threshold = value_threshold;
+  config.level0_hash_index = level0_hash_index;
+  config.index_type = index_type;
+  config.max_open_tables = max_open_tables;
+  config.access_hints = access_hints;
+  config.io_backend = io_backend;
+  config.block_cache_size = block_cache_size;
+  config.async_reads = async_reads;
+  config.compaction_style = compaction_style;
+  config.filter_bits_per_key = filter_bits_per_key;
+  config.filter_memory = uint64_t(filter_memory) << 20;
+  if (prefix_length > 0) {
+    config.prefix_extractor = PrefixExtractor::fixed(prefix_length);
+  }
+  if (range_filter_suffix_bits >= 0) {
+    config.range_filters = true;
+    config.range_filter_suffix_bits = range_filter_suffix_bits;
+  }
+  if (rate_limit > 0) {
+    config.rate_limiter = make_shared<RateLimiter>(uint64_t(rate_limit) << 20, uint64_t(max_rate_limit) << 20);
+  }
+  return config;
 }
 
 int main(int argc, char* argv[]) {
   OP op = NOP;
   int c;
 
-  while ((c = getopt (argc, argv, "p:l:n:s:t:m:o:r:d:c:")) != -1) {
+  while ((c = getopt (argc, argv, "p:l:n:s:t:m:o:r:d:c:v:i:e:x:f:a:b:k:u:w:g:z:y:q:j:h:R:")) != -1) {
     switch (c) {
     case 'p':
       num_partitions = stoul(optarg);
@@ -189,15 +453,125 @@ int main(int argc, char* argv[]) {
       path = optarg;
       break;
 
+    case 'v':
+      value_threshold = stoul(optarg);
+      break;
+
+    case 'i':
+      level0_hash_index = stoul(optarg);
+      break;
+
+    case 'e':
+      threshold = stoul(optarg);
+      break;
+
+    case 'f':
+      max_open_tables = stoul(optarg);
+      break;
+
+    case 'a':
+      access_hints = stoul(optarg);
+      break;
+
+    case 'k':
+      block_cache_size = stoul(optarg) << 20;
+      break;
+
+    case 'u':
+      async_reads = stoul(optarg);
+      break;
+
+    case 'w':
+      rate_limit = stoul(optarg);
+      break;
+
+    case 'g':
+      max_rate_limit = stoul(optarg);
+      break;
+
+    case 'z':
+      bulk_memory = stoul(optarg);
+      break;
+
+    case 'b':
+      if (strcmp("mmap", optarg) == 0) {
+        io_backend = MMAP_IO;
+      } else if (strcmp("pread", optarg) == 0) {
+        io_backend = PREAD_IO;
+      } else if (strcmp("direct", optarg) == 0) {
+        io_backend = DIRECT_IO;
+      } else {
+        cerr << "Invalid I/O backend " << optarg << endl;
+        return -1;
+      }
+
+      break;
+
+    case 'q':
+      filter_bits_per_key = stod(optarg);
+      break;
+
+    case 'j':
+      filter_memory = stoul(optarg);
+      break;
+
+    case 'h':
+      prefix_length = stoul(optarg);
+      break;
+
+    case 'R':
+      range_filter_suffix_bits = stoul(optarg);
+      break;
+
+    case 'y':
+      if (strcmp("leveled", optarg) == 0) {
+        compaction_style = LEVELED_COMPACTION;
+      } else if (strcmp("tiered", optarg) == 0) {
+        compaction_style = TIERED_COMPACTION;
+      } else if (strcmp("lazy", optarg) == 0) {
+        compaction_style = LAZY_LEVELING_COMPACTION;
+      } else {
+        cerr << "Invalid compaction style " << optarg << endl;
+        return -1;
+      }
+
+      break;
+
+    case 'x':
+      if (strcmp("dense", optarg) == 0) {
+        index_type = DENSE_INDEX;
+      } else if (strcmp("learned", optarg) == 0) {
+        index_type = LEARNED_INDEX;
+      } else if (strcmp("hash", optarg) == 0) {
+        index_type = HASH_INDEX;
+      } else {
+        cerr << "Invalid index type " << optarg << endl;
+        return -1;
+      }
+
+      break;
+
     case 'o':
       if (strcmp("fillrandom", optarg) == 0) {
         op = FILLRANDOM;
       } else if (strcmp("fillseq", optarg) == 0) {
         op = FILLSEQ;
+      } else if (strcmp("ingest", optarg) == 0) {
+        op = INGEST;
+      } else if (strcmp("bulkload", optarg) == 0) {
+        op = BULKLOAD;
       } else if (strcmp("readrandom", optarg) == 0) {
         op = READRANDOM;
       } else if (strcmp("readseq", optarg) == 0) {
         op = READSEQ;
+      } else if (strcmp("scanprefix", optarg) == 0) {
+        op = SCANPREFIX;
+      } else if (strcmp("scanrange", optarg) == 0) {
+        op = SCANRANGE;
+      } else if (strcmp("hash", optarg) == 0) {
+        op = HASH;
+      } else if (strcmp("index", optarg) == 0) {
+        op = INDEX;
       } else {
         cerr << "Invalid operation " << optarg << endl;
         return -1;
@@ -214,31 +588,67 @@ int main(int argc, char* argv[]) {
   switch(op) {
   case FILLRANDOM:
     {
-      Config config("db", path, num_levels, ss_table_size, threshold, memtable_size, num_partitions, clear);
+      auto config = create_config(clear);
       fill(config, true);
       break;
     }
 
   case FILLSEQ:
     {
-      Config config("db", path, num_levels, ss_table_size, threshold, memtable_size, num_partitions, clear);
+      auto config = create_config(clear);
       fill(config, false);
       break;
     }
 
+  case INGEST:
+    {
+      auto config = create_config(clear);
+      ingest(config);
+      break;
+    }
+
+  case BULKLOAD:
+    {
+      auto config = create_config(clear);
+      bulkload(config);
+      break;
+    }
+
   case READRANDOM:
     {
-      Config config("db", path, num_levels, ss_table_size, threshold, memtable_size, num_partitions);
+      auto config = create_config(false);
       read(config, true);
       break;
     }
 
   case READSEQ:
     {
-      Config config("db", path, num_levels, ss_table_size, threshold, memtable_size, num_partitions);
+      auto config = create_config(false);
       read(config, false);
       break;
     }
+
+  case SCANPREFIX:
+    {
+      auto config = create_config(false);
+      scan(config, true);
+      break;
+    }
+
+  case SCANRANGE:
+    {
+      auto config = create_config(false);
+      scan(config, false);
+      break;
+    }
+
+  case HASH:
+    hash_distribution();
+    break;
+
+  case INDEX:
+    table_index();
+    break;
   }
 
   return 0;
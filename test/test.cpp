@@ -13,15 +13,24 @@
 #include "Buffer.hpp"
 #include "AppendableMMap.hpp"
 #include "TableBuilder.hpp"
+#include "BlockCache.hpp"
+#include "BloomFilter.hpp"
+#include "CuckooIndex.hpp"
+#include "FenceIndex.hpp"
+#include "RangeFilter.hpp"
+#include "TableCache.hpp"
+#include "RateLimiter.hpp"
 #include "LSMTree.hpp"
 #include "KVStore.hpp"
 #include "ParallelKVStore.hpp"
+#include "SSTWriter.hpp"
+#include "BulkLoader.hpp"
 #include "Utils.hpp"
 
 using namespace std;
 
-shared_ptr<Table> create_table(uint32_t size, const vector<tuple<string, string>> &kv) {
-  auto builder = TableBuilder(size);
+shared_ptr<Table> create_table(uint32_t size, const vector<tuple<string, string>> &kv, IndexType index_type = DENSE_INDEX) {
+  auto builder = TableBuilder(size, "", index_type);
   for (const auto &item : kv) {
     REQUIRE(builder.add(get<0>(item), get<1>(item)));
   }
@@ -41,12 +50,13 @@ TEST_CASE( "Buffer" ) {
 
   SECTION( "Serialization" ) {
     char test[100];
-    uint16_t size = sizeof(data);
-    *((uint16_t *)test) = size;
-    strcpy(test + sizeof(uint16_t), data);
+    uint8_t size = sizeof(data);
+    test[0] = size;
+    strcpy(test + sizeof(uint8_t), data);
 
     auto buffer = Buffer::deserialize(test);
     REQUIRE( buffer.size() == size);
+    REQUIRE( buffer.total_size() == size + 1);
     REQUIRE( memcmp(buffer.data(), data, size) == 0 );
   }
 
@@ -58,6 +68,101 @@ TEST_CASE( "Buffer" ) {
     auto result = Buffer::deserialize(tmp.data());
     REQUIRE( buffer == result );
   }
+
+  SECTION( "Large" ) {
+    string test(300 << 10, 'x');
+    auto buffer = Buffer(test);
+    AppendableMMap tmp(test.size() + MAX_VARINT_LENGTH);
+    buffer.serialize(tmp);
+    auto result = Buffer::deserialize(tmp.data());
+    REQUIRE( result.size() == test.size() );
+    REQUIRE( result.total_size() == test.size() + 3 );
+    REQUIRE( buffer == result );
+  }
+}
+
+TEST_CASE( "Coding" ) {
+  vector<uint64_t> values = {0, 1, 127, 128, 300, 16383, 16384, UINT32_MAX, UINT64_MAX};
+  char tmp[MAX_VARINT_LENGTH];
+
+  for (auto value : values) {
+    auto end = encode_varint(tmp, value);
+    REQUIRE( end - tmp == varint_length(value) );
+
+    uint64_t result;
+    REQUIRE( decode_varint(tmp, &result) - tmp == end - tmp );
+    REQUIRE( result == value );
+  }
+}
+
+TEST_CASE( "CRC32C" ) {
+  string test = "123456789";
+  REQUIRE( crc32c_software(test.data(), test.size()) == 0xE3069283 );
+  REQUIRE( crc32c(test.data(), test.size()) == 0xE3069283 );
+
+  // Incremental computation
+  auto crc = crc32c(test.data(), 4);
+  REQUIRE( crc32c(test.data() + 4, test.size() - 4, crc) == 0xE3069283 );
+
+  auto data = gen_random(false, 1000, 1000);
+  REQUIRE( crc32c(data.data(), data.size()) == crc32c_software(data.data(), data.size()) );
+}
+
+TEST_CASE( "Hash" ) {
+  string data = gen_random(false, 100, 100);
+
+  // Hashes depend on all bytes and on the seed
+  for (int len = 0; len < data.size(); len++) {
+    auto hash = Buffer(data.data(), len).hash();
+    REQUIRE( hash == hash64(data.data(), len) );
+    REQUIRE( hash != Buffer(data.data(), len).hash(1) );
+    if (len > 0) {
+      string other = data.substr(0, len);
+      other[len / 2] ^= 1;
+      REQUIRE( hash != Buffer(other).hash() );
+    }
+  }
+
+  // Zero padded numbers are spread evenly among partitions
+  vector<int> partitions(8);
+  for (int i = 0; i < 80000; i++) {
+    char key[11];
+    snprintf(key, sizeof(key), "%010d", i);
+    partitions[Buffer(key).hash() % partitions.size()]++;
+  }
+
+  for (auto count : partitions) {
+    REQUIRE( count > 9500 );
+    REQUIRE( count < 10500 );
+  }
+}
+
+TEST_CASE( "KeyPrefix" ) {
+  // Prefix order is consistent with key order
+  vector<string> keys = {"", string(1, '\0'), "a", string("a\0", 2), "ab", "abcdefgh", "abcdefghi", "abcdefgi", "b"};
+  for (int i = 1; i < keys.size(); i++) {
+    REQUIRE( key_prefix(keys[i - 1], 0) <= key_prefix(keys[i], 0) );
+  }
+  REQUIRE( key_prefix("xxabc", 2) == key_prefix("abc", 0) );
+  REQUIRE( common_prefix_length("abcd", "abxy") == 2 );
+
+  // Vectorized lower bound matches the scalar one
+  for (int size = 0; size < 100; size++) {
+    string prefixes;
+    vector<uint64_t> values;
+    for (int i = 0; i < size; i++) {
+      values.push_back((i / 3) * 10 + (i % 3 == 0 ? 0 : (1ull << 63)));
+    }
+    sort(values.begin(), values.end());
+    for (auto value : values) {
+      put_fixed64(&prefixes, value);
+    }
+
+    for (uint64_t target : vector<uint64_t>{0, 5, 10, 1ull << 63, UINT64_MAX}) {
+      auto expected = lower_bound(values.begin(), values.end(), target) - values.begin();
+      REQUIRE( prefix_lower_bound(prefixes.data(), size, target) == expected );
+    }
+  }
 }
 
 TEST_CASE( "AppendableMMap" ) {
@@ -77,6 +182,11 @@ TEST_CASE( "AppendableMMap" ) {
   }
 }
 
+// Keys of objects of tenants, "tenant:object:field"
+string object_key(int tenant, int object, int field) {
+  return "t" + to_string(tenant) + ":o" + to_string(object) + ":f" + to_string(field);
+}
+
 TEST_CASE( "Table" ) {
   auto kv = create_random_kv(100000);
   auto table = create_table(1 << 23, kv);
@@ -94,13 +204,254 @@ TEST_CASE( "Table" ) {
 
   SECTION( "Find value" ) {
     for (const auto &item : kv) {
-      auto value = table->get(get<0>(item));
-      REQUIRE (value != nullptr );
-      REQUIRE (*value == Buffer(get<1>(item)));
+      auto result = table->get(get<0>(item));
+      REQUIRE (result.is_found());
+      REQUIRE (*result.value() == Buffer(get<1>(item)));
+    }
+
+    auto result = table->get("{}");
+    REQUIRE (result.status() == LookupResult::NOT_FOUND);
+  }
+
+  SECTION( "Shared prefixes" ) {
+    // Keys share long prefixes and differ after the first 8 bytes or by trailing zeros
+    vector<tuple<string, string>> kv;
+    for (int i = 0; i < 10000; i++) {
+      char key[32];
+      snprintf(key, sizeof(key), "tenant:%012d", i);
+      kv.push_back(make_tuple(key, to_string(i)));
+      kv.push_back(make_tuple(string(key) + string(1, '\0'), to_string(i)));
+    }
+    sort(kv.begin(), kv.end());
+    auto table = create_table(1 << 23, kv);
+
+    for (const auto &item : kv) {
+      auto result = table->get(get<0>(item));
+      REQUIRE (result.is_found());
+      REQUIRE (*result.value() == Buffer(get<1>(item)));
+    }
+
+    REQUIRE (table->get("tenant:").status() == LookupResult::NOT_FOUND);
+    REQUIRE (table->get("tenant:000000000001x").status() == LookupResult::NOT_FOUND);
+    REQUIRE (table->get("tenant:1").status() == LookupResult::NOT_FOUND);
+  }
+
+  SECTION( "Checksums" ) {
+    REQUIRE(system("rm -rf /tmp/crc && mkdir /tmp/crc") == 0);
+    auto builder = TableBuilder(1 << 23, "/tmp/crc");
+    for (const auto &item : kv) {
+      REQUIRE(builder.add(get<0>(item), get<1>(item)));
+    }
+    builder.finalize();
+
+    auto path = path_append("/tmp/crc", ls("/tmp/crc")[0]);
+    Table::load_table(path, true)->verify();
+
+    // Flip a byte in the middle of the entries
+    auto file = fopen(path.c_str(), "r+");
+    fseek(file, 100000, SEEK_SET);
+    auto c = fgetc(file);
+    fseek(file, 100000, SEEK_SET);
+    fputc(c ^ 1, file);
+    fclose(file);
+
+    auto corrupted = Table::load_table(path, true);
+    REQUIRE_THROWS_AS(corrupted->verify(), const CorruptionError &);
+
+    // Reads of entries in the corrupted block fail, other blocks are unaffected
+    int failures = 0;
+    for (const auto &item : kv) {
+      try {
+        corrupted->get(get<0>(item));
+      } catch (const CorruptionError &) {
+        failures++;
+      }
+    }
+    REQUIRE(failures > 0);
+    REQUIRE(failures < kv.size());
+
+    // Tables are not verified by default
+    Table::load_table(path)->get(get<0>(kv[0]));
+    REQUIRE(system("rm -rf /tmp/crc") == 0);
+  }
+
+  SECTION( "Index types" ) {
+    // Numeric keys with gaps, random keys and keys sharing their first 8 bytes
+    vector<tuple<string, string>> numeric, shared;
+    for (int i = 0; i < 100000; i++) {
+      char key[32];
+      snprintf(key, sizeof(key), "%010d", i*i % 1000003);
+      numeric.push_back(make_tuple(key, to_string(i)));
+      snprintf(key, sizeof(key), "%d", i / 100);
+      shared.push_back(make_tuple(string(8, 'x') + key + to_string(i), to_string(i)));
+    }
+    sort(numeric.begin(), numeric.end());
+    numeric.erase(unique(numeric.begin(), numeric.end(), [](auto &x, auto &y) { return get<0>(x) == get<0>(y); }), numeric.end());
+    sort(shared.begin(), shared.end());
+
+    for (const auto &kv : {kv, numeric, shared}) {
+      auto dense = create_table(1 << 23, kv);
+      auto learned = create_table(1 << 23, kv, LEARNED_INDEX);
+      auto hashed = create_table(1 << 23, kv, HASH_INDEX);
+
+      for (const auto &table : {learned, hashed}) {
+        for (const auto &item : kv) {
+          auto result = table->get(get<0>(item));
+          REQUIRE (result.is_found());
+          REQUIRE (*result.value() == Buffer(get<1>(item)));
+
+          // Keys right before and after an entry
+          auto key = get<0>(item);
+          REQUIRE (table->get(key + string(1, '\0')).status() == dense->get(key + string(1, '\0')).status());
+          key.back()--;
+          REQUIRE (table->get(key).status() == dense->get(key).status());
+        }
+      }
+
+      // Scans start at the first key that isn't smaller
+      for (const auto &table : {dense, learned, hashed}) {
+        for (uint64_t i = 0; i < kv.size(); i += 97) {
+          auto key = get<0>(kv[i]);
+          for (const auto &start : {key, key + string(1, '\0'), key.substr(0, key.size() - 1)}) {
+            auto expected = lower_bound(kv.begin(), kv.end(), start, [](const auto &item, const string &key) {
+              return get<0>(item) < key;
+            });
+            auto it = table->lower_bound(start);
+            if (expected == kv.end()) {
+              REQUIRE (it == table->end());
+            } else {
+              REQUIRE (it->key == Buffer(get<0>(*expected)));
+            }
+          }
+        }
+      }
+
+      // Entries stay sorted
+      REQUIRE (equal(hashed->begin(), hashed->end(), dense->begin(), [](const KeyValue &x, const KeyValue &y) {
+        return x.key == y.key;
+      }));
+      REQUIRE (learned->index_size() < dense->index_size());
     }
+  }
+
+  SECTION( "I/O backends" ) {
+    REQUIRE(system("rm -rf /tmp/io && mkdir /tmp/io") == 0);
+    auto entries = kv;
+    entries.insert(entries.begin(), make_tuple(string("!large"), string(100 << 10, 'x')));
+
+    auto builder = TableBuilder(1 << 24, "/tmp/io");
+    for (const auto &item : entries) {
+      REQUIRE(builder.add(get<0>(item), get<1>(item)));
+    }
+    builder.finalize();
+    auto path = path_append("/tmp/io", ls("/tmp/io")[0]);
+
+    for (auto io : {PREAD_IO, DIRECT_IO}) {
+      for (auto blocks : {shared_ptr<BlockCache>(), make_shared<BlockCache>(1 << 20)}) {
+        for (auto verify : {false, true}) {
+          auto table = Table::load_table(path, verify);
+          table->read_with(io, blocks);
+
+          for (const auto &item : entries) {
+            auto result = table->get(get<0>(item));
+            REQUIRE (result.is_found());
+            REQUIRE (*result.value() == Buffer(get<1>(item)));
+          }
+          REQUIRE (table->get("{}").status() == LookupResult::NOT_FOUND);
+
+          int i = 0;
+          for (const auto &item : *table) {
+            REQUIRE (item.key == Buffer(get<0>(entries[i])));
+            REQUIRE (item.value == Buffer(get<1>(entries[i])));
+            i++;
+          }
+          REQUIRE (i == entries.size());
+          table->verify();
+
+          // Scans read from the start through a growing window
+          i = 50000;
+          for (auto it = table->lower_bound(get<0>(entries[i])); i < 60000; ++it, i++) {
+            REQUIRE (it->key == Buffer(get<0>(entries[i])));
+            REQUIRE (it->value == Buffer(get<1>(entries[i])));
+          }
+
+          if (blocks) {
+            REQUIRE (blocks->size() <= 1 << 20);
+          }
+        }
+      }
+    }
+
+    // Corrupted blocks are detected when they are read
+    auto file = fopen(path.c_str(), "r+");
+    fseek(file, 300000, SEEK_SET);
+    auto c = fgetc(file);
+    fseek(file, 300000, SEEK_SET);
+    fputc(c ^ 1, file);
+    fclose(file);
+
+    auto corrupted = Table::load_table(path, true);
+    corrupted->read_with(PREAD_IO, make_shared<BlockCache>(1 << 20));
+    REQUIRE_THROWS_AS(corrupted->verify(), const CorruptionError &);
+
+    int failures = 0;
+    for (const auto &item : entries) {
+      try {
+        corrupted->get(get<0>(item));
+      } catch (const CorruptionError &) {
+        failures++;
+      }
+    }
+    REQUIRE(failures > 0);
+    REQUIRE(failures < entries.size());
+    REQUIRE(system("rm -rf /tmp/io") == 0);
+  }
+
+  SECTION( "Sequential writes" ) {
+    // Keys sharing prefixes of different lengths and values larger than the write buffer
+    vector<tuple<string, string>> entries;
+    for (int i = 0; i < 20000; i++) {
+      auto key = "key:" + string(i % 13, 'k') + to_string(i);
+      entries.push_back(make_tuple(key, (i % 5000 == 0) ? string(3 << 20, 'v') : to_string(i)));
+    }
+    sort(entries.begin(), entries.end());
+
+    for (auto index_type : {DENSE_INDEX, LEARNED_INDEX, HASH_INDEX}) {
+      REQUIRE(system("rm -rf /tmp/seq && mkdir /tmp/seq") == 0);
+      auto builder = TableBuilder(1 << 26, "/tmp/seq", index_type);
+      for (const auto &item : entries) {
+        REQUIRE(builder.add(get<0>(item), get<1>(item)));
+      }
+      auto size = builder.current_size();
+      auto table = builder.finalize();
+
+      // Preallocated space is given back
+      auto path = path_append("/tmp/seq", ls("/tmp/seq")[0]);
+      REQUIRE (file_size(path) <= size);
+
+      for (const auto &current : {table, Table::load_table(path, true)}) {
+        current->verify();
+        for (const auto &item : entries) {
+          auto result = current->get(get<0>(item));
+          REQUIRE (result.is_found());
+          REQUIRE (*result.value() == Buffer(get<1>(item)));
+        }
+        REQUIRE (current->get("key:").status() == LookupResult::NOT_FOUND);
+      }
+      REQUIRE(system("rm -rf /tmp/seq") == 0);
+    }
+  }
+
+  SECTION( "Large values" ) {
+    string large(200 << 10, 'x');
+    auto builder = TableBuilder(1 << 16);
+    REQUIRE(builder.add("a", large));
+    REQUIRE(!builder.add("b", "b"));
 
-    auto value = table->get("{}");
-    REQUIRE (value == nullptr);
+    auto table = builder.finalize();
+    auto result = table->get("a");
+    REQUIRE (result.is_found());
+    REQUIRE (*result.value() == large);
   }
 
   SECTION( "Benchmark" ) {
@@ -195,6 +546,361 @@ TEST_CASE( "Table merging" ) {
   }
 }
 
+TEST_CASE( "TableCache" ) {
+  REQUIRE(system("rm -rf /tmp/tables && mkdir /tmp/tables") == 0);
+
+  vector<vector<tuple<string, string>>> kvs;
+  for (int i = 0; i < 5; i++) {
+    kvs.push_back(create_random_kv(1000));
+    auto builder = TableBuilder(1 << 20, "/tmp/tables");
+    for (const auto &item : kvs.back()) {
+      REQUIRE(builder.add(get<0>(item), get<1>(item)));
+    }
+    builder.finalize();
+  }
+
+  auto cache = make_shared<TableCache>(2, 0);
+  vector<shared_ptr<Table>> tables;
+  for (const auto &file : ls("/tmp/tables")) {
+    tables.push_back(Table::load_table(path_append("/tmp/tables", file), true, cache));
+  }
+
+  // Metadata is read without mapping tables
+  REQUIRE( cache->size() == 0 );
+  for (const auto &table : tables) {
+    auto kv = find_if(kvs.begin(), kvs.end(), [&](auto &kv) {
+      return table->min_key() == Buffer(get<0>(kv.front())) && table->max_key() == Buffer(get<0>(kv.back()));
+    });
+    REQUIRE( kv != kvs.end() );
+  }
+
+  // Values outlive the eviction of their table
+  auto value = tables[0]->get(tables[0]->min_key()).value();
+  for (int i = 0; i < 2; i++) {
+    for (const auto &table : tables) {
+      table->verify();
+      REQUIRE( table->get(table->max_key()).is_found() );
+      REQUIRE( cache->size() <= 2 );
+    }
+  }
+  REQUIRE( value->size() > 0 );
+  REQUIRE( tables[0]->get(tables[0]->min_key()).value()->compare(*value) == 0 );
+
+  // Iteration keeps the table mapped
+  uint64_t count = 0;
+  for (const auto &item : *tables[1]) {
+    tables[(count++ % 4) + 1]->get(item.key);
+  }
+  REQUIRE( count == tables[1]->size() );
+
+  tables.clear();
+  REQUIRE( cache->size() == 0 );
+  REQUIRE(system("rm -rf /tmp/tables") == 0);
+}
+
+TEST_CASE( "RateLimiter" ) {
+  SECTION( "Rate" ) {
+    RateLimiter limiter(10 << 20);
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < 5; i++) {
+      limiter.request(1 << 20, COMPACTION_PRIORITY);
+    }
+
+    // The first request is paid from the burst, the others wait for the bucket to refill
+    REQUIRE (chrono::duration<double>(chrono::steady_clock::now() - start).count() > 0.3);
+    REQUIRE (limiter.bytes(COMPACTION_PRIORITY) == 5 << 20);
+    REQUIRE (limiter.bytes(FLUSH_PRIORITY) == 0);
+
+    // Requests would never be granted
+    REQUIRE_THROWS_AS(RateLimiter(0, 1 << 20), const invalid_argument &);
+  }
+
+  SECTION( "Priorities" ) {
+    RateLimiter limiter(1 << 20);
+    limiter.request(1 << 20, COMPACTION_PRIORITY);
+
+    // Both wait for the bucket to refill, the flush goes first although it came last
+    vector<IOPriority> order;
+    mutex order_mutex;
+    auto request = [&](IOPriority priority) {
+      limiter.request(1, priority);
+      lock_guard<mutex> lock(order_mutex);
+      order.push_back(priority);
+    };
+
+    thread compaction(request, COMPACTION_PRIORITY);
+    this_thread::sleep_for(chrono::milliseconds(100));
+    thread flush(request, FLUSH_PRIORITY);
+    compaction.join();
+    flush.join();
+
+    REQUIRE (order.size() == 2);
+    REQUIRE (order[0] == FLUSH_PRIORITY);
+  }
+
+  SECTION( "Auto tuning" ) {
+    RateLimiter limiter(1 << 20, 4 << 20);
+    limiter.add_debt(10 << 20);
+    REQUIRE (limiter.rate() == 2 << 20);
+    limiter.add_debt(100 << 20);
+    REQUIRE (limiter.rate() == 4 << 20);
+    limiter.add_debt(-(110 << 20));
+    REQUIRE (limiter.rate() == 1 << 20);
+  }
+}
+
+TEST_CASE( "FenceIndex" ) {
+  // Tables [key:00000, key:00099], [key:00100, key:00199], ... with gaps between them
+  vector<shared_ptr<Table>> tables;
+  for (int i = 0; i < 100; i++) {
+    vector<tuple<string, string>> kv;
+    for (int j = 0; j < 100; j += 3) {
+      char key[32];
+      snprintf(key, sizeof(key), "key:%05d", i*100 + j);
+      kv.push_back(make_tuple(key, "x"));
+    }
+    tables.push_back(create_table(1 << 12, kv));
+  }
+
+  FenceIndex fences(tables);
+  REQUIRE( fences.size() == tables.size() );
+
+  for (int i = 0; i < 100*100; i++) {
+    char key[32];
+    snprintf(key, sizeof(key), "key:%05d", i);
+    auto table = fences.find(key);
+
+    if (i % 100 <= 99 - 99 % 3) {
+      REQUIRE( table == i / 100 );
+    } else {
+      REQUIRE( table == -1 );
+    }
+  }
+
+  REQUIRE( fences.find("a") == -1 );
+  REQUIRE( fences.find("key:") == -1 );
+  REQUIRE( fences.find("key:000000") == 0 );
+  REQUIRE( fences.find("z") == -1 );
+  REQUIRE( FenceIndex().find("a") == -1 );
+}
+
+TEST_CASE( "CuckooIndex" ) {
+  CuckooIndex index;
+  mt19937_64 rng(42);
+  vector<uint64_t> hashes;
+
+  // Grows past its initial capacity
+  for (int i = 0; i < 100000; i++) {
+    hashes.push_back(rng());
+    index.insert(hashes.back(), i / 1000, i);
+  }
+  REQUIRE( index.size() == hashes.size() );
+
+  for (int i = 0; i < hashes.size(); i++) {
+    auto location = index.find(hashes[i]);
+    REQUIRE( location != nullptr );
+    REQUIRE( location->table == i / 1000 );
+    REQUIRE( location->entry == i );
+  }
+  REQUIRE( index.find(rng()) == nullptr );
+
+  index.insert(hashes[0], 1000, 0);
+  REQUIRE( index.find(hashes[0])->table == 1000 );
+  REQUIRE( index.size() == hashes.size() );
+
+  index.erase_before(99);
+  REQUIRE( index.size() == 1000 + 1 );
+  REQUIRE( index.find(hashes[0])->table == 1000 );
+  REQUIRE( index.find(hashes[1]) == nullptr );
+  REQUIRE( index.find(hashes.back())->entry == hashes.size() - 1 );
+}
+
+TEST_CASE( "BloomFilter" ) {
+  mt19937_64 rng(42);
+  vector<uint64_t> hashes;
+  for (int i = 0; i < 10000; i++) {
+    hashes.push_back(rng());
+  }
+
+  string filter;
+  BloomFilter::put(&filter, hashes, 10);
+  REQUIRE( filter.size() == BloomFilter::size(hashes.size(), 10) );
+  for (auto hash : hashes) {
+    REQUIRE( BloomFilter::may_contain(filter, hash) );
+  }
+
+  int false_positives = 0;
+  for (int i = 0; i < 100000; i++) {
+    false_positives += BloomFilter::may_contain(filter, rng());
+  }
+  auto expected = BloomFilter::false_positive_rate(filter);
+  REQUIRE( expected > 0.005 );
+  REQUIRE( expected < 0.015 );
+  REQUIRE( false_positives / 100000.0 < 2*expected );
+  REQUIRE( BloomFilter::may_contain("", rng()) );
+
+  // Smaller levels get more bits per key, all levels together about the budget
+  vector<uint64_t> entries = {1000, 10000, 100000, 1000000};
+  auto bits = BloomFilter::allocate(entries, 5*1111000);
+  double total = 0;
+  for (int i = 0; i < entries.size(); i++) {
+    total += bits[i]*entries[i];
+    if (i > 0) {
+      REQUIRE( bits[i] < bits[i - 1] );
+    }
+  }
+  REQUIRE( abs(total - 5*1111000) < 1000 );
+  REQUIRE( BloomFilter::allocate(entries, 1e12)[3] == BloomFilter::MAX_BITS_PER_KEY );
+
+  SECTION( "Levels" ) {
+    REQUIRE(system("rm -rf /tmp/db") == 0);
+    LevelConfig config("/tmp", "db", 0, 1 << 20, 1);
+    config.filter_bits = 10;
+    auto level0 = make_shared<Level0>(config);
+    for (int i = 0; i < 4; i++) {
+      level0->dump_memtable(create_random_kv(1000, false, 8));
+    }
+
+    // Missing keys within the key range of the tables are mostly filtered out
+    for (int i = 0; i < 10000; i++) {
+      level0->get("m:" + to_string(i));
+    }
+    REQUIRE( level0->expected_false_positive_rate() < 0.015 );
+    REQUIRE( level0->observed_false_positive_rate() < 0.03 );
+    level0->destroy();
+  }
+
+  SECTION( "Prefixes" ) {
+    auto tenant = PrefixExtractor::delimited(':');
+    Buffer prefix;
+    REQUIRE( tenant.extract("t1:o2:f3", &prefix) );
+    REQUIRE( prefix == "t1:" );
+    REQUIRE( PrefixExtractor::delimited(':', 2).extract("t1:o2:f3", &prefix) );
+    REQUIRE( prefix == "t1:o2:" );
+    REQUIRE( !tenant.extract("t1", &prefix) );
+    REQUIRE( PrefixExtractor::fixed(2).extract("t1:o2:f3", &prefix) );
+    REQUIRE( prefix == "t1" );
+    REQUIRE( tenant.id() != PrefixExtractor::delimited(':', 2).id() );
+    REQUIRE( PrefixExtractor().id() == 0 );
+
+    REQUIRE(system("rm -rf /tmp/db") == 0);
+    LevelConfig config("/tmp", "db", 0, 1 << 20, 1);
+    config.filter_bits = 10;
+    config.prefix_extractor = tenant;
+    auto level0 = make_shared<Level0>(config);
+
+    // Tables of overlapping key ranges, each with the objects of every other tenant
+    for (int i = 0; i < 4; i++) {
+      MemTable memtable;
+      for (int tenant = i % 2; tenant < 100; tenant += 2) {
+        for (int object = 0; object < 10; object++) {
+          memtable.add(object_key(tenant, object, i), "x");
+        }
+      }
+      level0->dump_memtable(memtable);
+    }
+
+    vector<shared_ptr<Table>> tables;
+    level0->scan_tables(ScanRange::prefix("t42:", tenant), &tables);
+    REQUIRE( tables.size() == 2 );
+    REQUIRE( level0->skipped() == 2 );
+
+    // Prefixes of other extractors can't be ruled out
+    tables.clear();
+    level0->scan_tables(ScanRange::prefix("t42:o1:", PrefixExtractor::delimited(':', 2)), &tables);
+    REQUIRE( tables.size() == 4 );
+    level0->destroy();
+  }
+}
+
+TEST_CASE( "RangeFilter" ) {
+  mt19937_64 rng(42);
+  set<string> keys = {"a", "ab", "abc", "b"};
+  while (keys.size() < 10000) {
+    keys.insert(object_key(rng() % 1000, rng() % 1000, rng() % 10));
+  }
+
+  for (uint32_t suffix_bits : {0, 8, 13}) {
+    RangeFilterBuilder builder(true, suffix_bits);
+    for (const auto &key : keys) {
+      builder.add(key);
+    }
+    auto size = builder.size();
+    string filter;
+    builder.put(&filter);
+    REQUIRE( filter.size() == size );
+
+    // Ranges holding a key are never ruled out, a prefix of a key may be a key too
+    for (const auto &key : keys) {
+      REQUIRE( RangeFilter::may_contain(filter, key, key + '\0') );
+      REQUIRE( RangeFilter::may_contain(filter, key.substr(0, key.size() - 1), "") );
+    }
+    REQUIRE( RangeFilter::may_contain(filter, "ab", "ab\x01") );
+    REQUIRE( !RangeFilter::may_contain(filter, "abd", "ac") );
+    REQUIRE( !RangeFilter::may_contain(filter, "u", "") );
+
+    // Empty short ranges are mostly ruled out, more so with suffixes
+    int empty = 0, false_positives = 0;
+    for (int i = 0; i < 10000; i++) {
+      auto start = object_key(rng() % 1000, rng() % 1000, rng() % 10) + "x";
+      auto end = start.substr(0, start.size() - 2) + to_string(rng() % 10);
+      if (end <= start || keys.lower_bound(start) != keys.lower_bound(end)) {
+        continue;
+      }
+      empty++;
+      false_positives += RangeFilter::may_contain(filter, start, end);
+    }
+    REQUIRE( empty > 1000 );
+    REQUIRE( false_positives < empty*(suffix_bits == 0 ? 0.5 : 0.05) );
+  }
+  REQUIRE( RangeFilter::may_contain("", "a", "b") );
+
+  SECTION( "Levels" ) {
+    REQUIRE(system("rm -rf /tmp/db") == 0);
+    LevelConfig config("/tmp", "db", 0, 1 << 20, 1);
+    config.range_filter = true;
+    config.range_filter_suffix_bits = 8;
+    auto level0 = make_shared<Level0>(config);
+
+    // Tables of overlapping key ranges, each with every fourth object
+    for (int i = 0; i < 4; i++) {
+      MemTable memtable;
+      for (int tenant = 0; tenant < 10; tenant++) {
+        for (int object = i; object < 100; object += 4) {
+          memtable.add(object_key(tenant, object, 0), "x");
+        }
+      }
+      level0->dump_memtable(memtable);
+    }
+
+    vector<shared_ptr<Table>> tables;
+    level0->scan_tables(ScanRange(object_key(4, 21, 0), object_key(4, 21, 9)), &tables);
+    REQUIRE( tables.size() == 1 );
+    REQUIRE( level0->skipped() == 3 );
+
+    // Objects without keys are ruled out
+    for (int object = 100; object < 200; object++) {
+      level0->scan_tables(ScanRange(object_key(4, object, 0), object_key(4, object, 9)), &tables);
+    }
+    REQUIRE( tables.size() == 1 );
+
+    // Filters are kept when tables are loaded again, with or without their metadata
+    tables.clear();
+    level0->scan_tables(ScanRange("", ""), &tables);
+    REQUIRE( tables.size() == 4 );
+    auto cache = make_shared<TableCache>(2, 0);
+    for (const auto &table : tables) {
+      auto loaded = Table::load_table(table->path(), false, cache);
+      auto reopened = make_shared<Table>(table->path(), loaded->metadata(), cache);
+      for (const auto &current : {loaded, reopened}) {
+        REQUIRE( current->may_contain_range(current->min_key(), "") );
+        REQUIRE( !current->may_contain_range(object_key(4, 150, 0), object_key(4, 150, 9)) );
+      }
+    }
+    level0->destroy();
+  }
+}
+
 TEST_CASE( "Level" ) {
   auto t = system("rm -rf /tmp/db");
 
@@ -214,7 +920,7 @@ TEST_CASE( "Level" ) {
   REQUIRE(level0->size() == 4);
 
   // Verify that values with the same key are shadowed correctly
-  auto value = level0->get("a");
+  auto value = level0->get("a").value();
   REQUIRE(value != nullptr);
   REQUIRE(*value == "y");
 
@@ -226,7 +932,7 @@ TEST_CASE( "Level" ) {
   REQUIRE(level1->size() == 3);
 
   // Verify that values with the same key are overwritten correctly
-  value = level1->get("a");
+  value = level1->get("a").value();
   REQUIRE(value != nullptr);
   REQUIRE(*value == "y");
 
@@ -235,9 +941,216 @@ TEST_CASE( "Level" ) {
   table5.add("b", "z");
   level0->dump_memtable(table5);
   level1->merge_with(level0);
-  REQUIRE(*(level1->get("b")) == "z");
+  REQUIRE(*(level1->get("b").value()) == "z");
   REQUIRE(level0->size() == 0);
   REQUIRE(level1->size() == 3);
+
+  // Tombstones in level 0 shadow values in level 1
+  MemTable table6;
+  table6.add("c", "");
+  level0->dump_memtable(table6);
+  REQUIRE(level0->get("c").is_deleted());
+  REQUIRE(level0->get("d").status() == LookupResult::NOT_FOUND);
+  REQUIRE(level0->lookups() == 3);
+  REQUIRE(level0->hits() == 2);
+
+  // A compaction that runs into a corrupted table leaves both levels as they are
+  for (const auto &name : ls(config1.path_level)) {
+    auto file = fopen(path_append(config1.path_level, name).c_str(), "r+");
+    auto c = fgetc(file);
+    fseek(file, 0, SEEK_SET);
+    fputc(c ^ 1, file);
+    fclose(file);
+  }
+  REQUIRE_THROWS_AS(level1->merge_with(level0), const CorruptionError &);
+  REQUIRE(level0->size() == 1);
+  REQUIRE(level1->size() == 3);
+  REQUIRE(ls(config0.path_level).size() == 1);
+  REQUIRE(ls(config1.path_level).size() == 3);
+  level0 = nullptr;
+  level1 = nullptr;
+  REQUIRE(ls(config0.path_level).size() == 1);
+  REQUIRE(ls(config1.path_level).size() == 3);
+
+  // A level fails to open only once none of its tables is being loaded anymore
+  write_file(path_append(config1.path_level, "truncated"), "x");
+  ThreadPool pool(4);
+  REQUIRE_THROWS_AS(make_shared<LevelN>(config1, nullptr, nullptr, nullptr, &pool), const CorruptionError &);
+}
+
+TEST_CASE( "Trivial move" ) {
+  REQUIRE(system("rm -rf /tmp/db") == 0);
+  LevelConfig config0("/tmp", "db", 0, 1 << 10, 1);
+  LevelConfig config1("/tmp", "db", 1, 1 << 10, 1);
+  LevelConfig config2("/tmp", "db", 2, 1 << 10, 1);
+  auto level0 = make_shared<Level0>(config0);
+  auto level1 = make_shared<LevelN>(config1);
+  auto level2 = make_shared<LevelN>(config2);
+
+  // Sequential ingest, tables of level 0 don't overlap
+  auto fill = [&](int begin, int end, const string &value) {
+    MemTable memtable;
+    for (int i = begin; i < end; i++) {
+      char key[16];
+      snprintf(key, sizeof(key), "%08d", i);
+      memtable.add(key, value);
+    }
+    level0->dump_memtable(memtable);
+  };
+
+  auto check = [](shared_ptr<LevelN> level, int begin, int end, const string &value) {
+    for (int i = begin; i < end; i++) {
+      char key[16];
+      snprintf(key, sizeof(key), "%08d", i);
+      auto result = level->get(key);
+      REQUIRE (result.is_found());
+      REQUIRE (*result.value() == value);
+    }
+  };
+
+  fill(0, 100, "a");
+  fill(100, 200, "a");
+  level1->merge_with(level0);
+  REQUIRE (level1->moved() == level1->size());
+  REQUIRE (ls(config0.path_level).empty());
+  check(level1, 0, 200, "a");
+
+  // Only the tables overlapping level 1 are merged
+  fill(300, 400, "b");
+  fill(150, 160, "b");
+  auto moved = level1->moved();
+  level1->merge_with(level0);
+  REQUIRE (level1->moved() > moved);
+  check(level1, 0, 150, "a");
+  check(level1, 150, 160, "b");
+  check(level1, 160, 200, "a");
+  check(level1, 300, 400, "b");
+
+  level2->merge_with(level1);
+  REQUIRE (level2->moved() == level2->size());
+  REQUIRE (level1->size() == 0);
+
+  // Moved tables are found in their new directory
+  level2 = make_shared<LevelN>(config2);
+  check(level2, 0, 150, "a");
+  check(level2, 300, 400, "b");
+  REQUIRE(system("rm -rf /tmp/db") == 0);
+}
+
+TEST_CASE( "Tiered compaction" ) {
+  REQUIRE(system("rm -rf /tmp/db") == 0);
+  LevelConfig config0("/tmp", "db", 0, 1 << 10, 1);
+  LevelConfig config1("/tmp", "db", 1, 1 << 10, 1);
+  config1.compaction_style = TIERED_COMPACTION;
+  config1.max_runs = 2;
+  auto level0 = make_shared<Level0>(config0);
+  auto level1 = make_shared<LevelN>(config1);
+
+  auto key = [](int i) {
+    char key[16];
+    snprintf(key, sizeof(key), "%08d", i);
+    return string(key);
+  };
+
+  auto fill = [&](int begin, int end, const string &value) {
+    MemTable memtable;
+    for (int i = begin; i < end; i++) {
+      memtable.add(key(i), value);
+    }
+    level0->dump_memtable(memtable);
+    level1->merge_with(level0);
+  };
+
+  auto check = [&](int begin, int end, const string &value, shared_ptr<LevelN> level = nullptr) {
+    for (int i = begin; i < end; i++) {
+      auto result = (level ? level : level1)->get(key(i));
+      REQUIRE (result.is_found());
+      REQUIRE (*result.value() == value);
+    }
+  };
+
+  // Every merge stacks a new run on top of the existing ones
+  fill(0, 200, "a");
+  fill(100, 300, "b");
+  REQUIRE (level1->runs() == 2);
+  REQUIRE (!level1->needs_merging());
+  fill(150, 160, "c");
+  REQUIRE (level1->runs() == 3);
+  REQUIRE (level1->needs_merging());
+
+  // Runs survive a restart
+  level1 = nullptr;
+  level1 = make_shared<LevelN>(config1);
+  REQUIRE (level1->runs() == 3);
+  check(0, 100, "a");
+  check(100, 150, "b");
+  check(150, 160, "c");
+  check(160, 300, "b");
+
+  // Merging the runs keeps the newest values
+  level1->merge_runs();
+  REQUIRE (level1->runs() == 1);
+  REQUIRE (ls(config1.path_level).size() == level1->size());
+  check(0, 100, "a");
+  check(100, 150, "b");
+  check(150, 160, "c");
+  check(160, 300, "b");
+
+  // A leveled level below takes all runs as a single one, even the moved tables
+  LevelConfig config2("/tmp", "db", 2, 1 << 10, 1);
+  auto level2 = make_shared<LevelN>(config2);
+  fill(1000, 1100, "d");
+  level2->merge_with(level1);
+  REQUIRE (level1->size() == 0);
+  REQUIRE (level2->moved() == level2->size());
+  level2 = nullptr;
+  level2 = make_shared<LevelN>(config2);
+  REQUIRE (level2->runs() == 1);
+  check(0, 100, "a", level2);
+  check(100, 150, "b", level2);
+  check(1000, 1100, "d", level2);
+}
+
+TEST_CASE( "Level0 hash index" ) {
+  REQUIRE(system("rm -rf /tmp/db") == 0);
+
+  LevelConfig config0("/tmp", "db", 0, 1 << 10, 1);
+  config0.hash_index = true;
+  auto level0 = make_shared<Level0>(config0);
+
+  // Every memtable spans multiple tables
+  for (int i = 0; i < 4; i++) {
+    MemTable table;
+    for (int j = i*50; j < 300; j++) {
+      table.add(to_string(j), (j % 7 == 0) ? "" : to_string(i));
+    }
+    level0->dump_memtable(table);
+  }
+  REQUIRE( level0->size() > 4 );
+  REQUIRE( level0->index_size().first == 300 );
+
+  for (int j = 0; j < 300; j++) {
+    auto result = level0->get(to_string(j));
+    if (j % 7 == 0) {
+      REQUIRE( result.is_deleted() );
+    } else {
+      REQUIRE( *result.value() == to_string(min(j / 50, 3)) );
+    }
+  }
+  REQUIRE( level0->get("a").status() == LookupResult::NOT_FOUND );
+
+  // Merged tables are removed from the index
+  LevelConfig config1("/tmp", "db", 1, 1 << 10, 1);
+  auto level1 = make_shared<LevelN>(config1);
+  level1->merge_with(level0);
+  REQUIRE( level0->index_size().first == 0 );
+  REQUIRE( level0->get("1").status() == LookupResult::NOT_FOUND );
+
+  MemTable table;
+  table.add("1", "x");
+  level0->dump_memtable(table);
+  REQUIRE( *level0->get("1").value() == "x" );
+  REQUIRE( level0->index_size().first == 1 );
 }
 
 TEST_CASE( "LSMTree" ) {
@@ -250,9 +1163,9 @@ TEST_CASE( "LSMTree" ) {
       auto kv = create_random_kv(1000, false, 5);
       tree.dump_memtable(kv);
       for (const auto &item : kv) {
-        auto value = tree.get(get<0>(item));
-        REQUIRE (value != nullptr );
-        REQUIRE (*value == Buffer(get<1>(item)));
+        auto result = tree.get(get<0>(item));
+        REQUIRE (result.is_found());
+        REQUIRE (*result.value() == Buffer(get<1>(item)));
       }
     }
 
@@ -272,13 +1185,393 @@ TEST_CASE( "LSMTree" ) {
 
     LSMTree other(config);
     for (const auto &item : kv2) {
-      auto value = other.get(get<0>(item));
-      REQUIRE (value != nullptr );
-      REQUIRE (*value == Buffer(get<1>(item)));
+      auto result = other.get(get<0>(item));
+      REQUIRE (result.is_found());
+      REQUIRE (*result.value() == Buffer(get<1>(item)));
+    }
+
+    other.destroy();
+  }
+
+  SECTION( "Table cache" ) {
+    config.max_open_tables = 3;
+    auto kv = create_random_kv(5000, false, 8);
+
+    {
+      LSMTree tree(config);
+      tree.dump_memtable(kv);
+    }
+
+    // Tables are reopened after eviction
+    LSMTree other(config);
+    for (int i = 0; i < 2; i++) {
+      for (const auto &item : kv) {
+        auto result = other.get(get<0>(item));
+        REQUIRE (result.is_found());
+        REQUIRE (*result.value() == Buffer(get<1>(item)));
+      }
     }
 
     other.destroy();
   }
+
+  SECTION( "Access hints" ) {
+    config.access_hints = true;
+    config.max_open_tables = 2;
+    auto kv = create_random_kv(5000, false, 8);
+
+    LSMTree tree(config);
+    tree.dump_memtable(kv);
+    tree.dump_memtable(create_random_kv(5000, false, 8));
+    for (const auto &item : kv) {
+      REQUIRE (tree.get(get<0>(item)).is_found());
+    }
+    tree.destroy();
+
+    // Tables keep the advice for lookups once compactions read them
+    auto level0 = make_shared<Level0>(config.level(0));
+    auto level1 = make_shared<LevelN>(config.level(1));
+    level0->dump_memtable(kv);
+    level1->merge_with(level0);
+    level0->dump_memtable(create_random_kv(5000, false, 8));
+    level1->merge_with(level0);
+
+    vector<shared_ptr<Table>> tables;
+    level1->scan_tables(ScanRange("", ""), &tables);
+    REQUIRE (!tables.empty());
+    for (const auto &table : tables) {
+      REQUIRE (table->advice() == MADV_RANDOM);
+    }
+    level1->destroy();
+  }
+
+  SECTION( "Rate limiter" ) {
+    config.rate_limiter = make_shared<RateLimiter>(64 << 20, 256 << 20);
+    config.rate_limit_reads = true;
+    vector<tuple<string, string>> kv;
+
+    {
+      LSMTree tree(config);
+      for (int i = 0; i < 5; i++) {
+        auto batch = create_random_kv(2000, false, 8);
+        kv.insert(kv.end(), batch.begin(), batch.end());
+        tree.dump_memtable(batch);
+      }
+    }
+
+    // Trees hand their debt back when closed
+    REQUIRE (config.rate_limiter->bytes(FLUSH_PRIORITY) > 0);
+    REQUIRE (config.rate_limiter->bytes(COMPACTION_PRIORITY) > 0);
+    REQUIRE (config.rate_limiter->rate() == 64 << 20);
+
+    LSMTree tree(config);
+    for (const auto &item : kv) {
+      REQUIRE (tree.get(get<0>(item)).is_found());
+    }
+    tree.destroy();
+  }
+
+  SECTION( "Tiered compaction" ) {
+    for (auto style : {TIERED_COMPACTION, LAZY_LEVELING_COMPACTION}) {
+      config.compaction_style = style;
+      map<string, string> truth;
+
+      {
+        LSMTree tree(config);
+        for (int i = 0; i < 20; i++) {
+          auto kv = create_random_kv(500, true, 5);
+          tree.dump_memtable(kv);
+          for (const auto &item : kv) {
+            truth[get<0>(item)] = get<1>(item);
+          }
+        }
+      }
+
+      // The runs of tiered levels would overlap in leveled ones
+      auto leveled = config;
+      leveled.compaction_style = LEVELED_COMPACTION;
+      REQUIRE_THROWS_AS(make_shared<LSMTree>(leveled), const invalid_argument &);
+
+      LSMTree tree(config);
+      for (const auto &item : truth) {
+        auto result = tree.get(item.first);
+        REQUIRE (result.is_found());
+        REQUIRE (*result.value() == Buffer(item.second));
+      }
+      tree.verify();
+      tree.destroy();
+    }
+  }
+
+  SECTION( "Bloom filters" ) {
+    config.filter_memory = 16 << 10;
+    vector<tuple<string, string>> kv;
+
+    {
+      LSMTree tree(config);
+      for (int i = 0; i < 5; i++) {
+        auto batch = create_random_kv(2000, false, 8);
+        kv.insert(kv.end(), batch.begin(), batch.end());
+        tree.dump_memtable(batch);
+      }
+    }
+
+    // Filters are restored along with the tables
+    config.io_backend = PREAD_IO;
+    LSMTree tree(config);
+    for (const auto &item : kv) {
+      REQUIRE (tree.get(get<0>(item)).is_found());
+    }
+    for (uint32_t i = 0; i < config.levels.size(); i++) {
+      if (tree.level(i)->entries() > 0) {
+        REQUIRE (tree.level(i)->expected_false_positive_rate() > 0);
+        REQUIRE (tree.level(i)->expected_false_positive_rate() < 0.1);
+      }
+    }
+    for (int i = 0; i < 1000; i++) {
+      REQUIRE (!tree.get("m:" + to_string(i)).is_found());
+    }
+    for (uint32_t i = 0; i < config.levels.size(); i++) {
+      auto level = tree.level(i);
+      REQUIRE (level->observed_false_positive_rate() <= 2*level->expected_false_positive_rate() + 0.01);
+    }
+    tree.destroy();
+  }
+
+  SECTION( "Pread" ) {
+    config.io_backend = PREAD_IO;
+    config.block_cache_size = 1 << 16;
+    config.max_open_tables = 4;
+    vector<tuple<string, string>> kv;
+
+    LSMTree tree(config);
+    for (int i = 0; i < 5; i++) {
+      auto batch = create_random_kv(2000, false, 8);
+      kv.insert(kv.end(), batch.begin(), batch.end());
+      tree.dump_memtable(batch);
+    }
+
+    for (const auto &item : kv) {
+      auto result = tree.get(get<0>(item));
+      REQUIRE (result.is_found());
+    }
+    tree.verify();
+    tree.destroy();
+  }
+
+  SECTION( "Pending reads" ) {
+    config.io_backend = PREAD_IO;
+    config.block_cache_size = 1 << 20;
+    auto kv = create_random_kv(1000, false, 8);
+
+    LSMTree tree(config);
+    tree.dump_memtable(kv);
+
+    // The lookup leaves the read of the block to the caller and succeeds once it's done
+    auto key = get<0>(kv[500]);
+    auto result = tree.get(key, NONBLOCKING_READ);
+    REQUIRE (result.is_pending());
+    auto read = result.pending_read();
+    read->complete(read->file->read(read->offset, read->size));
+
+    result = tree.get(key, NONBLOCKING_READ);
+    REQUIRE (result.is_found());
+    REQUIRE (*result.value() == Buffer(get<1>(kv[500])));
+    REQUIRE (tree.misses() == 0);
+
+    tree.destroy();
+  }
+
+  SECTION( "Summary" ) {
+    config.open_threads = 4;
+    auto kv = create_random_kv(5000, false, 8);
+
+    {
+      LSMTree tree(config);
+      tree.dump_memtable(kv);
+    }
+
+    {
+      LSMTree other(config);
+      REQUIRE (other.restored() > 0);
+      for (const auto &item : kv) {
+        auto result = other.get(get<0>(item));
+        REQUIRE (result.is_found());
+        REQUIRE (*result.value() == Buffer(get<1>(item)));
+      }
+    }
+
+    // Corrupted summaries are ignored and the tables are read instead
+    REQUIRE(system("for f in /tmp/db/*.summary; do echo garbage > $f; done") == 0);
+    LSMTree other(config);
+    REQUIRE (other.restored() == 0);
+    for (const auto &item : kv) {
+      REQUIRE (other.get(get<0>(item)).is_found());
+    }
+
+    other.destroy();
+  }
+
+  SECTION( "Tombstone" ) {
+    LSMTree tree(config);
+    tree.dump_memtable(vector<tuple<string, string>>{make_tuple("foo", "bar")});
+    tree.dump_memtable(vector<tuple<string, string>>{make_tuple("foo", "")});
+
+    // A tombstone in an upper level terminates the search
+    auto result = tree.get("foo");
+    REQUIRE(result.is_deleted());
+    REQUIRE(result.value() == nullptr);
+
+    result = tree.get("bar");
+    REQUIRE(result.status() == LookupResult::NOT_FOUND);
+    REQUIRE(tree.misses() == 1);
+
+    tree.destroy();
+  }
+}
+
+TEST_CASE( "ValueLog" ) {
+  REQUIRE(system("rm -rf /tmp/db") == 0);
+
+  Config config("db", "/tmp/", 4, 1 << 10, 2, 1024);
+  config.value_threshold = 64;
+  config.vlog_file_size = 4 << 10;
+
+  auto kv1 = create_random_kv(100, false, 8);
+  auto kv2 = kv1;
+  for (auto &item : kv1) {
+    get<1>(item) = string(100, 'a');
+  }
+  for (auto &item : kv2) {
+    get<1>(item) = string(100, 'b');
+  }
+
+  SECTION( "Read and write" ) {
+    {
+      LSMTree tree(config);
+      tree.dump_memtable(kv1);
+      tree.dump_memtable(vector<tuple<string, string>>{make_tuple("small", "value")});
+    }
+
+    // Only large values are moved to the value log
+    REQUIRE(ls("/tmp/db/vlog").size() > 1);
+
+    // Values remain readable once large values aren't separated anymore
+    {
+      auto inline_config = config;
+      inline_config.value_threshold = 0;
+      LSMTree tree(inline_config);
+      for (const auto &item : kv1) {
+        REQUIRE(*tree.get(get<0>(item)).value() == Buffer(get<1>(item)));
+      }
+    }
+
+    LSMTree tree(config);
+    REQUIRE(*tree.get("small").value() == "value");
+    for (const auto &item : kv1) {
+      auto result = tree.get(get<0>(item));
+      REQUIRE(result.is_found());
+      REQUIRE(!result.is_indirect());
+      REQUIRE(*result.value() == Buffer(get<1>(item)));
+    }
+
+    // Scans resolve values in the value log too
+    map<string, string> truth = {{"small", "value"}};
+    for (const auto &item : kv1) {
+      truth[get<0>(item)] = get<1>(item);
+    }
+    auto expected = truth.begin();
+    tree.scan(ScanRange("", ""), [&](const Buffer &key, const Buffer &value) {
+      REQUIRE(key == Buffer(expected->first));
+      REQUIRE(value == Buffer(expected->second));
+      expected++;
+      return true;
+    });
+    REQUIRE(expected == truth.end());
+
+    tree.destroy();
+  }
+
+  SECTION( "Garbage collection" ) {
+    // Level 0 is merged as soon as it holds more than one table
+    Config config("db", "/tmp/", 4, 1 << 10, 1, 1024);
+    config.value_threshold = 64;
+    config.vlog_file_size = 4 << 10;
+
+    LSMTree tree(config);
+    tree.dump_memtable(kv1);
+    tree.dump_memtable(kv2);
+
+    // Overwritten values are discarded by the background merges, which then collect
+    // the first file as it contains only values of kv1.
+    for (int i = 0; i < 1000 && access("/tmp/db/vlog/0", F_OK) == 0; i++) {
+      this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    REQUIRE(access("/tmp/db/vlog/0", F_OK) != 0);
+
+    for (const auto &item : kv2) {
+      auto result = tree.get(get<0>(item));
+      REQUIRE(result.is_found());
+      REQUIRE(*result.value() == Buffer(get<1>(item)));
+    }
+
+    tree.destroy();
+  }
+
+  SECTION( "Garbage collection without compactions" ) {
+    Config config("db", "/tmp/", 4, 1 << 10, 100, 1024);
+    config.value_threshold = 64;
+    config.vlog_file_size = 4 << 10;
+    {
+      LSMTree tree(config);
+      tree.dump_memtable(kv1);
+    }
+
+    // The values of the first file are reported as garbage although they are still live
+    {
+      ValueLog vlog(config);
+      vlog.scan(0, [&vlog](const Buffer &, const Buffer &, const string &pointer) {
+        vlog.discard(pointer);
+      });
+      vlog.save_summary();
+    }
+
+    // No level needs merging, the merger collects the file right away and relocates its values
+    LSMTree tree(config);
+    for (int i = 0; i < 1000 && access("/tmp/db/vlog/0", F_OK) == 0; i++) {
+      this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    REQUIRE(access("/tmp/db/vlog/0", F_OK) != 0);
+
+    for (const auto &item : kv1) {
+      auto result = tree.get(get<0>(item));
+      REQUIRE(result.is_found());
+      REQUIRE(*result.value() == Buffer(get<1>(item)));
+    }
+
+    tree.destroy();
+  }
+
+  SECTION( "Garbage summary" ) {
+    uint64_t garbage = 0;
+    {
+      ValueLog vlog(config);
+      for (const auto &item : kv1) {
+        auto pointer = vlog.append(get<0>(item), get<1>(item));
+        vlog.discard(pointer);
+        garbage += get<1>(item).size();
+      }
+      REQUIRE(vlog.garbage() == garbage);
+      vlog.save_summary();
+    }
+
+    // The garbage of files written before the restart is still known
+    ValueLog vlog(config);
+    REQUIRE(vlog.garbage() == garbage);
+    uint64_t file;
+    REQUIRE(vlog.gc_candidate(&file));
+    vlog.destroy();
+  }
 }
 
 TEST_CASE( "KVStore" ) {
@@ -306,6 +1599,17 @@ TEST_CASE( "KVStore" ) {
   REQUIRE(res != nullptr);
   REQUIRE(*res == "bar");
 
+  // Values larger than the table size
+  string large(300 << 10, 'x');
+  store->add("large", large);
+  delete store;
+  store = new KVStore(config);
+  res = store->get("large");
+  REQUIRE(res != nullptr);
+  REQUIRE(*res == large);
+
+  REQUIRE(store->verify());
+
   // Deletion
   store->destroy();
   delete store;
@@ -367,6 +1671,243 @@ TEST_CASE( "ParallelKVStore" ) {
     delete store;
   }
 
+  SECTION( "Ingestion" ) {
+    Config config("db", "/tmp/", 4, 1 << 16, 4, 1 << 20, 3);
+    REQUIRE(system("rm -rf /tmp/sst && mkdir /tmp/sst") == 0);
+    auto store = new ParallelKVStore(config);
+    store->add("00000000", "old");
+    store->add("99999999", "old");
+
+    auto key = [](int i) {
+      char key[16];
+      snprintf(key, sizeof(key), "%08d", i);
+      return string(key);
+    };
+
+    SSTWriter writer(config, "/tmp/sst");
+    for (int i = 0; i < 20000; i++) {
+      writer.add(key(i), "a" + to_string(i));
+    }
+    REQUIRE_THROWS_AS(writer.add(key(0), "a"), const std::invalid_argument &);
+    store->ingest_files(writer.finish());
+    REQUIRE (ls("/tmp/sst").empty());
+
+    // Ingested values are newer than the ones in the store
+    for (int i = 0; i < 20000; i++) {
+      REQUIRE (*store->get(key(i)).get() == "a" + to_string(i));
+    }
+    REQUIRE (*store->get("99999999").get() == "old");
+
+    // Tables mixing partitions are split, overlapping ones shadow the earlier ones
+    auto builder = TableBuilder(1 << 20, "/tmp/sst");
+    for (int i = 1000; i < 2000; i++) {
+      REQUIRE (builder.add(key(i), (i % 2) ? "b" : ""));
+    }
+    store->ingest_files({builder.finalize()->path()});
+    REQUIRE (ls("/tmp/sst").empty());
+
+    // Tables referencing values of a value log are refused, whether they are split or not
+    for (int end : {1001, 2000}) {
+      for (int i = 1000; i < end; i++) {
+        REQUIRE (builder.add(key(i), "pointer", true));
+      }
+      auto path = builder.finalize()->path();
+      REQUIRE_THROWS_AS(store->ingest_files({path}), const invalid_argument &);
+      REQUIRE (ls("/tmp/sst").size() == 1);
+      delete_file(path);
+    }
+
+    delete store;
+    store = new ParallelKVStore(config);
+    for (int i = 0; i < 20000; i++) {
+      auto value = store->get(key(i)).get();
+      if (i < 1000 || i >= 2000) {
+        REQUIRE (*value == "a" + to_string(i));
+      } else if (i % 2) {
+        REQUIRE (*value == "b");
+      } else {
+        REQUIRE (value == nullptr);
+      }
+    }
+    REQUIRE (store->verify());
+
+    store->destroy();
+    delete store;
+    REQUIRE(system("rm -rf /tmp/sst") == 0);
+  }
+
+  SECTION( "Bulk loading" ) {
+    Config config("db", "/tmp/", 4, 1 << 16, 4, 1 << 20, 3);
+    REQUIRE(system("rm -rf /tmp/bulk && mkdir /tmp/bulk") == 0);
+    auto store = new ParallelKVStore(config);
+    store->add("00000000", "old");
+
+    auto key = [](int i) {
+      char key[16];
+      snprintf(key, sizeof(key), "%08d", i);
+      return string(key);
+    };
+
+    // Small batches spill many runs, later values replace earlier ones
+    BulkLoader loader(config, "/tmp/bulk", 1 << 16, 2);
+    map<string, string> truth;
+    default_random_engine generator(42);
+    uniform_int_distribution<int> distribution(0, 9999);
+    for (int i = 0; i < 30000; i++) {
+      auto k = key(distribution(generator));
+      auto value = (i % 7) ? "v" + to_string(i) : "";
+      loader.add(k, value);
+      truth[k] = value;
+    }
+    REQUIRE (loader.entries() == 30000);
+
+    auto tables = loader.finish();
+    REQUIRE (loader.runs() > 10);
+    REQUIRE (ls("/tmp/bulk").size() == tables.size());
+    store->ingest_files(tables);
+    REQUIRE (ls("/tmp/bulk").empty());
+
+    for (int i = 0; i < 10000; i++) {
+      auto value = store->get(key(i)).get();
+      auto item = truth.find(key(i));
+      if (item != truth.end() && !item->second.empty()) {
+        REQUIRE (*value == item->second);
+      } else if (item == truth.end() && i == 0) {
+        REQUIRE (*value == "old");
+      } else {
+        REQUIRE (value == nullptr);
+      }
+    }
+    REQUIRE (store->verify());
+
+    store->destroy();
+    delete store;
+    REQUIRE(system("rm -rf /tmp/bulk") == 0);
+  }
+
+  SECTION( "Scans" ) {
+    Config config("db", "/tmp/", 4, 1 << 12, 2, 1 << 12, 3);
+    config.filter_bits_per_key = 10;
+    config.prefix_extractor = PrefixExtractor::delimited(':');
+    config.range_filters = true;
+    auto store = new ParallelKVStore(config);
+
+    // Objects of even tenants are rewritten and deleted over time
+    map<string, string> truth;
+    default_random_engine generator(42);
+    uniform_int_distribution<int> distribution(0, 49);
+    for (int i = 0; i < 20000; i++) {
+      auto key = object_key(2*distribution(generator), distribution(generator), i % 3);
+      if (i % 5 == 0) {
+        store->remove(key);
+        truth.erase(key);
+      } else {
+        store->add(key, "v" + to_string(i));
+        truth[key] = "v" + to_string(i);
+      }
+    }
+
+    auto expected = [&truth](const string &start, const string &end) {
+      return entry_list(truth.lower_bound(start), end.empty() ? truth.end() : truth.lower_bound(end));
+    };
+
+    for (int reopen = 0; reopen < 2; reopen++) {
+      if (reopen) {
+        delete store;
+        store = new ParallelKVStore(config);
+      }
+
+      for (int tenant = 0; tenant < 100; tenant++) {
+        auto prefix = "t" + to_string(tenant) + ":";
+        REQUIRE (store->scan_prefix(prefix) == expected(prefix, ScanRange::successor(prefix)));
+      }
+
+      auto objects = expected("t42:o1:", "t42:o1;");
+      REQUIRE (!objects.empty());
+      REQUIRE (store->scan_prefix("t42:o1:") == objects);
+      auto tenant = expected("t42:", "t42;");
+      REQUIRE (store->scan_prefix("t42:", 2) == entry_list(tenant.begin(), tenant.begin() + 2));
+
+      // Ranges span partitions
+      REQUIRE (store->scan("t10:", "t12:") == expected("t10:", "t12:"));
+      REQUIRE (store->scan("t10:", "t12:", 10) == entry_list(truth.lower_bound("t10:"), next(truth.lower_bound("t10:"), 10)));
+      REQUIRE (store->scan("", "") == expected("", ""));
+
+      // Short ranges, mostly of fields that were never written
+      for (int object = 0; object < 50; object++) {
+        auto start = object_key(42, object, 1), end = object_key(42, object, 5);
+        REQUIRE (store->scan(start, end) == expected(start, end));
+      }
+    }
+
+    // Keys would be looked up in other partitions with another prefix extractor
+    delete store;
+    auto other_config = config;
+    other_config.prefix_extractor = PrefixExtractor::delimited(':', 2);
+    REQUIRE_THROWS_AS(new ParallelKVStore(other_config), const invalid_argument &);
+    store = new ParallelKVStore(config);
+    REQUIRE (store->scan_prefix("t42:") == expected("t42:", "t42;"));
+
+    store->destroy();
+    delete store;
+  }
+
+  SECTION( "Asynchronous reads" ) {
+    Config config("db", "/tmp/", 4, 1 << 20, 17, 1 << 20, 2);
+    config.io_backend = PREAD_IO;
+    config.block_cache_size = 1 << 18;
+    config.async_reads = true;
+    vector<tuple<string, string>> kv;
+    map<string, string> truth;
+    tie(kv, truth) = create_random_data(20000, false, 16);
+
+    auto store = new ParallelKVStore(config);
+    for (const auto &item : kv) {
+      store->add(get<0>(item), get<1>(item));
+    }
+    delete store;
+
+    // Gets are all queued before any of them completes
+    store = new ParallelKVStore(config);
+    vector<future<shared_ptr<Buffer>>> results;
+    for (const auto &item : truth) {
+      results.push_back(store->get(item.first));
+    }
+
+    auto it = truth.begin();
+    for (auto &result : results) {
+      REQUIRE(*result.get() == (it++)->second);
+    }
+
+    store->destroy();
+    delete store;
+  }
+
+  SECTION( "I/O errors" ) {
+    Config config("db", "/tmp/", 4, 1 << 20, 17, 1 << 20, 1);
+    config.io_backend = PREAD_IO;
+    auto kv = create_random_kv(20000, false, 16);
+
+    auto store = new ParallelKVStore(config);
+    for (const auto &item : kv) {
+      store->add(get<0>(item), get<1>(item));
+    }
+    delete store;
+
+    // Reads past the end of the truncated tables fail, the gets report it
+    store = new ParallelKVStore(config);
+    auto partition = Config::create_partition(config, 0);
+    for (const auto &level : partition.levels) {
+      for (const auto &name : ls(level.path_level)) {
+        REQUIRE(truncate(path_append(level.path_level, name).c_str(), 0) == 0);
+      }
+    }
+    REQUIRE_THROWS_AS(store->get(get<0>(kv[0])).get(), const system_error &);
+
+    store->destroy();
+    delete store;
+  }
+
   SECTION( "Multiple Clients Read Benchmark" ) {
     for (int cores = 1; cores <= num_cores/2; cores <<= 1) {
       Config config("db", "/tmp/", 4, 1 << 23, 17, 1 << 20, cores);